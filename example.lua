@@ -1,8 +1,98 @@
 require("spoof")
 
-spoof.SetEnabled(true)
-spoof.SetPlayerCount(20)
+-- after a map change or restart the last configuration, players and bans are
+-- already active again, only set them up on a cold start
+if not spoof.IsRestored() then
+	spoof.SetEnabled(true)
+	spoof.SetPlayerCount(20)
 
-spoof.ResetPlayers()
-spoof.AddPlayer("Matt", 10, 300);
-spoof.AddPlayer("Alex", 20, 100);
\ No newline at end of file
+	spoof.ResetPlayers()
+	spoof.AddPlayer("Matt", 10, 300);
+	spoof.AddPlayer("Alex", 20, 100);
+	-- master servers and listing sites get their own answers
+	local listing = spoof.AddRequesterClass("listing")
+	spoof.AddRequesterRange(listing, "208.64.200.0/24")
+	spoof.SetPlayerCount(30, listing)
+	spoof.AddPlayer("Sam", 5, 600, listing)
+end
+
+-- dedicate CPU 3 to the packet receiver and spin for 50us before blocking
+spoof.SetReceiverAffinity({3})
+spoof.SetReceiverPriority("fifo", 10, 0)
+spoof.SetLowLatencyMode(true, 50, 50)
+spoof.SetWakeupLatencyTracking(true)
+
+-- capture 1 in 100 A2S_INFO queries
+spoof.SetPacketSampling("rate", 100, {types = {"info"}, oob = "T"})
+timer.Create("spoof_samples", 10, 0, function()
+	for _, sample in ipairs(spoof.GetPacketSamples(16)) do
+		print(sample.ip, sample.port, sample.length, sample.type, sample.oob)
+	end
+end)
+
+-- ban sources sending 20 invalid packets within 5 seconds for 10 minutes
+spoof.SetBanThreshold(20, 5)
+spoof.SetBanDuration(600)
+spoof.AddBan("203.0.113.7", 3600)
+for _, ban in ipairs(spoof.GetBans()) do
+	print(ban.ip, ban.remaining, ban.hits)
+end
+spoof.ClearBans("203.0.113.7")
+
+-- forward a resent challenge request or connect from the same ip:port once per 500ms
+spoof.SetHandshakeCoalescing(500)
+print(spoof.GetCoalescedHandshakes() .. " duplicate handshakes dropped")
+
+-- share bans with the other servers on this host
+local ok, err = spoof.AttachSharedMemory("/gmsv_spoof")
+if not ok then
+	print("shared memory unavailable: " .. err)
+end
+for _, instance in ipairs(spoof.GetSharedStats()) do
+	print(instance.pid, instance.port, instance.received, instance.banned)
+end
+
+-- every engine UDP socket is filtered, SourceTV queries are left to the engine by default
+for _, socket in ipairs(spoof.GetSocketStats()) do
+	print(socket.index, socket.port, socket.queued, socket.received, socket.invalid)
+end
+spoof.SetSocketQueryCaching(27020, false)
+
+-- classify and answer queries on 4 threads, sharded by source address
+spoof.SetWorkerCount(4)
+print(spoof.GetWorkerStats().dropped .. " packets dropped by full workers")
+
+-- at most 2 MB/s and 5000 replies/s of cached A2S replies, past that only challenges,
+-- clients that come back with a valid one are answered regardless
+spoof.SetEgressBudget(2 * 1024 * 1024, 5000, 200, "challenge")
+local egress = spoof.GetEgressStats()
+print(egress.bytes_in, egress.bytes_out, egress.amplification, egress.challenges)
+
+-- publish counters and latency histograms every 500 ms for statsreader
+local opened, err = spoof.OpenStatsPage("/dev/shm/spoof.stats", 500)
+if not opened then
+	print("stats page unavailable: " .. err)
+end
+
+-- who is sending the most A2S_INFO queries, by address and by /24
+spoof.SetHeavyHitterTracking(true, 10)
+for _, hitter in ipairs(spoof.GetHeavyHitters("info", 5)) do
+	print(hitter.ip, hitter.pps, hitter.bps)
+end
+for _, hitter in ipairs(spoof.GetHeavyHitters("info", 5, true)) do
+	print(hitter.ip, hitter.pps, hitter.bps)
+end
+
+-- one batch per tick: { kind, ip, port, detail, kind, ip, port, detail, ... }
+spoof.SetEventCallback(function(events, overflow)
+	for i = 1, #events, 4 do
+		local kind, ip, port, detail = events[i], events[i + 1], events[i + 2], events[i + 3]
+		if kind == "rejected" then
+			print("rejected " .. ip .. ":" .. port .. " (" .. detail .. ")")
+		end
+	end
+
+	if overflow > 0 then
+		print(overflow .. " events were dropped")
+	end
+end, 2048)
@@ -20,3 +20,45 @@ CreateWorkspace({name = "spoof", abi_compatible = true})
 			"../source/netfilter/*.cpp",
 			"../source/netfilter/*.hpp"
 		})
+
+		filter("system:linux")
+			-- shm_open lives in librt on older glibc
+			links({"rt"})
+
+		filter({})
+
+	-- hot path microbenchmarks, the kernels run against synthetic engine state
+	project("benchmark")
+		kind("ConsoleApp")
+		language("C++")
+		IncludeSDKCommon()
+		IncludeSDKTier0()
+		IncludeSDKTier1()
+		includedirs({"../source"})
+		files({
+			"../source/benchmark/*.cpp",
+			"../source/benchmark/*.hpp",
+			"../source/netfilter/classify.cpp",
+			"../source/netfilter/reply.cpp",
+			"../source/netfilter/sampling.cpp",
+			"../source/netfilter/workers.cpp"
+		})
+
+	if os.istarget("linux") then
+		-- loopback stress testing tool, uses sendmmsg/recvmmsg
+		project("loadgen")
+			kind("ConsoleApp")
+			language("C++")
+			files({"../source/tools/loadgen.cpp"})
+			links({"pthread"})
+
+		-- prints the memory mapped stats page, or converts it for Prometheus
+		project("statsreader")
+			kind("ConsoleApp")
+			language("C++")
+			includedirs({"../source"})
+			files({
+				"../source/tools/statsreader.cpp",
+				"../source/netfilter/statspage.hpp"
+			})
+	end
@@ -0,0 +1,100 @@
+#include <benchmark/baseline.hpp>
+#include <bitbuf.h>
+#include <Platform.hpp>
+
+namespace benchmark
+{
+	namespace baseline
+	{
+
+#if defined SYSTEM_WINDOWS
+
+		static const char operating_system_char = 'w';
+
+#elif defined SYSTEM_LINUX
+
+		static const char operating_system_char = 'l';
+
+#elif defined SYSTEM_MACOSX
+
+		static const char operating_system_char = 'm';
+
+#endif
+
+		static const uint8_t default_proto_version = 17;
+
+		size_t WriteInfoReply(
+			bf_write &packet,
+			const netfilter::reply_info_t &info,
+			const netfilter::reply_state_t &state
+		)
+		{
+			packet.Reset( );
+
+			packet.WriteLong( -1 ); // connectionless packet header
+			packet.WriteByte( 'I' ); // packet type is always 'I'
+			packet.WriteByte( default_proto_version );
+			packet.WriteString( state.name );
+			packet.WriteString( state.map );
+			packet.WriteString( info.game_dir.c_str( ) );
+			packet.WriteString( info.game_desc.c_str( ) );
+			packet.WriteShort( state.appid );
+
+			size_t players_offset = packet.GetNumBytesWritten( );
+			packet.WriteByte( state.players );
+			packet.WriteByte( state.max_players );
+			packet.WriteByte( state.bots );
+			packet.WriteByte( 'd' ); // dedicated server identifier
+			packet.WriteByte( operating_system_char );
+			packet.WriteByte( state.password ? 1 : 0 );
+			packet.WriteByte( state.secure ? 1 : 0 );
+			packet.WriteString( info.game_version.c_str( ) );
+
+			bool notags = info.tags.empty( );
+			packet.WriteByte( 0x80 | 0x10 | ( notags ? 0x00 : 0x20 ) | 0x01 );
+			packet.WriteShort( info.udp_port );
+			packet.WriteLongLong( state.steamid );
+			if( !notags )
+				packet.WriteString( info.tags.c_str( ) );
+			packet.WriteLongLong( state.appid );
+
+			return players_offset;
+		}
+
+		int32_t WritePlayerReply(
+			bf_write &packet,
+			netfilter::player_table &game_players,
+			uint32_t elapsed
+		)
+		{
+			packet.Reset( );
+			packet.WriteLong( -1 );
+			packet.WriteByte( 'D' );
+			packet.WriteByte( game_players.count );
+
+			int32_t written = 0;
+			for( int i = 0; i < game_players.count; i++ )
+			{
+				game_players.players[i].time += elapsed / 1000.0;
+
+				const netfilter::player_t &player = game_players.players[i];
+
+				// index + name + null terminator + score + time
+				int needed = 1 + static_cast<int>( player.name.size( ) ) + 1 + 4 + 4;
+				if( packet.GetNumBytesLeft( ) < needed )
+					continue;
+
+				packet.WriteByte( written );
+				packet.WriteString( player.name.c_str( ) );
+				packet.WriteLong( player.score );
+				packet.WriteFloat( player.time );
+				++written;
+			}
+
+			if( written != game_players.count )
+				packet.GetData( )[5] = static_cast<unsigned char>( written );
+
+			return written;
+		}
+	}
+}
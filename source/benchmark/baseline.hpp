@@ -0,0 +1,25 @@
+#pragma once
+
+#include <netfilter/reply.hpp>
+
+class bf_write;
+
+namespace benchmark
+{
+	// The bf_write based serializers the module used before netfilter::a2s::Writer,
+	// kept byte for byte so the two can be compared on the same inputs.
+	namespace baseline
+	{
+		size_t WriteInfoReply(
+			bf_write &packet,
+			const netfilter::reply_info_t &info,
+			const netfilter::reply_state_t &state
+		);
+
+		int32_t WritePlayerReply(
+			bf_write &packet,
+			netfilter::player_table &players,
+			uint32_t elapsed
+		);
+	}
+}
@@ -0,0 +1,660 @@
+// Microbenchmarks for the hot path kernels of the module, run in isolation
+// against synthetic engine state instead of a live server.
+//
+// usage: benchmark [-t milliseconds per benchmark] [-f name filter] [-o results.json]
+
+#include <benchmark/baseline.hpp>
+#include <netfilter/a2s.hpp>
+#include <netfilter/classify.hpp>
+#include <netfilter/queue.hpp>
+#include <netfilter/reply.hpp>
+#include <netfilter/sampling.hpp>
+#include <netfilter/workers.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <bitbuf.h>
+#include <dbg.h>
+
+namespace benchmark
+{
+	static std::atomic<uint64_t> allocations( 0 );
+	static std::atomic<uint64_t> allocated_bytes( 0 );
+
+	struct result_t
+	{
+		std::string name;
+		std::string params;
+		uint64_t iterations;
+		double ns_per_op;
+		double allocs_per_op;
+		double bytes_per_op;
+	};
+
+	static double min_time = 0.25; // seconds
+	static const char *filter = nullptr;
+	static std::vector<result_t> results;
+
+	// Doubles the iteration count until a run takes at least min_time.
+	template<typename Function>
+	static void Run( const char *name, const std::string &params, Function op )
+	{
+		std::string full_name = std::string( name ) + "/" + params;
+		if( filter != nullptr && full_name.find( filter ) == std::string::npos )
+			return;
+
+		for( uint32_t k = 0; k < 16; ++k )
+			op( );
+
+		uint64_t iterations = 1;
+		while( true )
+		{
+			uint64_t allocs = allocations, bytes = allocated_bytes;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now( );
+			for( uint64_t k = 0; k < iterations; ++k )
+				op( );
+
+			double elapsed = std::chrono::duration<double>(
+				std::chrono::steady_clock::now( ) - start
+			).count( );
+			if( elapsed >= min_time || iterations >= ( 1ULL << 40 ) )
+			{
+				result_t result;
+				result.name = name;
+				result.params = params;
+				result.iterations = iterations;
+				result.ns_per_op = elapsed * 1000000000.0 / iterations;
+				result.allocs_per_op = static_cast<double>( allocations - allocs ) / iterations;
+				result.bytes_per_op = static_cast<double>( allocated_bytes - bytes ) / iterations;
+				results.push_back( result );
+
+				printf(
+					"%-48s %12.1f ns/op %8.2f allocs/op %10.1f B/op\n",
+					full_name.c_str( ),
+					result.ns_per_op,
+					result.allocs_per_op,
+					result.bytes_per_op
+				);
+				return;
+			}
+
+			iterations *= elapsed > 0.0 && elapsed * 10.0 < min_time ? 10 : 2;
+		}
+	}
+
+	// ClassifyPacket logs bad packets, which would dominate the measurements
+	static SpewRetval_t SilentSpew( SpewType_t, const tchar * )
+	{
+		return SPEW_CONTINUE;
+	}
+
+	static netfilter::reply_info_t MakeReplyInfo( )
+	{
+		netfilter::reply_info_t info;
+		info.game_dir = "garrysmod";
+		info.game_version = "16.12.01";
+		info.game_desc = "Garry's Mod";
+		info.max_clients = 128;
+		info.udp_port = 27015;
+		info.tags = " gm:sandbox gmws:123456789";
+		return info;
+	}
+
+	static netfilter::reply_state_t MakeReplyState( )
+	{
+		netfilter::reply_state_t state;
+		state.name = "Benchmark Server | Sandbox | Fast Downloads";
+		state.map = "gm_construct";
+		state.appid = 4000;
+		state.players = 42;
+		state.max_players = 128;
+		state.bots = 0;
+		state.password = false;
+		state.secure = true;
+		state.steamid = 90071992547409920ULL;
+		return state;
+	}
+
+	static netfilter::player_table MakePlayers( size_t count, size_t name_length )
+	{
+		netfilter::player_table table;
+		table.players.resize( count );
+		table.count = static_cast<uint8_t>( count );
+		for( size_t k = 0; k < count; ++k )
+		{
+			netfilter::player_t &player = table.players[k];
+			player.index = static_cast<uint8_t>( k );
+			player.name.assign( name_length, static_cast<char>( 'a' + k % 26 ) );
+			player.score = static_cast<double>( k * 7 );
+			player.time = static_cast<double>( k * 60 );
+		}
+
+		return table;
+	}
+
+	// Both serializers have to produce the same bytes for the comparison to mean anything.
+	static bool SameReply( const netfilter::a2s::Writer &writer, bf_write &legacy )
+	{
+		return writer.GetSize( ) == static_cast<size_t>( legacy.GetNumBytesWritten( ) ) &&
+			memcmp( writer.GetData( ), legacy.GetData( ), writer.GetSize( ) ) == 0;
+	}
+
+	static void BenchmarkReplyInfo( )
+	{
+		static char buffer[1024], legacy_buffer[1024];
+		netfilter::a2s::Writer packet( buffer, sizeof( buffer ) );
+		bf_write legacy( legacy_buffer, sizeof( legacy_buffer ) );
+		netfilter::reply_info_t info = MakeReplyInfo( );
+		netfilter::reply_state_t state = MakeReplyState( );
+		netfilter::reply_cache_t cache;
+
+		netfilter::WriteInfoReply( packet, info, state );
+		baseline::WriteInfoReply( legacy, info, state );
+		if( !SameReply( packet, legacy ) )
+			fprintf( stderr, "A2S_INFO replies differ between a2s and bf_write\n" );
+
+		Run( "BuildReplyInfo", "serialize,bf_write", [&]( )
+		{
+			baseline::WriteInfoReply( legacy, info, state );
+		} );
+
+		Run( "BuildReplyInfo", "serialize,a2s", [&]( )
+		{
+			netfilter::WriteInfoReply( packet, info, state );
+		} );
+
+		Run( "BuildReplyInfo", "serialize+fragment", [&]( )
+		{
+			netfilter::WriteInfoReply( packet, info, state );
+			netfilter::BuildReplyFragments( packet, cache );
+		} );
+	}
+
+	static void BenchmarkPlayerInfo( )
+	{
+		static char buffer[netfilter::split_packet_max_payload * netfilter::split_packet_max_fragments];
+		static char legacy_buffer[sizeof( buffer )];
+		netfilter::a2s::Writer packet( buffer, sizeof( buffer ) );
+		bf_write legacy( legacy_buffer, sizeof( legacy_buffer ) );
+		netfilter::reply_cache_t cache;
+
+		static const size_t player_counts[] = { 0, 1, 16, 64, 128, 255 };
+		static const size_t name_lengths[] = { 8, 32, 64 };
+		for( size_t c = 0; c < sizeof( player_counts ) / sizeof( *player_counts ); ++c )
+			for( size_t n = 0; n < sizeof( name_lengths ) / sizeof( *name_lengths ); ++n )
+			{
+				netfilter::player_table players = MakePlayers( player_counts[c], name_lengths[n] );
+
+				netfilter::player_table legacy_players = players;
+				netfilter::WritePlayerReply( packet, players, 0 );
+				baseline::WritePlayerReply( legacy, legacy_players, 0 );
+				if( !SameReply( packet, legacy ) )
+					fprintf(
+						stderr,
+						"A2S_PLAYER replies differ between a2s and bf_write (%u players)\n",
+						static_cast<uint32_t>( player_counts[c] )
+					);
+
+				char params[64];
+				snprintf(
+					params,
+					sizeof( params ),
+					"players=%u,name=%u",
+					static_cast<uint32_t>( player_counts[c] ),
+					static_cast<uint32_t>( name_lengths[n] )
+				);
+
+				Run( "BuildPlayerInfo", std::string( "bf_write," ) + params, [&]( )
+				{
+					baseline::WritePlayerReply( legacy, legacy_players, 1000 );
+				} );
+
+				Run( "BuildPlayerInfo", std::string( "a2s," ) + params, [&]( )
+				{
+					netfilter::WritePlayerReply( packet, players, 1000 );
+				} );
+
+				Run( "BuildPlayerInfo", std::string( "a2s+fragment," ) + params, [&]( )
+				{
+					netfilter::WritePlayerReply( packet, players, 1000 );
+					netfilter::BuildReplyFragments( packet, cache );
+				} );
+			}
+	}
+
+	enum OOBKind
+	{
+		OOBNetchan,
+		OOBInfo,
+		OOBPlayer,
+		OOBHandshake,
+		OOBChallenge,
+		OOBMalformed,
+		OOBKindCount
+	};
+
+	struct distribution_t
+	{
+		const char *name;
+		uint32_t weights[OOBKindCount];
+	};
+
+	static std::vector<char> MakePacket( OOBKind kind, uint32_t seed )
+	{
+		std::vector<char> packet;
+		int32_t header = -1;
+		switch( kind )
+		{
+		case OOBNetchan:
+			header = static_cast<int32_t>( seed & 0x7FFFFFFF );
+			packet.resize( 64 + seed % 128 );
+			break;
+
+		case OOBInfo:
+			packet.resize( 25 );
+			packet[4] = 'T';
+			memcpy( &packet[5], "Source Engine Query", 20 );
+			break;
+
+		case OOBPlayer:
+			packet.resize( 9, '\xFF' );
+			packet[4] = 'U';
+			break;
+
+		case OOBHandshake:
+			packet.resize( 20, '0' );
+			packet[4] = seed % 2 == 0 ? 'q' : 'k';
+			break;
+
+		case OOBChallenge:
+			packet.resize( 5 );
+			packet[4] = 'W';
+			break;
+
+		case OOBMalformed:
+		default:
+			header = seed % 2 == 0 ? -2 : -1;
+			packet.resize( 5 + seed % 200, 'A' );
+			packet[4] = 'z';
+			break;
+		}
+
+		memcpy( &packet[0], &header, sizeof( header ) );
+		return packet;
+	}
+
+	static void BenchmarkClassify( )
+	{
+		static const distribution_t distributions[] = {
+			{ "netchan", { 100, 0, 0, 0, 0, 0 } },
+			{ "queries", { 0, 70, 30, 0, 0, 0 } },
+			{ "handshakes", { 0, 0, 0, 100, 0, 0 } },
+			{ "mixed", { 60, 15, 5, 5, 10, 5 } },
+			{ "malformed", { 0, 0, 0, 0, 0, 100 } }
+		};
+
+		sockaddr_in from;
+		memset( &from, 0, sizeof( from ) );
+		from.sin_family = AF_INET;
+		from.sin_addr.s_addr = htonl( 0x7F000001 );
+
+		for( size_t d = 0; d < sizeof( distributions ) / sizeof( *distributions ); ++d )
+		{
+			const distribution_t &distribution = distributions[d];
+			uint32_t total = 0;
+			for( size_t k = 0; k < OOBKindCount; ++k )
+				total += distribution.weights[k];
+
+			// fixed seed so every run classifies the same packets
+			uint32_t state = 2463534242U;
+			std::vector< std::vector<char> > packets( 1024 );
+			for( size_t k = 0; k < packets.size( ); ++k )
+			{
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+
+				uint32_t pick = state % total;
+				size_t kind = 0;
+				while( pick >= distribution.weights[kind] )
+					pick -= distribution.weights[kind++];
+
+				packets[k] = MakePacket( static_cast<OOBKind>( kind ), state );
+			}
+
+			size_t next = 0;
+			Run( "ClassifyPacket", distribution.name, [&]( )
+			{
+				const std::vector<char> &packet = packets[next++ & 1023];
+				netfilter::ClassifyPacket(
+					&packet[0], static_cast<int32_t>( packet.size( ) ), from, true
+				);
+			} );
+		}
+	}
+
+	static void BenchmarkQueue( )
+	{
+		static const size_t sizes[] = { 64, 1200 };
+		for( size_t k = 0; k < sizeof( sizes ) / sizeof( *sizes ); ++k )
+		{
+			netfilter::PacketQueue queue( 1000 );
+			netfilter::packet_t packet, popped;
+			packet.buffer.resize( sizes[k] );
+
+			char params[32];
+			snprintf( params, sizeof( params ), "bytes=%u", static_cast<uint32_t>( sizes[k] ) );
+
+			Run( "PacketQueue", std::string( "push+pop," ) + params, [&]( )
+			{
+				queue.Push( packet );
+				queue.Pop( popped );
+			} );
+		}
+	}
+
+	static void BenchmarkSampling( )
+	{
+		sockaddr_in from;
+		memset( &from, 0, sizeof( from ) );
+		from.sin_family = AF_INET;
+
+		netfilter::sampling::filter_t filter;
+		std::vector<netfilter::sampling::sample_t> samples;
+
+		static const uint32_t rates[] = { 1, 100, 10000 };
+		static const size_t sizes[] = { 64, 1200 };
+		for( size_t k = 0; k < sizeof( sizes ) / sizeof( *sizes ); ++k )
+		{
+			std::vector<char> data( sizes[k], 'x' );
+
+			for( size_t r = 0; r < sizeof( rates ) / sizeof( *rates ); ++r )
+			{
+				char params[64];
+				snprintf(
+					params,
+					sizeof( params ),
+					"rate=%u,bytes=%u",
+					rates[r],
+					static_cast<uint32_t>( sizes[k] )
+				);
+
+				netfilter::sampling::Configure( netfilter::sampling::ModeRate, rates[r], filter );
+				Run( "Sampling", params, [&]( )
+				{
+					netfilter::sampling::Sample(
+						from, &data[0], static_cast<int32_t>( data.size( ) ), netfilter::PacketTypeGood
+					);
+				} );
+			}
+
+			char params[64];
+			snprintf( params, sizeof( params ), "reservoir,bytes=%u", static_cast<uint32_t>( sizes[k] ) );
+
+			netfilter::sampling::Configure( netfilter::sampling::ModeReservoir, 1, filter );
+			Run( "Sampling", params, [&]( )
+			{
+				netfilter::sampling::Sample(
+					from, &data[0], static_cast<int32_t>( data.size( ) ), netfilter::PacketTypeGood
+				);
+			} );
+
+			netfilter::sampling::Configure( netfilter::sampling::ModeDisabled, 1, filter );
+			netfilter::sampling::Drain( samples, netfilter::sampling::max_samples );
+			samples.clear( );
+		}
+	}
+
+	static std::atomic<uint64_t> worker_handled( 0 );
+	static netfilter::reply_info_t worker_reply_info;
+	static netfilter::reply_state_t worker_reply_state;
+
+	// Stand-in for the module's handler, classifies every packet and serializes a
+	// reply for each query, costing about what sending the cached one would.
+	static bool WorkerHandler( netfilter::packet_t &p )
+	{
+		// WritePlayerReply updates the play times, so every worker needs its own
+		static thread_local netfilter::player_table players = MakePlayers( 64, 32 );
+		static thread_local std::vector<char> reply(
+			netfilter::split_packet_max_payload * netfilter::split_packet_max_fragments
+		);
+
+		netfilter::PacketType type = netfilter::ClassifyPacket(
+			&p.buffer[0], static_cast<int32_t>( p.buffer.size( ) ), p.address, true
+		);
+		netfilter::a2s::Writer packet( &reply[0], reply.size( ) );
+		if( type == netfilter::PacketTypeInfo )
+			netfilter::WriteInfoReply( packet, worker_reply_info, worker_reply_state );
+		else if( type == netfilter::PacketTypePlayer )
+			netfilter::WritePlayerReply( packet, players, 0 );
+
+		++worker_handled;
+		return true;
+	}
+
+	// Throughput rather than latency, the receiver side dispatches batches for
+	// min_time and the clock stops once the workers went through all of them.
+	// It waits instead of overrunning the workers, the socket buffer does that
+	// in the module. 0 workers runs the handler on the dispatching thread.
+	static void BenchmarkWorkers( )
+	{
+		static const size_t worker_counts[] = { 0, 1, 2, 4, 8 };
+		static const size_t batch_size = 32;
+
+		worker_reply_info = MakeReplyInfo( );
+		worker_reply_state = MakeReplyState( );
+
+		// queries from many sources, like a reflection attack or a busy server browser
+		uint32_t state = 2463534242U;
+		std::vector<netfilter::packet_t> packets( 1024 );
+		for( size_t k = 0; k < packets.size( ); ++k )
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+
+			netfilter::packet_t &p = packets[k];
+			p.address.sin_family = AF_INET;
+			p.address.sin_addr.s_addr = htonl( state );
+			static const OOBKind kinds[] = { OOBNetchan, OOBInfo, OOBInfo, OOBPlayer };
+			p.buffer = MakePacket( kinds[state % 4], state );
+		}
+
+		for( size_t w = 0; w < sizeof( worker_counts ) / sizeof( *worker_counts ); ++w )
+		{
+			char params[32];
+			snprintf(
+				params, sizeof( params ), "workers=%u", static_cast<uint32_t>( worker_counts[w] )
+			);
+
+			std::string full_name = std::string( "WorkerPool/" ) + params;
+			if( filter != nullptr && full_name.find( filter ) == std::string::npos )
+				continue;
+
+			netfilter::WorkerPool pool( WorkerHandler, 1000 );
+			if( !pool.Start( worker_counts[w] ) )
+			{
+				fprintf( stderr, "failed to start %s\n", full_name.c_str( ) );
+				continue;
+			}
+
+			std::vector<netfilter::packet_t> batch;
+			batch.reserve( batch_size );
+			worker_handled = 0;
+
+			uint64_t dispatched = 0, allocs = allocations, bytes = allocated_bytes;
+			size_t next = 0;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now( );
+			double elapsed = 0.0;
+			do
+			{
+				while( dispatched - worker_handled >= worker_counts[w] * 500 + batch_size )
+					std::this_thread::yield( );
+
+				for( size_t k = 0; k < batch_size; ++k )
+					batch.push_back( packets[next++ & 1023] );
+
+				dispatched += batch.size( );
+				if( worker_counts[w] == 0 )
+				{
+					for( size_t k = 0; k < batch.size( ); ++k )
+						WorkerHandler( batch[k] );
+
+					batch.clear( );
+				}
+				else
+				{
+					pool.Dispatch( batch );
+				}
+
+				elapsed = std::chrono::duration<double>(
+					std::chrono::steady_clock::now( ) - start
+				).count( );
+			}
+			while( elapsed < min_time );
+
+			pool.Stop( );
+			elapsed = std::chrono::duration<double>(
+				std::chrono::steady_clock::now( ) - start
+			).count( );
+
+			uint64_t handled = worker_handled;
+			result_t result;
+			result.name = "WorkerPool";
+			result.params = params;
+			result.iterations = handled;
+			result.ns_per_op = handled != 0 ? elapsed * 1000000000.0 / handled : 0.0;
+			result.allocs_per_op =
+				handled != 0 ? static_cast<double>( allocations - allocs ) / handled : 0.0;
+			result.bytes_per_op =
+				handled != 0 ? static_cast<double>( allocated_bytes - bytes ) / handled : 0.0;
+			results.push_back( result );
+
+			printf(
+				"%-48s %12.1f ns/op %8.2f allocs/op %10.1f B/op %12.0f pps (%.1f%% dropped)\n",
+				full_name.c_str( ),
+				result.ns_per_op,
+				result.allocs_per_op,
+				result.bytes_per_op,
+				handled / elapsed,
+				dispatched != 0 ? 100.0 * ( dispatched - handled ) / dispatched : 0.0
+			);
+		}
+	}
+
+	static void EscapeJSON( FILE *file, const std::string &str )
+	{
+		for( size_t k = 0; k < str.size( ); ++k )
+		{
+			if( str[k] == '"' || str[k] == '\\' )
+				fputc( '\\', file );
+
+			fputc( str[k], file );
+		}
+	}
+
+	static bool WriteJSON( const char *path )
+	{
+		FILE *file = fopen( path, "w" );
+		if( file == nullptr )
+			return false;
+
+		fprintf( file, "[\n" );
+		for( size_t k = 0; k < results.size( ); ++k )
+		{
+			const result_t &result = results[k];
+			fprintf( file, "\t{ \"name\": \"" );
+			EscapeJSON( file, result.name );
+			fprintf( file, "\", \"params\": \"" );
+			EscapeJSON( file, result.params );
+			fprintf(
+				file,
+				"\", \"iterations\": %llu, \"ns_per_op\": %.3f, "
+				"\"allocs_per_op\": %.3f, \"bytes_per_op\": %.3f }%s\n",
+				static_cast<unsigned long long>( result.iterations ),
+				result.ns_per_op,
+				result.allocs_per_op,
+				result.bytes_per_op,
+				k + 1 < results.size( ) ? "," : ""
+			);
+		}
+
+		fprintf( file, "]\n" );
+		fclose( file );
+		return true;
+	}
+}
+
+void *operator new( size_t size )
+{
+	++benchmark::allocations;
+	benchmark::allocated_bytes += size;
+	void *ptr = malloc( size != 0 ? size : 1 );
+	if( ptr == nullptr )
+		throw std::bad_alloc( );
+
+	return ptr;
+}
+
+void *operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void operator delete( void *ptr ) throw( )
+{
+	free( ptr );
+}
+
+void operator delete[]( void *ptr ) throw( )
+{
+	free( ptr );
+}
+
+int main( int argc, char **argv )
+{
+	const char *output = nullptr;
+	for( int k = 1; k < argc; ++k )
+	{
+		if( strcmp( argv[k], "-t" ) == 0 && k + 1 < argc )
+			benchmark::min_time = atof( argv[++k] ) / 1000.0;
+		else if( strcmp( argv[k], "-f" ) == 0 && k + 1 < argc )
+			benchmark::filter = argv[++k];
+		else if( strcmp( argv[k], "-o" ) == 0 && k + 1 < argc )
+			output = argv[++k];
+		else
+		{
+			fprintf(
+				stderr,
+				"usage: %s [-t milliseconds per benchmark] [-f name filter] [-o results.json]\n",
+				argv[0]
+			);
+			return 1;
+		}
+	}
+
+	SpewOutputFunc( benchmark::SilentSpew );
+
+	benchmark::BenchmarkReplyInfo( );
+	benchmark::BenchmarkPlayerInfo( );
+	benchmark::BenchmarkClassify( );
+	benchmark::BenchmarkQueue( );
+	benchmark::BenchmarkSampling( );
+	benchmark::BenchmarkWorkers( );
+
+	if( output != nullptr && !benchmark::WriteJSON( output ) )
+	{
+		fprintf( stderr, "failed to write results to '%s'\n", output );
+		return 1;
+	}
+
+	return 0;
+}
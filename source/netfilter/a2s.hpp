@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace netfilter
+{
+	// Byte oriented serializer for the connectionless replies. Layouts are described
+	// at compile time as sections of fixed size fields, so a section costs a single
+	// capacity check followed by straight stores, while strings are memcpy'd with a
+	// length the caller already knows. Values are stored in host byte order, which is
+	// what the protocol wants on every platform srcds runs on (little endian).
+	namespace a2s
+	{
+		template<typename T>
+		struct Field
+		{
+			typedef T type;
+			static constexpr size_t size = sizeof( T );
+		};
+
+		typedef Field<uint8_t> Byte;
+		typedef Field<int16_t> Short;
+		typedef Field<int32_t> Long;
+		typedef Field<float> Float;
+		typedef Field<uint64_t> LongLong;
+
+		template<typename... Fields>
+		struct Section;
+
+		template<>
+		struct Section<>
+		{
+			static constexpr size_t size = 0;
+		};
+
+		template<typename First, typename... Rest>
+		struct Section<First, Rest...>
+		{
+			typedef First first;
+			typedef Section<Rest...> rest;
+			static constexpr size_t size = First::size + rest::size;
+		};
+
+		namespace layout
+		{
+			// A2S_INFO: connectionless header, 'I', protocol version
+			typedef Section<Long, Byte, Byte> InfoHeader;
+			// app id, players, max players, bots, server type, os, password, vac
+			typedef Section<Short, Byte, Byte, Byte, Byte, Byte, Byte, Byte> InfoDetails;
+			// extra data flags, port, server steamid
+			typedef Section<Byte, Short, LongLong> InfoExtra;
+			// 64 bits game id
+			typedef Section<LongLong> InfoGameID;
+
+			// split header (-2), sequence, total fragments, fragment number, split size
+			typedef Section<Long, Long, Byte, Byte, Short> SplitHeader;
+
+			// A2S_PLAYER: connectionless header, 'D', player count
+			typedef Section<Long, Byte, Byte> PlayerHeader;
+			typedef Section<Byte> PlayerIndex;
+			// score, connection time in seconds
+			typedef Section<Long, Float> PlayerStats;
+		}
+
+		class Writer
+		{
+		public:
+			Writer( void *data, size_t capacity ) :
+				begin( static_cast<char *>( data ) ),
+				cursor( static_cast<char *>( data ) ),
+				end( static_cast<char *>( data ) + capacity )
+			{ }
+
+			void Reset( )
+			{
+				cursor = begin;
+			}
+
+			// The only bounds check, every Put* after it assumes the space is there.
+			bool Reserve( size_t size ) const
+			{
+				return static_cast<size_t>( end - cursor ) >= size;
+			}
+
+			template<typename S>
+			bool Reserve( ) const
+			{
+				return Reserve( S::size );
+			}
+
+			// Stores one value per field of the section, converted to the field's type.
+			template<typename S, typename... Values>
+			void Put( Values... values )
+			{
+				static_assert(
+					sizeof...( Values ) == CountFields<S>::value,
+					"one value is needed per field of the section"
+				);
+				PutFields<S>( values... );
+			}
+
+			// Null terminated, len doesn't include the terminator.
+			void PutString( const char *str, size_t len )
+			{
+				memcpy( cursor, str, len );
+				cursor[len] = '\0';
+				cursor += len + 1;
+			}
+
+			char *GetData( ) const
+			{
+				return begin;
+			}
+
+			size_t GetSize( ) const
+			{
+				return static_cast<size_t>( cursor - begin );
+			}
+
+		private:
+			template<typename S>
+			struct CountFields
+			{
+				static constexpr size_t value = 1 + CountFields<typename S::rest>::value;
+			};
+
+			template<typename S>
+			void PutFields( )
+			{ }
+
+			template<typename S, typename Value, typename... Values>
+			void PutFields( Value value, Values... values )
+			{
+				typename S::first::type field = static_cast<typename S::first::type>( value );
+				memcpy( cursor, &field, sizeof( field ) );
+				cursor += sizeof( field );
+				PutFields<typename S::rest>( values... );
+			}
+
+			char *begin;
+			char *cursor;
+			char *end;
+		};
+
+		template<>
+		struct Writer::CountFields< Section<> >
+		{
+			static constexpr size_t value = 0;
+		};
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <Platform.hpp>
+
+#ifndef SYSTEM_MACOSX_BAD
+
+#include <atomic>
+
+#endif
+
+namespace netfilter
+{
+
+#ifdef SYSTEM_MACOSX_BAD
+
+	// Pray to the gods for guidance and hope this is enough.
+	class AtomicBool
+	{
+	public:
+		AtomicBool( bool v )
+		{
+			__sync_bool_compare_and_swap( &value, !v, v );
+		}
+
+		operator bool( ) const
+		{
+			return __sync_fetch_and_or( &value, 0 );
+		}
+
+		AtomicBool &operator =( bool v )
+		{
+			__sync_bool_compare_and_swap( &value, !v, v );
+			return *this;
+		}
+
+	private:
+		bool value;
+	};
+
+	// Only the sequentially consistent subset of std::atomic the module uses.
+	template<typename T>
+	class Atomic
+	{
+	public:
+		Atomic( T v = T( ) ) :
+			value( v )
+		{ }
+
+		T load( ) const
+		{
+			return __sync_fetch_and_add( const_cast<T *>( &value ), 0 );
+		}
+
+		void store( T v )
+		{
+			exchange( v );
+		}
+
+		T exchange( T v )
+		{
+			T old = value;
+			while( !__sync_bool_compare_and_swap( &value, old, v ) )
+				old = value;
+
+			return old;
+		}
+
+		bool compare_exchange_strong( T &expected, T desired )
+		{
+			T old = __sync_val_compare_and_swap( &value, expected, desired );
+			if( old == expected )
+				return true;
+
+			expected = old;
+			return false;
+		}
+
+		T fetch_add( T v )
+		{
+			return __sync_fetch_and_add( &value, v );
+		}
+
+		T fetch_sub( T v )
+		{
+			return __sync_fetch_and_sub( &value, v );
+		}
+
+		operator T( ) const
+		{
+			return load( );
+		}
+
+		Atomic &operator =( T v )
+		{
+			store( v );
+			return *this;
+		}
+
+	private:
+		volatile T value;
+	};
+
+#else
+
+	typedef std::atomic_bool AtomicBool;
+
+	template<typename T>
+	using Atomic = std::atomic<T>;
+
+	// 64 bit words pack two values updated together (handshakes, egress buckets,
+	// shared bans), a hidden lock would serialize every worker on them
+	static_assert(
+		ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+		"32 and 64 bit atomics must always be lock-free"
+	);
+
+#endif
+
+}
@@ -0,0 +1,251 @@
+#include <netfilter/bans.hpp>
+#include <netfilter/atomic.hpp>
+#include <netfilter/classify.hpp>
+#include <netfilter/wheel.hpp>
+#include <main.hpp>
+#include <string.h>
+#include <unordered_map>
+#include <threadtools.h>
+
+namespace netfilter
+{
+	namespace bans
+	{
+		// the wheel ticks once per second, so bans last up to 1s longer than asked
+		static const uint32_t tick_time = 1000;
+
+		// direct mapped, a colliding source just restarts the count
+		static const size_t strike_count = 4096;
+
+		struct strike_t
+		{
+			uint32_t address;
+			uint32_t window_start;
+			uint32_t count;
+		};
+
+		struct entry_t
+		{
+			uint32_t address;
+			uint32_t hits;
+		};
+
+		static Atomic<uint32_t> ban_threshold( 0 );
+		static uint32_t ban_window = 1000;
+		static uint32_t ban_duration = 60000;
+
+		static strike_t strikes[strike_count];
+
+		static Atomic<uint32_t> ban_count( 0 );
+		static entry_t entries[max_bans];
+		static std::vector<uint32_t> free_entries;
+		static std::unordered_map<uint32_t, uint32_t> entry_index;
+		static TimerWheel expiry_wheel( max_bans );
+		static uint32_t wheel_time = 0;
+		static bool wheel_started = false;
+		static CThreadFastMutex bans_mutex;
+
+		inline uint32_t HashAddress( uint32_t address )
+		{
+			return ( address * 0x9E3779B1U ) >> 20;
+		}
+
+		static void Release( uint32_t id )
+		{
+			expiry_wheel.Cancel( id );
+			entry_index.erase( entries[id].address );
+			free_entries.push_back( id );
+			--ban_count;
+		}
+
+		// Must be called with bans_mutex held.
+		static void Expire( uint32_t now )
+		{
+			if( !wheel_started )
+			{
+				wheel_time = now;
+				wheel_started = true;
+				return;
+			}
+
+			uint32_t ticks = ( now - wheel_time ) / tick_time;
+			if( ticks == 0 )
+				return;
+
+			wheel_time += ticks * tick_time;
+			expiry_wheel.Advance( expiry_wheel.GetTick( ) + ticks, Release );
+		}
+
+		static bool AddLocked( uint32_t address, uint32_t duration, uint32_t now )
+		{
+			Expire( now );
+
+			uint32_t id = 0;
+			std::unordered_map<uint32_t, uint32_t>::iterator it = entry_index.find( address );
+			if( it != entry_index.end( ) )
+			{
+				id = it->second;
+			}
+			else
+			{
+				if( free_entries.empty( ) )
+				{
+					if( ban_count.load( ) != 0 )
+						return false;
+
+					// first ban, build the free list lazily
+					free_entries.reserve( max_bans );
+					for( uint32_t k = max_bans; k > 0; --k )
+						free_entries.push_back( k - 1 );
+				}
+
+				id = free_entries.back( );
+				free_entries.pop_back( );
+				entry_index[address] = id;
+				entries[id].address = address;
+				entries[id].hits = 0;
+				++ban_count;
+			}
+
+			// counted from the start of the current tick, so round up what's left
+			uint32_t delay = duration + ( now - wheel_time );
+			expiry_wheel.Schedule(
+				id,
+				expiry_wheel.GetTick( ) + ( delay + tick_time - 1 ) / tick_time
+			);
+			return true;
+		}
+
+		void SetThreshold( uint32_t count, uint32_t window )
+		{
+			AUTO_LOCK( bans_mutex );
+			ban_window = window;
+			ban_threshold = count;
+			memset( strikes, 0, sizeof( strikes ) );
+		}
+
+		void GetThreshold( uint32_t &count, uint32_t &window )
+		{
+			AUTO_LOCK( bans_mutex );
+			count = ban_threshold;
+			window = ban_window;
+		}
+
+		void SetDuration( uint32_t duration )
+		{
+			AUTO_LOCK( bans_mutex );
+			ban_duration = duration;
+		}
+
+		uint32_t GetDuration( )
+		{
+			AUTO_LOCK( bans_mutex );
+			return ban_duration;
+		}
+
+		bool IsAutomatic( )
+		{
+			return ban_threshold.load( ) != 0;
+		}
+
+		bool HasBans( )
+		{
+			return ban_count.load( ) != 0;
+		}
+
+		bool IsBanned( uint32_t address, uint32_t now )
+		{
+			if( ban_count.load( ) == 0 )
+				return false;
+
+			AUTO_LOCK( bans_mutex );
+			Expire( now );
+
+			std::unordered_map<uint32_t, uint32_t>::iterator it = entry_index.find( address );
+			if( it == entry_index.end( ) )
+				return false;
+
+			++entries[it->second].hits;
+			return true;
+		}
+
+		bool RecordInvalid( uint32_t address, uint32_t now )
+		{
+			if( ban_threshold.load( ) == 0 )
+				return false;
+
+			AUTO_LOCK( bans_mutex );
+
+			strike_t &strike = strikes[HashAddress( address ) % strike_count];
+			if( strike.address != address || now - strike.window_start >= ban_window )
+			{
+				strike.address = address;
+				strike.window_start = now;
+				strike.count = 0;
+			}
+
+			if( ++strike.count < ban_threshold.load( ) )
+				return false;
+
+			strike.count = 0;
+			if( !AddLocked( address, ban_duration, now ) )
+			{
+				DebugWarning( "[spoof] Ban list is full, not banning another source\n" );
+				return false;
+			}
+
+			in_addr addr;
+			addr.s_addr = htonl( address );
+			char name[ip_string_size];
+			DebugWarning( "[spoof] Banned %s for %u seconds\n",
+				IPToString( addr, name, sizeof( name ) ), ban_duration / 1000 );
+			return true;
+		}
+
+		bool Add( uint32_t address, uint32_t duration, uint32_t now )
+		{
+			AUTO_LOCK( bans_mutex );
+			return AddLocked( address, duration, now );
+		}
+
+		bool Remove( uint32_t address )
+		{
+			AUTO_LOCK( bans_mutex );
+
+			std::unordered_map<uint32_t, uint32_t>::iterator it = entry_index.find( address );
+			if( it == entry_index.end( ) )
+				return false;
+
+			Release( it->second );
+			return true;
+		}
+
+		void Clear( )
+		{
+			AUTO_LOCK( bans_mutex );
+
+			while( !entry_index.empty( ) )
+				Release( entry_index.begin( )->second );
+		}
+
+		void List( std::vector<ban_t> &list, uint32_t now )
+		{
+			AUTO_LOCK( bans_mutex );
+			Expire( now );
+
+			list.reserve( list.size( ) + entry_index.size( ) );
+			for( std::unordered_map<uint32_t, uint32_t>::iterator it = entry_index.begin( );
+				it != entry_index.end( ); ++it )
+			{
+				const entry_t &entry = entries[it->second];
+				uint32_t ticks = expiry_wheel.GetExpiry( it->second ) - expiry_wheel.GetTick( );
+
+				ban_t ban;
+				ban.address = entry.address;
+				ban.remaining = ticks * tick_time - ( now - wheel_time );
+				ban.hits = entry.hits;
+				list.push_back( ban );
+			}
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Temporary bans of IPv4 sources (host byte order), either added by hand or
+	// automatically once a source sends too many invalid packets.
+	// Times are netfilter::clock milliseconds.
+	namespace bans
+	{
+		static const uint32_t max_bans = 16384;
+
+		struct ban_t
+		{
+			uint32_t address;
+			uint32_t remaining; // milliseconds
+			uint32_t hits; // packets dropped while banned
+		};
+
+		// A source is banned once it sends count invalid packets within window
+		// milliseconds, a count of 0 disables automatic bans.
+		void SetThreshold( uint32_t count, uint32_t window );
+		void GetThreshold( uint32_t &count, uint32_t &window );
+		void SetDuration( uint32_t duration );
+		uint32_t GetDuration( );
+		bool IsAutomatic( );
+
+		// Whether any ban is active, expired ones count until a lookup reaps them.
+		bool HasBans( );
+
+		// Cheap while the ban set is empty, rejected packets count as hits.
+		bool IsBanned( uint32_t address, uint32_t now );
+
+		// True when this packet got the source banned.
+		bool RecordInvalid( uint32_t address, uint32_t now );
+
+		bool Add( uint32_t address, uint32_t duration, uint32_t now );
+		bool Remove( uint32_t address );
+		void Clear( );
+		void List( std::vector<ban_t> &list, uint32_t now );
+	}
+}
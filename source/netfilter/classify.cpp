@@ -0,0 +1,155 @@
+#include <netfilter/classify.hpp>
+#include <main.hpp>
+#include <string.h>
+#include <stdlib.h>
+
+namespace netfilter
+{
+	const char *IPToString( const in_addr &addr, char *buffer, size_t size )
+	{
+		const char *str =
+			inet_ntop( AF_INET, const_cast<in_addr *>( &addr ), buffer, size );
+		if( str == nullptr )
+			return "unknown";
+
+		return str;
+	}
+
+	bool ParseCIDR( const char *cidr, uint32_t &network, uint32_t &mask )
+	{
+		char ip[16] = { 0 };
+		uint32_t prefix = 32;
+		const char *slash = strchr( cidr, '/' );
+		size_t iplen = slash != nullptr ? static_cast<size_t>( slash - cidr ) : strlen( cidr );
+		if( slash != nullptr )
+		{
+			// only digits, "a.b.c.d/" or a trailing typo must not turn into a /0
+			const char *digits = slash + 1;
+			if( *digits < '0' || *digits > '9' )
+				return false;
+
+			char *end = nullptr;
+			unsigned long value = strtoul( digits, &end, 10 );
+			if( *end != '\0' || value > 32 )
+				return false;
+
+			prefix = static_cast<uint32_t>( value );
+		}
+
+		if( iplen >= sizeof( ip ) || prefix > 32 )
+			return false;
+
+		in_addr address;
+		memcpy( ip, cidr, iplen );
+		if( inet_pton( AF_INET, ip, &address ) != 1 )
+			return false;
+
+		mask = prefix == 0 ? 0 : 0xFFFFFFFF << ( 32 - prefix );
+		network = ntohl( address.s_addr ) & mask;
+		return true;
+	}
+
+	PacketType ClassifyPacket(
+		const char *data,
+		int32_t len,
+		const sockaddr_in &from,
+		bool validate
+	)
+	{
+		char address[ip_string_size]; // only written when a packet is logged
+		if( len == 0 )
+		{
+			DebugWarning(
+				"[spoof] Bad OOB! len: %d from %s\n",
+				len,
+				IPToString( from.sin_addr, address, sizeof( address ) )
+			);
+			return PacketTypeInvalid;
+		}
+
+		if( len < 5 )
+			return PacketTypeGood;
+
+		int32_t channel = *reinterpret_cast<const int32_t *>( data );
+		if( channel == -2 )
+		{
+			DebugWarning(
+				"[spoof] Bad OOB! len: %d, channel: 0x%X from %s\n",
+				len,
+				channel,
+				IPToString( from.sin_addr, address, sizeof( address ) )
+			);
+			return PacketTypeInvalid;
+		}
+
+		if( channel != -1 )
+			return PacketTypeGood;
+
+		uint8_t type = *reinterpret_cast<const uint8_t *>( data + 4 );
+		if( validate )
+		{
+			switch( type )
+			{
+			case 'W': // server challenge request
+			case 's': // master server challenge
+				if( len > 100 )
+				{
+					DebugWarning(
+						"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
+						len,
+						channel,
+						type,
+						IPToString( from.sin_addr, address, sizeof( address ) )
+					);
+					return PacketTypeInvalid;
+				}
+
+				if( len >= 18 && strncmp( data + 5, "statusResponse", 14 ) == 0 )
+				{
+					DebugWarning(
+						"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
+						len,
+						channel,
+						type,
+						IPToString( from.sin_addr, address, sizeof( address ) )
+					);
+					return PacketTypeInvalid;
+				}
+
+				return PacketTypeGood;
+
+			case 'T': // server info request, resent with a challenge when asked for one
+				return ( len == 25 || len == 29 ) &&
+					strncmp( data + 5, "Source Engine Query", 19 ) == 0 ?
+					PacketTypeInfo : PacketTypeInvalid;
+
+			case 'U': // player info request
+				return PacketTypePlayer;
+			case 'V': // rules request
+				return len == 9 ? PacketTypeGood : PacketTypeInvalid;
+
+			case 'q': // connection handshake init
+			case 'k': // steam auth packet
+				DebugMsg(
+					"[spoof] Good OOB! len: %d, channel: 0x%X, type: %c from %s\n",
+					len,
+					channel,
+					type,
+					IPToString( from.sin_addr, address, sizeof( address ) )
+				);
+				return PacketTypeGood;
+			}
+
+			DebugWarning(
+				"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
+				len,
+				channel,
+				type,
+				IPToString( from.sin_addr, address, sizeof( address ) )
+			);
+			return PacketTypeInvalid;
+		}
+
+		return type == 'T' ? PacketTypeInfo : PacketTypeGood;
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+
+namespace netfilter
+{
+	static const size_t ip_string_size = 16; // "255.255.255.255" and the terminator
+
+	// Writes the dotted address into buffer, returns it or "unknown".
+	const char *IPToString( const in_addr &addr, char *buffer, size_t size );
+
+	// Parses "a.b.c.d" or "a.b.c.d/prefix" into a network and mask in host byte order.
+	bool ParseCIDR( const char *cidr, uint32_t &network, uint32_t &mask );
+
+	// Decides what to do with a received datagram without touching any state,
+	// validate enables the stricter connectionless packet checks.
+	PacketType ClassifyPacket(
+		const char *data,
+		int32_t len,
+		const sockaddr_in &from,
+		bool validate
+	);
+}
@@ -0,0 +1,81 @@
+#include <netfilter/clock.hpp>
+#include <netfilter/atomic.hpp>
+#include <Platform.hpp>
+
+#if defined SYSTEM_WINDOWS
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <Windows.h>
+
+#elif defined SYSTEM_LINUX
+
+#include <time.h>
+
+#elif defined SYSTEM_MACOSX
+
+#include <mach/mach_time.h>
+
+#endif
+
+namespace netfilter
+{
+	namespace clock
+	{
+		// written by the game thread and the receiver, read by the workers
+		static Atomic<uint32_t> cached_time( 0 );
+
+#if defined SYSTEM_WINDOWS
+
+		uint32_t Now( )
+		{
+			// same resolution as the coarse clock on Linux and costs about as much
+			return GetTickCount( );
+		}
+
+#elif defined SYSTEM_LINUX
+
+		uint32_t Now( )
+		{
+			timespec now;
+
+#if defined CLOCK_MONOTONIC_COARSE
+
+			clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+
+#else
+
+			clock_gettime( CLOCK_MONOTONIC, &now );
+
+#endif
+
+			return static_cast<uint32_t>( now.tv_sec * 1000ULL + now.tv_nsec / 1000000 );
+		}
+
+#elif defined SYSTEM_MACOSX
+
+		uint32_t Now( )
+		{
+			static mach_timebase_info_data_t timebase = { 0, 0 };
+			if( timebase.denom == 0 )
+				mach_timebase_info( &timebase );
+
+			uint64_t ns = mach_absolute_time( ) * timebase.numer / timebase.denom;
+			return static_cast<uint32_t>( ns / 1000000 );
+		}
+
+#endif
+
+		uint32_t Refresh( )
+		{
+			uint32_t now = Now( );
+			cached_time = now;
+			return now;
+		}
+
+		uint32_t Cached( )
+		{
+			return cached_time;
+		}
+	}
+}
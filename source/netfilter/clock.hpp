@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace netfilter
+{
+	namespace clock
+	{
+		// Monotonic milliseconds from an arbitrary point, keeps advancing while the
+		// server hibernates. Wraps after ~49 days, so only compare differences.
+		uint32_t Now( );
+
+		// Samples Now( ) once per receive batch, Cached( ) then returns that sample
+		// so packets in the same batch don't pay for another clock read.
+		uint32_t Refresh( );
+		uint32_t Cached( );
+	}
+}
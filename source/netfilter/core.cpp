@@ -1,47 +1,56 @@
 #include <netfilter/core.hpp>
+#include <netfilter/atomic.hpp>
+#include <netfilter/bans.hpp>
+#include <netfilter/classify.hpp>
+#include <netfilter/clock.hpp>
+#include <netfilter/egress.hpp>
+#include <netfilter/events.hpp>
+#include <netfilter/handshakes.hpp>
+#include <netfilter/histogram.hpp>
+#include <netfilter/hitters.hpp>
+#include <netfilter/packet.hpp>
+#include <netfilter/queue.hpp>
+#include <netfilter/reply.hpp>
+#include <netfilter/sampling.hpp>
+#include <netfilter/scheduling.hpp>
+#include <netfilter/shared.hpp>
+#include <netfilter/snapshot.hpp>
+#include <netfilter/stats.hpp>
+#include <netfilter/workers.hpp>
 #include <main.hpp>
 #include <GarrysMod/Lua/Interface.h>
 #include <GarrysMod/Interfaces.hpp>
 #include <stdint.h>
 #include <stddef.h>
-#include <queue>
+#include <stdlib.h>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <eiface.h>
 #include <filesystem_stdio.h>
 #include <iserver.h>
 #include <threadtools.h>
+#include <platform.h>
+#include <tier0/icommandline.h>
 #include <utlvector.h>
-#include <bitbuf.h>
 #include <steam/steam_gameserver.h>
-#include <game/server/iplayerinfo.h>
 #include <scanning/symbolfinder.hpp>
 #include <Platform.hpp>
 
 #if defined SYSTEM_WINDOWS
 
-#define WIN32_LEAN_AND_MEAN
-
-#include <WinSock2.h>
-#include <Ws2tcpip.h>
 #include <unordered_set>
-#include <atomic>
 
 #elif defined SYSTEM_LINUX
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <time.h>
 #include <errno.h>
 #include <unordered_set>
-#include <atomic>
 
 #elif defined SYSTEM_MACOSX
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <errno.h>
 
 #ifdef SYSTEM_MACOSX_BAD
@@ -51,7 +60,6 @@
 #else
 
 #include <unordered_set>
-#include <atomic>
 
 #endif
 
@@ -66,36 +74,10 @@ namespace netfilter
 
 	typedef std::set<uint32_t> set_uint32;
 
-	// Pray to the gods for guidance and hope this is enough.
-	class AtomicBool
-	{
-	public:
-		AtomicBool( bool v )
-		{
-			__sync_bool_compare_and_swap( &value, !v, v );
-		}
-
-		operator bool( ) const
-		{
-			return __sync_fetch_and_or( &value, 0 );
-		}
-
-		AtomicBool &operator =( bool v )
-		{
-			__sync_bool_compare_and_swap( &value, !v, v );
-			return *this;
-		}
-
-	private:
-		bool value;
-	};
-
 #else
 
 	typedef std::unordered_set<uint32_t> set_uint32;
 
-	typedef std::atomic_bool AtomicBool;
-
 #endif
 
 	typedef int32_t( *Hook_recvfrom_t )(
@@ -107,18 +89,6 @@ namespace netfilter
 		int32_t *fromlen
 		);
 
-	struct packet_t
-	{
-		packet_t( ) :
-			address( ),
-			address_size( sizeof( address ) )
-		{ }
-
-		sockaddr_in address;
-		int32_t address_size;
-		std::vector<char> buffer;
-	};
-
 	struct netsocket_t
 	{
 		int32_t nPort;
@@ -127,36 +97,89 @@ namespace netfilter
 		int32_t hTCP;
 	};
 
-	struct reply_info_t
+	struct receiver_settings_t
+	{
+		receiver_settings_t( ) :
+			policy( scheduling::PolicyDefault ),
+			priority( 0 ),
+			nice( 0 ),
+			busy_poll_usec( 0 ),
+			spin_usec( 0 ),
+			workers( 0 )
+		{ }
+
+		std::vector<int32_t> cpus;
+		scheduling::Policy policy;
+		int32_t priority;
+		int32_t nice;
+		int32_t busy_poll_usec;
+		int32_t spin_usec;
+		size_t workers;
+	};
+
+	struct wakeup_latency_t
 	{
-		std::string game_dir;
-		std::string game_version;
-		std::string game_desc;
-		int32_t max_clients;
-		int32_t udp_port;
-		std::string tags;
+		wakeup_latency_t( ) :
+			count( 0 ),
+			total( 0 ),
+			min( 0 ),
+			max( 0 )
+		{ }
+
+		uint64_t count;
+		uint64_t total; // nanoseconds
+		uint64_t min;
+		uint64_t max;
 	};
 
-	struct player_t
+	struct requester_class_t
 	{
-		byte index;
+		requester_class_t( const std::string &n ) :
+			name( n ),
+			spoof_count( 10 )
+		{
+			players.count = 0;
+		}
+
 		std::string name;
-		double score;
-		double time;
+		int spoof_count;
+		player_table players;
+	};
+
+	struct requester_cidr_t
+	{
+		uint32_t first; // host byte order
+		uint32_t last;
+		size_t class_index;
 	};
 
-	struct player_table
+	struct requester_range_t
 	{
-		byte count;
-		std::vector<player_t> players;
+		uint32_t first; // host byte order, range ends where the next one starts
+		size_t class_index;
+	};
+
+	// indexed by PacketType + 1
+	static const size_t traffic_class_count = 4;
+	static const char *traffic_class_names[traffic_class_count] = {
+		"invalid",
+		"good",
+		"info",
+		"player"
 	};
 
-	enum PacketType
+	enum LatencyStage
 	{
-		PacketTypeInvalid = -1,
-		PacketTypeGood,
-		PacketTypeInfo,
-		PacketTypePlayer
+		LatencyKernelToReceiver,
+		LatencyReceiverToDequeue,
+		LatencyQueryTurnaround,
+		LatencyStageCount
+	};
+
+	static const char *latency_stage_names[LatencyStageCount] = {
+		"kernel_to_receiver",
+		"receiver_to_dequeue",
+		"query_turnaround"
 	};
 
 	class CSteamGameServerAPIContext
@@ -193,8 +216,6 @@ namespace netfilter
 		"\x2A\x2A\x2A\x2A\x80\x7E\x04\x00\x0F\x84\x2A\x2A\x2A\x2A\xA1\x2A\x2A\x2A\x2A\xC7\x45\xF8\x10";
 	static size_t net_sockets_siglen = sizeof( net_sockets_sig ) - 1;
 
-	static const char operating_system_char = 'w';
-
 #elif defined SYSTEM_LINUX
 
 	static const char SteamGameServerAPIContext_sym[] = "@_ZL27s_SteamGameServerAPIContext";
@@ -209,8 +230,6 @@ namespace netfilter
 	static const char net_sockets_sig[] = "@_ZL11net_sockets";
 	static const size_t net_sockets_siglen = 0;
 
-	static const char operating_system_char = 'l';
-
 	typedef int SOCKET;
 
 	static const SOCKET INVALID_SOCKET = -1;
@@ -229,14 +248,50 @@ namespace netfilter
 	static const char net_sockets_sig[] = "@__ZL11net_sockets";
 	static const size_t net_sockets_siglen = 0;
 
-	static const char operating_system_char = 'm';
-
 	typedef int SOCKET;
 
 	static const SOCKET INVALID_SOCKET = -1;
 
 #endif
 
+	typedef std::shared_ptr<const reply_cache_t> reply_cache_ptr;
+
+	// One of the engine's UDP sockets, each gets its own queue, reply caches and
+	// counters. The list is built once in Initialize and never changes after.
+	struct engine_socket_t
+	{
+		engine_socket_t( int32_t i, SOCKET h, int32_t p ) :
+			index( i ),
+			handle( h ),
+			port( p ),
+			answer_queries( false ),
+			queue( 1000 ),
+			info_cache_version( 0 ),
+			info_cache_last_update( 0 ),
+			player_cache_version( 0 ),
+			player_cache_last_update( 0 )
+		{
+			for( size_t k = 0; k < shared::CounterCount; ++k )
+				counters[k] = 0;
+		}
+
+		int32_t index; // in net_sockets
+		SOCKET handle;
+		int32_t port;
+		AtomicBool answer_queries;
+		PacketQueue queue;
+		Atomic<uint64_t> counters[shared::CounterCount];
+
+		// guarded by requester_class_mutex, indexed by requester class and replaced
+		// instead of rebuilt in place, senders keep the one they started with
+		std::vector<reply_cache_ptr> info_caches;
+		uint32_t info_cache_version;
+		uint32_t info_cache_last_update;
+		std::vector<reply_cache_ptr> player_caches;
+		uint32_t player_cache_version;
+		uint32_t player_cache_last_update;
+	};
+
 	static std::string server_binary =
 		Helpers::GetBinaryFileName( "server", false, true, "garrysmod/bin/" );
 	static CSteamGameServerAPIContext *gameserver_context = nullptr;
@@ -249,7 +304,7 @@ namespace netfilter
 	static SourceSDK::FactoryLoader server_loader( "server", false, true, "garrysmod/bin/" );
 
 	static Hook_recvfrom_t Hook_recvfrom = VCRHook_recvfrom;
-	static SOCKET game_socket = INVALID_SOCKET;
+	static std::vector<engine_socket_t *> engine_sockets; // the game socket comes first
 
 	static bool packet_validation_enabled = true;
 
@@ -259,42 +314,73 @@ namespace netfilter
 	static bool firewall_blacklist_enabled = false;
 	static set_uint32 firewall_blacklist;
 
-	static const size_t threaded_socket_max_queue = 1000;
 	static AtomicBool threaded_socket_enabled( false );
 	static AtomicBool threaded_socket_execute( true );
 	static ThreadHandle_t threaded_socket_handle = nullptr;
-	static std::queue<packet_t> threaded_socket_queue;
-	static CThreadFastMutex threaded_socket_mutex;
+
+	// written by Lua, applied by the receiver thread itself
+	static receiver_settings_t receiver_settings;
+	static AtomicBool receiver_settings_dirty( false );
+	static CThreadFastMutex receiver_settings_mutex;
+	static int32_t receiver_spin_usec = 0;
+
+	// owned by the receiver thread, with no workers it analyzes packets itself
+	static bool AnalyzeQueuedPacket( packet_t &p );
+	static WorkerPool worker_pool( AnalyzeQueuedPacket, 1000 );
+	static const size_t receive_batch_size = 32;
+
+	static AtomicBool latency_tracing_enabled( false );
+	static LatencyHistogram latency_histograms[LatencyStageCount][traffic_class_count];
+	static CThreadFastMutex latency_histograms_mutex;
+
+	static AtomicBool wakeup_latency_enabled( false );
+	static wakeup_latency_t wakeup_latency;
+	static CThreadFastMutex wakeup_latency_mutex;
+
+	// published by the receiver thread
+	static Atomic<uint32_t> stats_interval( 250 ); // milliseconds
+	static uint32_t stats_last_publish = 0;
+	static stats::page_t stats_page;
+
+	static_assert(
+		stats::counter_count == shared::CounterCount &&
+		stats::stage_count == LatencyStageCount &&
+		stats::class_count == traffic_class_count &&
+		stats::bucket_count == LatencyHistogram::bucket_count,
+		"stats page layout is out of sync"
+	);
 
 	static const char *default_game_version = "16.12.01";
-	static const uint8_t default_proto_version = 17;
-	static bool player_spoofing_enabled = false;
-	static int player_spoof_count = 10;
+	static AtomicBool player_spoofing_enabled( false ); // read by the workers
 	static reply_info_t reply_info;
 	static char info_cache_buffer[1024] = { 0 };
-	static bf_write info_cache_packet( info_cache_buffer, sizeof( info_cache_buffer ) );
-	static uint32_t info_cache_last_update = 0;
-	static uint32_t info_cache_time = 5;
-
-	static char player_cache_buffer[1024] = { 0 };
-	static bf_write player_cache_packet( player_cache_buffer, sizeof( player_cache_buffer ) );
-	static uint32_t player_cache_last_update = 0;
-	static uint32_t player_cache_time = 5;
+	static a2s::Writer info_cache_packet( info_cache_buffer, sizeof( info_cache_buffer ) );
+	static size_t info_cache_players_offset = 0;
+	static uint32_t info_cache_version = 1; // bumped to rebuild every socket's caches
+	static uint32_t info_cache_time = 5000; // milliseconds
+
+	static char player_cache_buffer[split_packet_max_payload * split_packet_max_fragments] = { 0 };
+	static a2s::Writer player_cache_packet( player_cache_buffer, sizeof( player_cache_buffer ) );
+	static uint32_t player_cache_version = 1;
+	static uint32_t player_cache_time = 5000; // milliseconds
 	
 	static uint32_t a2s_player_last_send = 0;
-	
-	static const size_t packet_sampling_max_queue = 50;
-	static AtomicBool packet_sampling_enabled( false );
-	static std::deque<packet_t> packet_sampling_queue;
-	static CThreadFastMutex packet_sampling_mutex;
 
-	static CGlobalVars *globalvars = nullptr;
+	// class 0 answers everyone not matched by a CIDR range of another class
+	static std::vector<requester_class_t> requester_classes( 1, requester_class_t( "default" ) );
+	static std::vector<requester_cidr_t> requester_cidrs;
+	static std::vector<requester_range_t> requester_ranges;
+	static CThreadFastMutex requester_class_mutex;
+
+	// mirrors the settings kept in the snapshot, only touched by the Lua thread
+	static const char *default_snapshot_path = "garrysmod/data/spoof_snapshot.dat";
+	static snapshot::settings_t snapshot_settings;
+	static bool snapshot_restored = false;
+
 	static IServerGameDLL *gamedll = nullptr;
 	static IVEngineServer *engine_server = nullptr;
 	static IFileSystem *filesystem = nullptr;
 
-	static player_table game_players;
-
 	static void BuildStaticReplyInfo( )
 	{
 		reply_info.game_desc = gamedll->GetGameDescription( );
@@ -354,245 +440,357 @@ namespace netfilter
 		}
 	}
 
-	// maybe divide into low priority and high priority data?
-	// low priority would be VAC protection status for example
-	// updated on a much bigger period
-	static void BuildReplyInfo( )
+	static void BuildReplyInfo( engine_socket_t &socket )
 	{
-		info_cache_packet.Reset( );
-
-		info_cache_packet.WriteLong( -1 ); // connectionless packet header
-		info_cache_packet.WriteByte( 'I' ); // packet type is always 'I'
-		info_cache_packet.WriteByte( default_proto_version );
-		info_cache_packet.WriteString( global::server->GetName( ) );
-		info_cache_packet.WriteString( global::server->GetMapName( ) );
-		info_cache_packet.WriteString( reply_info.game_dir.c_str( ) );
-		info_cache_packet.WriteString( reply_info.game_desc.c_str( ) );
-
-		int32_t appid = engine_server->GetAppID( );
-		info_cache_packet.WriteShort( appid );
-
-		if (player_spoofing_enabled) {
-			info_cache_packet.WriteByte(player_spoof_count);
-		} else {
-			info_cache_packet.WriteByte( global::server->GetNumClients() );
-		}			
+		reply_state_t state;
+		state.name = global::server->GetName( );
+		state.map = global::server->GetMapName( );
+		state.appid = engine_server->GetAppID( );
+		state.players = global::server->GetNumClients( );
 
 		int32_t maxplayers =
 			sv_visiblemaxplayers != nullptr ? sv_visiblemaxplayers->GetInt( ) : -1;
 		if( maxplayers <= 0 || maxplayers > reply_info.max_clients )
 			maxplayers = reply_info.max_clients;
-		info_cache_packet.WriteByte( maxplayers );
-		info_cache_packet.WriteByte( global::server->GetNumFakeClients( ) );
-		info_cache_packet.WriteByte( 'd' ); // dedicated server identifier
-		info_cache_packet.WriteByte( operating_system_char );
-		info_cache_packet.WriteByte( global::server->GetPassword( ) != nullptr ? 1 : 0 );
-		// if vac protected, it activates itself some time after startup
+		state.max_players = maxplayers;
+
+		state.bots = global::server->GetNumFakeClients( );
+		state.password = global::server->GetPassword( ) != nullptr;
+
 		ISteamGameServer *steamGS = gameserver_context != nullptr ?
 			gameserver_context->m_pSteamGameServer : nullptr;
-		info_cache_packet.WriteByte( steamGS != nullptr ? steamGS->BSecure( ) : false );
-		info_cache_packet.WriteString( reply_info.game_version.c_str( ) );
+		state.secure = steamGS != nullptr ? steamGS->BSecure( ) : false;
 
 		const CSteamID *sid = engine_server->GetGameServerSteamID( );
-		uint64_t steamid = 0;
-		if( sid != nullptr )
-			steamid = sid->ConvertToUint64( );
+		state.steamid = sid != nullptr ? sid->ConvertToUint64( ) : 0;
+
+		// advertise the port the query arrived on
+		reply_info_t info = reply_info;
+		info.udp_port = socket.port;
+
+		// patched with each requester class' spoof count below
+		info_cache_players_offset = WriteInfoReply( info_cache_packet, info, state );
+
+		// without caches the queries are left to the engine
+		socket.info_caches.clear( );
+		socket.info_caches.resize( requester_classes.size( ) );
+		if( info_cache_players_offset == 0 )
+			return;
 
-		bool notags = reply_info.tags.empty( );
-		// 0x80 - port number is present
-		// 0x10 - server steamid is present
-		// 0x20 - tags are present
-		// 0x01 - game long appid is present
-		info_cache_packet.WriteByte( 0x80 | 0x10 | ( notags ? 0x00 : 0x20 ) | 0x01 );
-		info_cache_packet.WriteShort( reply_info.udp_port );
-		info_cache_packet.WriteLongLong( steamid );
-		if( !notags )
-			info_cache_packet.WriteString( reply_info.tags.c_str( ) );
-		info_cache_packet.WriteLongLong( appid );
+		for( size_t k = 0; k < requester_classes.size( ); ++k )
+		{
+			requester_class_t &requester = requester_classes[k];
+			if( player_spoofing_enabled )
+				info_cache_buffer[info_cache_players_offset] =
+					static_cast<char>( requester.spoof_count );
+
+			std::shared_ptr<reply_cache_t> cache = std::make_shared<reply_cache_t>( );
+			BuildReplyFragments( info_cache_packet, *cache );
+			socket.info_caches[k] = cache;
+		}
 	}
 
-	static void BuildPlayerInfo(uint32_t time)
+	static reply_cache_ptr BuildPlayerInfo(requester_class_t &requester, uint32_t elapsed)
 	{
-		player_cache_packet.Reset();
-		player_cache_packet.WriteLong(-1);
-		player_cache_packet.WriteByte('D');
+		WritePlayerReply(player_cache_packet, requester.players, elapsed);
 
-		player_cache_packet.WriteByte(game_players.count);
+		std::shared_ptr<reply_cache_t> cache = std::make_shared<reply_cache_t>( );
+		BuildReplyFragments( player_cache_packet, *cache );
+		return cache;
+	}
 
-		for (int i=0; i<game_players.count; i++) 
-		{
-			game_players.players[i].time += (time - a2s_player_last_send);
+	// Workers read the cached clock before taking requester_class_mutex, so another
+	// one may have rebuilt with a newer time in between, which counts as no time.
+	inline uint32_t GetElapsed( uint32_t time, uint32_t since )
+	{
+		int32_t elapsed = static_cast<int32_t>( time - since );
+		return elapsed > 0 ? static_cast<uint32_t>( elapsed ) : 0;
+	}
 
-			player_t player = game_players.players[i];
-			player_cache_packet.WriteByte(i);
-			player_cache_packet.WriteString(player.name.c_str());
-			player_cache_packet.WriteLong(player.score);
-			player_cache_packet.WriteFloat(player.time);
-		}
+	static void BuildPlayerInfo(engine_socket_t &socket, uint32_t time)
+	{
+		uint32_t elapsed = GetElapsed( time, a2s_player_last_send );
+
+		socket.player_caches.resize(requester_classes.size());
+		for (size_t k = 0; k < requester_classes.size(); ++k)
+			socket.player_caches[k] = BuildPlayerInfo(requester_classes[k], elapsed);
+
+		a2s_player_last_send += elapsed;
+
+		// the times advance with every rebuild, keep them advancing after a restart
+		if( snapshot::IsOpen( ) )
+			for( size_t k = 0; k < requester_classes.size( ); ++k )
+			{
+				const player_table &players = requester_classes[k].players;
+				for( size_t p = 0; p < players.players.size( ); ++p )
+					snapshot::SavePlayerTime(
+						static_cast<uint32_t>( k ),
+						static_cast<uint32_t>( p ),
+						players.players[p].time
+					);
+			}
+	}
 
-		a2s_player_last_send = time;
+	inline bool CompareRequesterRange( uint32_t address, const requester_range_t &range )
+	{
+		return address < range.first;
 	}
 
-	inline PacketType SendInfoCache( const sockaddr_in &from, uint32_t time )
+	// Flattens the (possibly overlapping) CIDR list into sorted disjoint ranges,
+	// the most specific CIDR wins, so a query only needs one binary search.
+	static void BuildRequesterRanges( )
 	{
-		if( time - info_cache_last_update >= info_cache_time )
+		std::vector<uint64_t> bounds( 1, 0 );
+		for( size_t k = 0; k < requester_cidrs.size( ); ++k )
 		{
-			BuildReplyInfo( );
-			info_cache_last_update = time;
+			bounds.push_back( requester_cidrs[k].first );
+			bounds.push_back( static_cast<uint64_t>( requester_cidrs[k].last ) + 1 );
 		}
 
-		sendto(
-			game_socket,
-			reinterpret_cast<char *>( info_cache_packet.GetData( ) ),
-			info_cache_packet.GetNumBytesWritten( ),
-			0,
-			reinterpret_cast<const sockaddr *>( &from ),
-			sizeof( from )
-		);
+		std::sort( bounds.begin( ), bounds.end( ) );
+		bounds.erase( std::unique( bounds.begin( ), bounds.end( ) ), bounds.end( ) );
 
-		return PacketTypeInvalid; // we've handled it
+		requester_ranges.clear( );
+		for( size_t k = 0; k < bounds.size( ) && bounds[k] <= 0xFFFFFFFF; ++k )
+		{
+			uint32_t address = static_cast<uint32_t>( bounds[k] );
+			size_t class_index = 0;
+			uint64_t class_size = 0x100000000ULL + 1;
+			for( size_t c = 0; c < requester_cidrs.size( ); ++c )
+			{
+				const requester_cidr_t &cidr = requester_cidrs[c];
+				uint64_t size = static_cast<uint64_t>( cidr.last ) - cidr.first + 1;
+				if( address >= cidr.first && address <= cidr.last && size < class_size )
+				{
+					class_index = cidr.class_index;
+					class_size = size;
+				}
+			}
+
+			if( requester_ranges.empty( ) || requester_ranges.back( ).class_index != class_index )
+			{
+				requester_range_t range = { address, class_index };
+				requester_ranges.push_back( range );
+			}
+		}
 	}
 
-	inline PacketType SendPlayerCache(const sockaddr_in &from, uint32_t time)
+	inline size_t GetRequesterClass( const sockaddr_in &from )
 	{
-		if (time - player_cache_last_update >= player_cache_time)
-		{
-			BuildPlayerInfo(time);
-			player_cache_last_update = time;
-		}
+		std::vector<requester_range_t>::const_iterator it = std::upper_bound(
+			requester_ranges.begin( ),
+			requester_ranges.end( ),
+			ntohl( from.sin_addr.s_addr ),
+			CompareRequesterRange
+		);
+		return ( it - 1 )->class_index;
+	}
 
+	inline void SendDatagram(
+		const engine_socket_t &socket,
+		const char *data,
+		size_t size,
+		const sockaddr_in &from
+	)
+	{
 		sendto(
-			game_socket,
-			reinterpret_cast<char *>( player_cache_packet.GetData( ) ),
-			player_cache_packet.GetNumBytesWritten( ),
+			socket.handle,
+			data,
+			static_cast<int32_t>( size ),
 			0,
 			reinterpret_cast<const sockaddr *>( &from ),
 			sizeof( from )
 		);
-		
-		return PacketTypeInvalid;
 	}
 
-	inline PacketType HandleInfoQuery( const sockaddr_in &from )
+	// Replies only go out while the egress budget allows, past it the requester
+	// gets a challenge or nothing. Queries that came back with a valid challenge
+	// proved their source and are answered either way. Returns false when there
+	// is no reply to send, a reply that didn't fit or couldn't be split leaves
+	// the cache empty.
+	inline bool SendReplyCache(
+		const engine_socket_t &socket,
+		const reply_cache_t *cache,
+		const sockaddr_in &from,
+		uint32_t time,
+		bool validated
+	)
 	{
-		uint32_t time = static_cast<uint32_t>( globalvars->realtime );
-		return SendInfoCache( from, time );
-	}
+		if( cache == nullptr || cache->fragments.empty( ) )
+			return false;
 
-	inline PacketType HandlePlayerQuery( const sockaddr_in &from )
-	{
-		uint32_t time = static_cast<uint32_t>( globalvars->realtime );
-		return SendPlayerCache( from, time );
-	}
+		size_t bytes = 0;
+		for( size_t k = 0; k < cache->fragments.size( ); ++k )
+			bytes += cache->fragments[k].size( );
 
-	inline const char *IPToString( const in_addr &addr )
-	{
-		static char buffer[16] = { };
-		const char *str =
-			inet_ntop( AF_INET, const_cast<in_addr *>( &addr ), buffer, sizeof( buffer ) );
-		if( str == nullptr )
-			return "unknown";
+		if( !validated && egress::IsEnabled( ) &&
+			!egress::Spend( static_cast<uint32_t>( bytes ), time ) )
+		{
+			if( egress::GetFallback( ) == egress::FallbackDrop )
+			{
+				egress::RecordDropped( );
+				return true;
+			}
+
+			uint8_t challenge[egress::challenge_size];
+			egress::WriteChallenge( from, time, challenge );
+			SendDatagram(
+				socket, reinterpret_cast<const char *>( challenge ), sizeof( challenge ), from
+			);
+			egress::RecordChallenge( sizeof( challenge ) );
+			return true;
+		}
+
+		for( size_t k = 0; k < cache->fragments.size( ); ++k )
+		{
+			const std::vector<char> &fragment = cache->fragments[k];
+			SendDatagram( socket, &fragment[0], fragment.size( ), from );
+		}
 
-		return str;
+		egress::RecordReply( static_cast<uint32_t>( bytes ) );
+		return true;
 	}
 
-	static PacketType ClassifyPacket( const char *data, int32_t len, const sockaddr_in &from )
+	// The lock only covers picking the cache, workers answering queries in
+	// parallel must not wait on each other's sendto.
+	inline PacketType SendInfoCache(
+		engine_socket_t &socket,
+		const sockaddr_in &from,
+		uint32_t time,
+		bool validated
+	)
 	{
-		if( len == 0 )
+		reply_cache_ptr cache;
+
 		{
-			DebugWarning(
-				"[spoof] Bad OOB! len: %d from %s\n",
-				len,
-				IPToString( from.sin_addr )
-			);
-			return PacketTypeInvalid;
+			AUTO_LOCK( requester_class_mutex );
+
+			uint32_t elapsed = GetElapsed( time, socket.info_cache_last_update );
+			if( socket.info_cache_version != info_cache_version || elapsed >= info_cache_time )
+			{
+				BuildReplyInfo( socket );
+				socket.info_cache_version = info_cache_version;
+				socket.info_cache_last_update = time;
+			}
+
+			cache = socket.info_caches[GetRequesterClass( from )];
 		}
 
-		if( len < 5 )
+		if( !SendReplyCache( socket, cache.get( ), from, time, validated ) )
 			return PacketTypeGood;
 
-		int32_t channel = *reinterpret_cast<const int32_t *>( data );
-		if( channel == -2 )
+		return PacketTypeInvalid; // we've handled it
+	}
+
+	inline PacketType SendPlayerCache(
+		engine_socket_t &socket,
+		const sockaddr_in &from,
+		uint32_t time,
+		bool validated
+	)
+	{
+		reply_cache_ptr cache;
+
 		{
-			DebugWarning(
-				"[spoof] Bad OOB! len: %d, channel: 0x%X from %s\n",
-				len,
-				channel,
-				IPToString( from.sin_addr )
-			);
-			return PacketTypeInvalid;
+			AUTO_LOCK( requester_class_mutex );
+
+			uint32_t elapsed = GetElapsed( time, socket.player_cache_last_update );
+			if (socket.player_cache_version != player_cache_version ||
+				elapsed >= player_cache_time)
+			{
+				BuildPlayerInfo(socket, time);
+				socket.player_cache_version = player_cache_version;
+				socket.player_cache_last_update = time;
+			}
+
+			cache = socket.player_caches[GetRequesterClass( from )];
 		}
 
-		if( channel != -1 )
+		if( !SendReplyCache( socket, cache.get( ), from, time, validated ) )
 			return PacketTypeGood;
 
-		uint8_t type = *reinterpret_cast<const uint8_t *>( data + 4 );
-		if( packet_validation_enabled )
-		{
-			switch( type )
-			{
-			case 'W': // server challenge request
-			case 's': // master server challenge
-				if( len > 100 )
-				{
-					DebugWarning(
-						"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
-						len,
-						channel,
-						type,
-						IPToString( from.sin_addr )
-					);
-					return PacketTypeInvalid;
-				}
+		return PacketTypeInvalid;
+	}
 
-				if( len >= 18 && strncmp( data + 5, "statusResponse", 14 ) == 0 )
-				{
-					DebugWarning(
-						"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
-						len,
-						channel,
-						type,
-						IPToString( from.sin_addr )
-					);
-					return PacketTypeInvalid;
-				}
+	// Queries resent after an egress challenge carry it after the query itself,
+	// A2S_PLAYER always has one and 0xFFFFFFFF there asks for a challenge instead.
+	// Only checked while the budget is on, returns false for a challenge the
+	// module didn't hand out recently and sets validated for one it did.
+	inline bool CheckQueryChallenge(
+		const char *data,
+		int32_t len,
+		int32_t offset,
+		const sockaddr_in &from,
+		uint32_t time,
+		bool &validated
+	)
+	{
+		validated = false;
+		uint32_t challenge;
+		if( !egress::IsEnabled( ) || len < offset + 4 )
+			return true;
 
-				return PacketTypeGood;
-
-			case 'T': // server info request
-				return len == 25 && strncmp( data + 5, "Source Engine Query", 19 ) == 0 ?
-					PacketTypeInfo : PacketTypeInvalid;
-
-			case 'U': // player info request
-				return PacketTypePlayer;
-			case 'V': // rules request
-				return len == 9 ? PacketTypeGood : PacketTypeInvalid;
-
-			case 'q': // connection handshake init
-			case 'k': // steam auth packet
-				DebugMsg(
-					"[spoof] Good OOB! len: %d, channel: 0x%X, type: %c from %s\n",
-					len,
-					channel,
-					type,
-					IPToString( from.sin_addr )
-				);
-				return PacketTypeGood;
-			}
+		memcpy( &challenge, data + offset, sizeof( challenge ) );
+		if( challenge == 0xFFFFFFFF )
+			return true;
 
-			DebugWarning(
-				"[spoof] Bad OOB! len: %d, channel: 0x%X, type: %c from %s\n",
-				len,
-				channel,
-				type,
-				IPToString( from.sin_addr )
-			);
+		validated = egress::CheckChallenge( from, challenge, time );
+		return validated;
+	}
+
+	// Only while spoofing and only on sockets answering queries themselves, the
+	// detour is also installed for filtering alone and then leaves them to the engine.
+	// Forged or expired challenges are dropped, they would only be answered to
+	// sources that never asked.
+	inline PacketType HandleInfoQuery(
+		engine_socket_t &socket,
+		const sockaddr_in &from,
+		const char *data,
+		int32_t len
+	)
+	{
+		if( !player_spoofing_enabled || !socket.answer_queries )
+			return PacketTypeGood;
+
+		uint32_t time = clock::Cached( );
+		bool validated;
+		if( !CheckQueryChallenge( data, len, 25, from, time, validated ) )
+		{
+			egress::RecordDropped( );
 			return PacketTypeInvalid;
 		}
 
-		return type == 'T' ? PacketTypeInfo : PacketTypeGood;
+		PacketType type = SendInfoCache( socket, from, time, validated );
+		if( type == PacketTypeInvalid )
+			egress::RecordQuery( static_cast<uint32_t>( len ) );
+
+		return type;
 	}
 
+	inline PacketType HandlePlayerQuery(
+		engine_socket_t &socket,
+		const sockaddr_in &from,
+		const char *data,
+		int32_t len
+	)
+	{
+		if( !player_spoofing_enabled || !socket.answer_queries )
+			return PacketTypeGood;
+
+		uint32_t time = clock::Cached( );
+		bool validated;
+		if( !CheckQueryChallenge( data, len, 5, from, time, validated ) )
+		{
+			egress::RecordDropped( );
+			return PacketTypeInvalid;
+		}
+
+		PacketType type = SendPlayerCache( socket, from, time, validated );
+		if( type == PacketTypeInvalid )
+			egress::RecordQuery( static_cast<uint32_t>( len ) );
+
+		return type;
+	}
 
 	inline int32_t HandleNetError( int32_t value )
 	{
@@ -611,220 +809,1907 @@ namespace netfilter
 		return value;
 	}
 
-	inline packet_t GetQueuedPacket( )
+	inline uint64_t GetRealtimeNanoseconds( )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		packet_t p = threaded_socket_queue.front( );
-		threaded_socket_queue.pop( );
-		return p;
+
+#if defined SYSTEM_WINDOWS
+
+		// 100 nanosecond intervals since 1601, moved to the Unix epoch
+		FILETIME now;
+		GetSystemTimePreciseAsFileTime( &now );
+		uint64_t intervals =
+			static_cast<uint64_t>( now.dwHighDateTime ) << 32 | now.dwLowDateTime;
+		return ( intervals - 116444736000000000ULL ) * 100;
+
+#elif defined SYSTEM_POSIX
+
+		timespec now;
+		clock_gettime( CLOCK_REALTIME, &now );
+		return now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+#endif
+
 	}
 
-	static int32_t ReceiveAndAnalyzePacket(
+	// Uses recvmsg when latency tracing is enabled to get the SO_TIMESTAMPNS
+	// kernel receive time, which recvfrom would throw away.
+	static int32_t ReceivePacket(
 		int32_t s,
 		char *buf,
 		int32_t buflen,
 		int32_t flags,
 		sockaddr *from,
-		int32_t *fromlen
+		int32_t *fromlen,
+		uint64_t &kernel_time
 	)
 	{
-		sockaddr_in &infrom = *reinterpret_cast<sockaddr_in *>( from );
-		int32_t len = Hook_recvfrom( s, buf, buflen, flags, from, fromlen );
-		if( len == -1 )
-			return -1;
+		kernel_time = 0;
 
-		if( packet_sampling_enabled )
+#if defined SYSTEM_LINUX && defined SO_TIMESTAMPNS
+
+		if( latency_tracing_enabled )
 		{
-			packet_t p;
-			memcpy( &p.address, from, *fromlen );
-			p.address_size = *fromlen;
-			p.buffer.assign( buf, buf + len );
+			char control[CMSG_SPACE( sizeof( timespec ) )];
+			iovec iov;
+			iov.iov_base = buf;
+			iov.iov_len = static_cast<size_t>( buflen );
+
+			msghdr msg;
+			memset( &msg, 0, sizeof( msg ) );
+			msg.msg_name = from;
+			msg.msg_namelen = static_cast<socklen_t>( *fromlen );
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof( control );
+
+			ssize_t len = recvmsg( s, &msg, flags );
+			if( len == -1 )
+				return -1;
 
-			AUTO_LOCK( packet_sampling_mutex );
+			*fromlen = static_cast<int32_t>( msg.msg_namelen );
 
-			// there should only be packet_sampling_max_queue packets on the queue
-			// at the moment of this check
-			if( packet_sampling_queue.size( ) >= packet_sampling_max_queue )
-				packet_sampling_queue.pop_front( );
+			for( cmsghdr *cmsg = CMSG_FIRSTHDR( &msg ); cmsg != nullptr;
+				cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+				if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS )
+				{
+					timespec stamp;
+					memcpy( &stamp, CMSG_DATA( cmsg ), sizeof( stamp ) );
+					kernel_time = stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+				}
 
-			packet_sampling_queue.push_back( p );
+			return static_cast<int32_t>( len );
 		}
 
-		PacketType type = ClassifyPacket( buf, len, infrom );
-		if( type == PacketTypeInfo )
-			type = HandleInfoQuery( infrom );
-
-		if ( type == PacketTypePlayer)
-			type = HandlePlayerQuery(infrom);
-
-		if( type == PacketTypeInvalid )
-			return -1;
+#endif
 
-		return len;
+		return Hook_recvfrom( s, buf, buflen, flags, from, fromlen );
 	}
 
-	inline bool IsPacketQueueEmpty( )
+	inline void RecordLatency( LatencyStage stage, PacketType type, uint64_t start, uint64_t end )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		return threaded_socket_queue.empty( );
+		if( start == 0 || end < start )
+			return;
+
+		AUTO_LOCK( latency_histograms_mutex );
+		latency_histograms[stage][type + 1].Record( end - start );
 	}
 
-	static int32_t Hook_recvfrom_detour(
-		int32_t s,
-		char *buf,
-		int32_t buflen,
-		int32_t flags,
-		sockaddr *from,
-		int32_t *fromlen
+	// Queries, handshakes and rejections, everything else is too common to report.
+	inline void PushTrafficEvent(
+		uint32_t source,
+		uint16_t port,
+		const char *buf,
+		int32_t len,
+		PacketType type
 	)
 	{
-		bool queue_empty = IsPacketQueueEmpty( );
-		if( !threaded_socket_enabled && queue_empty )
-			return HandleNetError(
-				ReceiveAndAnalyzePacket( s, buf, buflen, flags, from, fromlen )
-			);
-
-		if( queue_empty )
-			return HandleNetError( -1 );
-
-		packet_t p = GetQueuedPacket( );
-		int32_t len = static_cast<int32_t>( p.buffer.size( ) );
-		if( len > buflen )
-			len = buflen;
-
-		size_t addrlen = static_cast<size_t>( *fromlen );
-		if( addrlen > sizeof( p.address ) )
-			addrlen = sizeof( p.address );
+		if( type == PacketTypeInvalid )
+		{
+			events::Push( events::KindRejected, source, port, events::ReasonInvalid );
+			return;
+		}
 
-		memcpy( buf, &p.buffer[0], len );
-		memcpy( from, &p.address, addrlen );
-		*fromlen = p.address_size;
+		if( len < 5 || *reinterpret_cast<const int32_t *>( buf ) != -1 )
+			return;
 
-		return len;
+		uint8_t oob_type = static_cast<uint8_t>( buf[4] );
+		if( type == PacketTypeInfo || type == PacketTypePlayer || oob_type == 'V' )
+			events::Push( events::KindQuery, source, port, oob_type );
+		else if( oob_type == 'q' || oob_type == 'k' )
+			events::Push( events::KindHandshake, source, port, oob_type );
 	}
 
-	inline bool IsPacketQueueFull( )
+	inline void CountPacket( engine_socket_t &socket, shared::Counter counter )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		return threaded_socket_queue.size( ) >= threaded_socket_max_queue;
+		socket.counters[counter].fetch_add( 1 );
+		shared::Increment( counter );
 	}
 
-	inline void PushPacketToQueue( const packet_t &p )
+	inline bool IsHandshake( const char *buf, int32_t len )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		threaded_socket_queue.push( p );
+		return len >= 5 && *reinterpret_cast<const int32_t *>( buf ) == -1 &&
+			( buf[4] == 'q' || buf[4] == 'k' );
 	}
 
-	static uint32_t PacketReceiverThread( void * )
+	// Everything done to a received packet besides receiving it, returns whether
+	// the engine should get it. Runs on whichever thread received the packet, or
+	// on the worker owning its source.
+	static bool AnalyzePacket(
+		engine_socket_t &socket,
+		const char *buf,
+		int32_t len,
+		const sockaddr_in &from,
+		uint64_t kernel_stamp,
+		uint64_t receive_stamp,
+		PacketType &traffic_class
+	)
 	{
-		timeval ms100 = { 0, 100000 };
-		char tempbuf[65535] = { 0 };
-		fd_set readables;
+		CountPacket( socket, shared::CounterReceived );
+		traffic_class = PacketTypeInvalid;
 
-		while( threaded_socket_execute )
+		uint32_t source = ntohl( from.sin_addr.s_addr );
+		if( bans::IsBanned( source, clock::Cached( ) ) || shared::IsBanned( source ) )
+		{
+			CountPacket( socket, shared::CounterBanned );
+			if( events::IsEnabled( ) )
+				events::Push(
+					events::KindRejected, source, ntohs( from.sin_port ), events::ReasonBanned
+				);
+
+			return false;
+		}
+
+		PacketType type = ClassifyPacket( buf, len, from, packet_validation_enabled );
+		traffic_class = type;
+		if( traffic_class == PacketTypeInvalid )
 		{
-			if( !threaded_socket_enabled || IsPacketQueueFull( ) )
-				// testing for maximum queue size, this is a very cheap "fix"
-				// the socket itself has a queue too but will start dropping packets when full
+			CountPacket( socket, shared::CounterInvalid );
+			if( bans::RecordInvalid( source, clock::Cached( ) ) )
 			{
-				ThreadSleep( 100 );
-				continue;
+				uint32_t duration = bans::GetDuration( );
+				shared::Ban( source, duration );
+				snapshot::SaveBan( source, duration );
+				CountPacket( socket, shared::CounterBans );
 			}
+		}
+		else if( traffic_class == PacketTypeInfo )
+		{
+			CountPacket( socket, shared::CounterInfoQueries );
+		}
+		else if( traffic_class == PacketTypePlayer )
+		{
+			CountPacket( socket, shared::CounterPlayerQueries );
+		}
 
-			FD_ZERO( &readables );
-			FD_SET( game_socket, &readables );
-			int res = select( game_socket + 1, &readables, nullptr, nullptr, &ms100 );
-			ms100.tv_usec = 100000;
-			if( res == -1 || !FD_ISSET( game_socket, &readables ) )
-				continue;
+		if( hitters::IsEnabled( ) )
+			hitters::Record( source, len, traffic_class, clock::Cached( ) );
 
-			packet_t p;
-			int32_t len = ReceiveAndAnalyzePacket(
-				game_socket,
-				tempbuf,
-				sizeof( tempbuf ),
-				0,
-				reinterpret_cast<sockaddr *>( &p.address ),
-				&p.address_size
-			);
-			if( len == -1 )
-				continue;
+		if( events::IsEnabled( ) )
+			PushTrafficEvent( source, ntohs( from.sin_port ), buf, len, traffic_class );
 
-			p.buffer.assign( tempbuf, tempbuf + len );
+		if( sampling::IsEnabled( ) )
+			sampling::Sample( from, buf, len, traffic_class );
 
-			PushPacketToQueue( p );
-		}
+		if( type == PacketTypeGood && handshakes::IsEnabled( ) && IsHandshake( buf, len ) &&
+			handshakes::Coalesce( from, static_cast<uint8_t>( buf[4] ), clock::Cached( ) ) )
+			return false;
 
-		return 0;
-	}
+		if( type == PacketTypeInfo )
+			type = HandleInfoQuery( socket, from, buf, len );
 
-	inline void SetReceiveDetourStatus( bool enabled )
-	{
-		if( enabled )
-			VCRHook_recvfrom = Hook_recvfrom_detour;
-		else if( !firewall_whitelist_enabled &&
-			!firewall_blacklist_enabled &&
-			!packet_validation_enabled &&
-			!threaded_socket_enabled )
-			VCRHook_recvfrom = Hook_recvfrom;
-	}
+		if ( type == PacketTypePlayer)
+			type = HandlePlayerQuery(socket, from, buf, len);
 
+		if( receive_stamp != 0 )
+		{
+			RecordLatency( LatencyKernelToReceiver, traffic_class, kernel_stamp, receive_stamp );
+
+			if( traffic_class == PacketTypeInfo || traffic_class == PacketTypePlayer )
+				RecordLatency(
+					LatencyQueryTurnaround,
+					traffic_class,
+					kernel_stamp != 0 ? kernel_stamp : receive_stamp,
+					GetRealtimeNanoseconds( )
+				);
+		}
+
+		return type != PacketTypeInvalid;
+	}
+
+	static int32_t ReceiveAndAnalyzePacket(
+		engine_socket_t &socket,
+		char *buf,
+		int32_t buflen,
+		int32_t flags,
+		sockaddr *from,
+		int32_t *fromlen,
+		uint64_t *kernel_time = nullptr,
+		uint64_t *receive_time = nullptr,
+		PacketType *traffic_class = nullptr
+	)
+	{
+		uint64_t kernel_stamp = 0;
+		int32_t len = ReceivePacket(
+			socket.handle, buf, buflen, flags, from, fromlen, kernel_stamp
+		);
+		if( len == -1 )
+			return -1;
+
+		uint64_t receive_stamp = latency_tracing_enabled ? GetRealtimeNanoseconds( ) : 0;
+		PacketType type;
+		if( !AnalyzePacket(
+			socket,
+			buf,
+			len,
+			*reinterpret_cast<sockaddr_in *>( from ),
+			kernel_stamp,
+			receive_stamp,
+			type
+		) )
+			return -1;
+
+		if( traffic_class != nullptr )
+			*traffic_class = type;
+
+		if( kernel_time != nullptr )
+			*kernel_time = kernel_stamp;
+
+		if( receive_time != nullptr )
+			*receive_time = receive_stamp;
+
+		return len;
+	}
+
+	// Worker side of the receiver, packets of the same source are handled by the
+	// same worker in arrival order, so they also reach the engine in that order.
+	// The receiver only checks the queue before dispatching, several workers can
+	// fill it in the meantime, so accepted packets that don't fit are dropped here.
+	static bool AnalyzeQueuedPacket( packet_t &p )
+	{
+		engine_socket_t &socket = *engine_sockets[p.socket];
+		if( !AnalyzePacket(
+			socket,
+			!p.buffer.empty( ) ? &p.buffer[0] : nullptr,
+			static_cast<int32_t>( p.buffer.size( ) ),
+			p.address,
+			p.kernel_time,
+			p.receive_time,
+			p.type
+		) )
+			return true;
+
+		return socket.queue.Push( p );
+	}
+
+	static engine_socket_t *FindSocket( SOCKET handle )
+	{
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			if( engine_sockets[k]->handle == handle )
+				return engine_sockets[k];
+
+		return nullptr;
+	}
+
+	static int32_t Hook_recvfrom_detour(
+		int32_t s,
+		char *buf,
+		int32_t buflen,
+		int32_t flags,
+		sockaddr *from,
+		int32_t *fromlen
+	)
+	{
+		engine_socket_t *socket = FindSocket( s );
+		if( socket == nullptr )
+			return Hook_recvfrom( s, buf, buflen, flags, from, fromlen );
+
+		if( !threaded_socket_enabled && socket->queue.Empty( ) )
+		{
+			// the game thread polls the socket once per packet, which is its own batch
+			clock::Refresh( );
+			return HandleNetError(
+				ReceiveAndAnalyzePacket( *socket, buf, buflen, flags, from, fromlen )
+			);
+		}
+
+		packet_t p;
+		if( !socket->queue.Pop( p ) )
+			return HandleNetError( -1 );
+
+		if( p.receive_time != 0 )
+			RecordLatency(
+				LatencyReceiverToDequeue,
+				p.type,
+				p.receive_time,
+				GetRealtimeNanoseconds( )
+			);
+
+		int32_t len = static_cast<int32_t>( p.buffer.size( ) );
+		if( len > buflen )
+			len = buflen;
+
+		size_t addrlen = static_cast<size_t>( *fromlen );
+		if( addrlen > sizeof( p.address ) )
+			addrlen = sizeof( p.address );
+
+		memcpy( buf, &p.buffer[0], len );
+		memcpy( from, &p.address, addrlen );
+		*fromlen = p.address_size;
+
+		return len;
+	}
+
+	static void ApplyReceiverSettings( )
+	{
+		receiver_settings_t settings;
+
+		{
+			AUTO_LOCK( receiver_settings_mutex );
+			settings = receiver_settings;
+			receiver_settings_dirty = false;
+		}
+
+		if( !scheduling::SetCurrentThreadAffinity( settings.cpus ) )
+			DebugWarning( "[spoof] Failed to set receiver thread CPU affinity\n" );
+
+		if( !scheduling::SetCurrentThreadPriority(
+			settings.policy, settings.priority, settings.nice
+		) )
+			DebugWarning( "[spoof] Failed to set receiver thread scheduling policy\n" );
+
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			if( !scheduling::SetSocketBusyPoll(
+				engine_sockets[k]->handle, settings.busy_poll_usec
+			) )
+				DebugWarning(
+					"[spoof] Failed to set SO_BUSY_POLL on socket %d\n", engine_sockets[k]->index
+				);
+
+		receiver_spin_usec = settings.spin_usec;
+
+		if( settings.workers != worker_pool.GetCount( ) && !worker_pool.Start( settings.workers ) )
+			DebugWarning( "[spoof] Failed to start packet workers, analyzing on the receiver\n" );
+	}
+
+	// Sockets whose queue still has room, returns false when every queue is full.
+	static bool GetReceivableSockets( fd_set &sockets, SOCKET &highest )
+	{
+		FD_ZERO( &sockets );
+		highest = 0;
+		bool any = false;
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+		{
+			engine_socket_t &socket = *engine_sockets[k];
+			if( socket.queue.Full( ) )
+				continue;
+
+			FD_SET( socket.handle, &sockets );
+			if( socket.handle > highest )
+				highest = socket.handle;
+
+			any = true;
+		}
+
+		return any;
+	}
+
+	inline bool AreSocketsReadable(
+		const fd_set &sockets,
+		SOCKET highest,
+		fd_set &readables,
+		timeval &timeout
+	)
+	{
+		readables = sockets;
+		int res = select( static_cast<int>( highest + 1 ), &readables, nullptr, nullptr, &timeout );
+		return res > 0;
+	}
+
+	// Spins on a non blocking poll for receiver_spin_usec (low latency mode),
+	// then blocks for at most 100ms. readables gets the sockets with packets.
+	static bool WaitForPackets( const fd_set &sockets, SOCKET highest, fd_set &readables )
+	{
+		if( receiver_spin_usec > 0 )
+		{
+			double deadline = Plat_FloatTime( ) + receiver_spin_usec / 1000000.0;
+			do
+			{
+				timeval nowait = { 0, 0 };
+				if( AreSocketsReadable( sockets, highest, readables, nowait ) )
+					return true;
+			}
+			while( Plat_FloatTime( ) < deadline );
+		}
+
+		timeval ms100 = { 0, 100000 };
+		return AreSocketsReadable( sockets, highest, readables, ms100 );
+	}
+
+	// Time between the kernel receiving the last packet and the receiver waking
+	// up for it, only available where SIOCGSTAMPNS exists.
+	static void RecordWakeupLatency( const engine_socket_t &socket, uint64_t wakeup )
+	{
+
+#if defined SYSTEM_LINUX && defined SIOCGSTAMPNS
+
+		timespec stamp;
+		if( ioctl( socket.handle, SIOCGSTAMPNS, &stamp ) == -1 )
+			return;
+
+		uint64_t received = stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+		uint64_t ns = wakeup > received ? wakeup - received : 0;
+
+		AUTO_LOCK( wakeup_latency_mutex );
+		if( wakeup_latency.count == 0 || ns < wakeup_latency.min )
+			wakeup_latency.min = ns;
+
+		if( ns > wakeup_latency.max )
+			wakeup_latency.max = ns;
+
+		wakeup_latency.total += ns;
+		++wakeup_latency.count;
+
+#else
+
+		( void )socket;
+		( void )wakeup;
+
+#endif
+
+	}
+
+	// Drains what the socket has buffered, up to receive_batch_size packets, and
+	// leaves their analysis to the workers.
+	static void ReceiveBatch(
+		engine_socket_t &socket,
+		size_t socket_index,
+		char *buf,
+		int32_t buflen,
+		std::vector<packet_t> &batch,
+		uint64_t wakeup
+	)
+	{
+		for( size_t k = 0; k < receive_batch_size; ++k )
+		{
+			packet_t p;
+			p.socket = socket_index;
+			int32_t len = ReceivePacket(
+				socket.handle,
+				buf,
+				buflen,
+				0,
+				reinterpret_cast<sockaddr *>( &p.address ),
+				&p.address_size,
+				p.kernel_time
+			);
+			if( len == -1 )
+				break;
+
+			// filtering happens later on the workers, so every wake up is measured
+			if( k == 0 && wakeup_latency_enabled )
+				RecordWakeupLatency( socket, wakeup );
+
+			if( latency_tracing_enabled )
+				p.receive_time = GetRealtimeNanoseconds( );
+
+			p.buffer.assign( buf, buf + len );
+			batch.push_back( std::move( p ) );
+		}
+	}
+
+	// Without workers the receiver analyzes the packet itself before queueing it.
+	static void ReceiveAndQueuePacket(
+		engine_socket_t &socket,
+		char *buf,
+		int32_t buflen,
+		uint64_t wakeup
+	)
+	{
+		packet_t p;
+		int32_t len = ReceiveAndAnalyzePacket(
+			socket,
+			buf,
+			buflen,
+			0,
+			reinterpret_cast<sockaddr *>( &p.address ),
+			&p.address_size,
+			&p.kernel_time,
+			&p.receive_time,
+			&p.type
+		);
+		if( len == -1 )
+			return;
+
+		// filtered packets can't be told apart from an empty socket here,
+		// so only packets handed to the engine are measured
+		if( wakeup_latency_enabled )
+			RecordWakeupLatency( socket, wakeup );
+
+		p.buffer.assign( buf, buf + len );
+
+		socket.queue.Push( p );
+	}
+
+	inline uint32_t GetCacheAge( uint32_t version, uint32_t last_update, uint32_t now )
+	{
+		return version != 0 ? GetElapsed( now, last_update ) : 0xFFFFFFFF;
+	}
+
+	// Snapshots everything into stats_page and hands it to the memory mapped page,
+	// at most once every stats_interval milliseconds.
+	static void PublishStats( )
+	{
+		uint32_t now = clock::Now( );
+		if( !stats::IsOpen( ) || now - stats_last_publish < stats_interval )
+			return;
+
+		stats_last_publish = now;
+
+		stats::page_t &page = stats_page;
+		memset( &page, 0, sizeof( page ) );
+		page.updated = GetRealtimeNanoseconds( ) / 1000000;
+		page.workers = static_cast<uint32_t>( worker_pool.GetCount( ) );
+		page.worker_dropped = worker_pool.GetDropped( );
+		page.handshakes_coalesced = handshakes::GetCoalesced( );
+
+		egress::totals_t egress_totals;
+		egress::GetTotals( egress_totals );
+		page.egress_bytes_in = egress_totals.bytes_in;
+		page.egress_bytes_out = egress_totals.bytes_out;
+		page.egress_replies = egress_totals.replies;
+		page.egress_challenges = egress_totals.challenges;
+		page.egress_dropped = egress_totals.dropped;
+
+		size_t socket_count = std::min<size_t>( engine_sockets.size( ), stats::max_sockets );
+		page.socket_count = static_cast<uint32_t>( socket_count );
+		for( size_t k = 0; k < socket_count; ++k )
+		{
+			engine_socket_t &socket = *engine_sockets[k];
+			stats::socket_stats_t &entry = page.sockets[k];
+			entry.index = socket.index;
+			entry.port = socket.port;
+			entry.queued = static_cast<uint32_t>( socket.queue.Size( ) );
+			entry.answer_queries = socket.answer_queries ? 1 : 0;
+
+			for( size_t c = 0; c < shared::CounterCount; ++c )
+			{
+				entry.counters[c] = socket.counters[c];
+				page.counters[c] += entry.counters[c];
+			}
+
+			AUTO_LOCK( requester_class_mutex );
+			entry.info_cache_age =
+				GetCacheAge( socket.info_cache_version, socket.info_cache_last_update, now );
+			entry.player_cache_age =
+				GetCacheAge( socket.player_cache_version, socket.player_cache_last_update, now );
+		}
+
+		{
+			AUTO_LOCK( latency_histograms_mutex );
+			for( size_t stage = 0; stage < LatencyStageCount; ++stage )
+				for( size_t type = 0; type < traffic_class_count; ++type )
+				{
+					const LatencyHistogram &histogram = latency_histograms[stage][type];
+					stats::histogram_t &entry = page.latency[stage][type];
+					entry.count = histogram.GetCount( );
+					entry.total = histogram.GetTotal( );
+					for( size_t b = 0; b < LatencyHistogram::bucket_count; ++b )
+						entry.buckets[b] = histogram.GetBucket( b );
+				}
+		}
+
+		{
+			AUTO_LOCK( wakeup_latency_mutex );
+			page.wakeup_count = wakeup_latency.count;
+			page.wakeup_total = wakeup_latency.total;
+			page.wakeup_min = wakeup_latency.min;
+			page.wakeup_max = wakeup_latency.max;
+		}
+
+		stats::Publish( page );
+	}
+
+	// One loop multiplexes every filtered socket, each readable socket gets a
+	// packet (or a batch with workers) per wake up so none can starve the others.
+	static uint32_t PacketReceiverThread( void * )
+	{
+		char tempbuf[65535] = { 0 };
+		std::vector<packet_t> batch;
+		batch.reserve( receive_batch_size * engine_sockets.size( ) );
+
+		while( threaded_socket_execute )
+		{
+			if( receiver_settings_dirty )
+				ApplyReceiverSettings( );
+
+			shared::Heartbeat( );
+			PublishStats( );
+
+			fd_set sockets, readables;
+			SOCKET highest = 0;
+			if( !threaded_socket_enabled || !GetReceivableSockets( sockets, highest ) )
+			{
+				ThreadSleep( 100 );
+				continue;
+			}
+
+			if( !WaitForPackets( sockets, highest, readables ) )
+				continue;
+
+			clock::Refresh( );
+
+			uint64_t wakeup = wakeup_latency_enabled ? GetRealtimeNanoseconds( ) : 0;
+
+			bool workers = worker_pool.GetCount( ) != 0;
+			for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			{
+				engine_socket_t &socket = *engine_sockets[k];
+				if( !FD_ISSET( socket.handle, &readables ) )
+					continue;
+
+				if( workers )
+					ReceiveBatch( socket, k, tempbuf, sizeof( tempbuf ), batch, wakeup );
+				else
+					ReceiveAndQueuePacket( socket, tempbuf, sizeof( tempbuf ), wakeup );
+			}
+
+			if( workers )
+				worker_pool.Dispatch( batch );
+		}
+
+		// whatever the workers still hold is handed to the engine before leaving
+		worker_pool.Stop( );
+		return 0;
+	}
+
+	// Everything that only works while the engine's receives go through the
+	// detour, packet validation just applies to whatever they let through.
+	static bool IsReceiveDetourNeeded( )
+	{
+		return threaded_socket_enabled ||
+			firewall_whitelist_enabled ||
+			firewall_blacklist_enabled ||
+			bans::IsAutomatic( ) ||
+			bans::HasBans( ) ||
+			shared::IsAttached( ) ||
+			handshakes::IsEnabled( ) ||
+			hitters::IsEnabled( ) ||
+			sampling::IsEnabled( ) ||
+			events::IsEnabled( ) ||
+			latency_tracing_enabled;
+	}
+
+	// Called after changing anything IsReceiveDetourNeeded( ) looks at.
+	inline void UpdateReceiveDetour( )
+	{
+		VCRHook_recvfrom = IsReceiveDetourNeeded( ) ? Hook_recvfrom_detour : Hook_recvfrom;
+	}
+
+
+	// Optional requester class argument, defaults to the class answering everyone else.
+	// Validated before taking requester_class_mutex since Lua errors don't unwind.
+	static size_t CheckRequesterClass( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+	{
+		if( LUA->Top( ) < index || LUA->IsType( index, GarrysMod::Lua::Type::NIL ) )
+			return 0;
+
+		LUA->CheckType( index, GarrysMod::Lua::Type::NUMBER );
+		double class_index = LUA->GetNumber( index );
+		if( class_index < 0 || class_index >= requester_classes.size( ) )
+			LUA->ArgError( index, "invalid requester class" );
+
+		return static_cast<size_t>( class_index );
+	}
 
 	LUA_FUNCTION_STATIC( EnablePlayerSpoofing )
 	{
-		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
-		player_spoofing_enabled = LUA->GetBool( 1 );
-		threaded_socket_enabled = player_spoofing_enabled;
-		SetReceiveDetourStatus( threaded_socket_enabled );
+		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
+		bool enabled = LUA->GetBool( 1 );
+		player_spoofing_enabled = enabled;
+		threaded_socket_enabled = enabled;
+		UpdateReceiveDetour( );
+
+		snapshot_settings.spoofing_enabled = enabled;
+		snapshot::SaveSettings( snapshot_settings );
+
+		AUTO_LOCK( requester_class_mutex );
+		++info_cache_version;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPlayerCount )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::NUMBER );
+		size_t class_index = CheckRequesterClass( LUA, 2 );
+
+		AUTO_LOCK( requester_class_mutex );
+		requester_classes[class_index].spoof_count = static_cast<uint32_t>( LUA->GetNumber( 1 ) );
+		++info_cache_version;
+		snapshot::SaveSpoofCount(
+			static_cast<uint32_t>( class_index ), requester_classes[class_index].spoof_count
+		);
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( ResetPlayerList )
+	{
+		size_t class_index = CheckRequesterClass( LUA, 1 );
+
+		AUTO_LOCK( requester_class_mutex );
+		player_table &game_players = requester_classes[class_index].players;
+		game_players.players.clear();
+		game_players.count = 0;
+		++player_cache_version;
+		snapshot::SavePlayerCount( static_cast<uint32_t>( class_index ), 0 );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( AddPlayer )
+	{
+		player_t player;
+
+		LUA->CheckType(1, GarrysMod::Lua::Type::STRING);
+		player.name = LUA->GetString(1);
+
+		LUA->CheckType(2, GarrysMod::Lua::Type::NUMBER);
+		player.score = LUA->GetNumber(2);
+
+		LUA->CheckType(3, GarrysMod::Lua::Type::NUMBER);
+		player.time = LUA->GetNumber(3);
+
+		size_t class_index = CheckRequesterClass(LUA, 4);
+
+		// the player count is a single byte on the wire
+		if (requester_classes[class_index].players.players.size() >= 255)
+			LUA->ThrowError("player list is full (255 players)");
+
+		AUTO_LOCK( requester_class_mutex );
+		player_table &game_players = requester_classes[class_index].players;
+		game_players.players.push_back(player);
+		game_players.count = game_players.players.size();
+		++player_cache_version;
+
+		snapshot::SavePlayer(
+			static_cast<uint32_t>( class_index ),
+			game_players.count - 1,
+			player.name.c_str( ),
+			player.name.size( ),
+			player.score,
+			player.time
+		);
+		snapshot::SavePlayerCount( static_cast<uint32_t>( class_index ), game_players.count );
+
+		return 0;
+
+	}
+
+	LUA_FUNCTION_STATIC( SetInfoCacheTime )
+	{
+		double ms = LUA->CheckNumber( 1 );
+		if( ms < 0 )
+			LUA->ArgError( 1, "cache time must be positive" );
+
+		AUTO_LOCK( requester_class_mutex );
+		info_cache_time = static_cast<uint32_t>( ms );
+		snapshot_settings.info_cache_time = info_cache_time;
+		snapshot::SaveSettings( snapshot_settings );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPlayerCacheTime )
+	{
+		double ms = LUA->CheckNumber( 1 );
+		if( ms < 0 )
+			LUA->ArgError( 1, "cache time must be positive" );
+
+		AUTO_LOCK( requester_class_mutex );
+		player_cache_time = static_cast<uint32_t>( ms );
+		snapshot_settings.player_cache_time = player_cache_time;
+		snapshot::SaveSettings( snapshot_settings );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetReceiverAffinity )
+	{
+		std::vector<int32_t> cpus;
+		if( !LUA->IsType( 1, GarrysMod::Lua::Type::NIL ) )
+		{
+			LUA->CheckType( 1, GarrysMod::Lua::Type::TABLE );
+
+			int32_t count = LUA->ObjLen( 1 );
+			for( int32_t k = 1; k <= count; ++k )
+			{
+				LUA->PushNumber( k );
+				LUA->GetTable( 1 );
+				bool valid = LUA->IsType( -1, GarrysMod::Lua::Type::NUMBER );
+				if( valid )
+					cpus.push_back( static_cast<int32_t>( LUA->GetNumber( -1 ) ) );
+
+				LUA->Pop( 1 );
+				if( !valid )
+					break;
+			}
+
+			if( static_cast<int32_t>( cpus.size( ) ) != count )
+			{
+				std::vector<int32_t>( ).swap( cpus );
+				LUA->ArgError( 1, "CPU list must only contain numbers" );
+			}
+		}
+
+		AUTO_LOCK( receiver_settings_mutex );
+		receiver_settings.cpus.swap( cpus );
+		receiver_settings_dirty = true;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetReceiverPriority )
+	{
+		scheduling::Policy policy = scheduling::ParsePolicy( LUA->CheckString( 1 ) );
+		if( policy == scheduling::PolicyInvalid )
+			LUA->ArgError( 1, "unknown policy (default, batch, idle, fifo or rr)" );
+
+		int32_t priority = static_cast<int32_t>( LUA->CheckNumber( 2 ) );
+		int32_t nice = static_cast<int32_t>( LUA->CheckNumber( 3 ) );
+
+		AUTO_LOCK( receiver_settings_mutex );
+		receiver_settings.policy = policy;
+		receiver_settings.priority = priority;
+		receiver_settings.nice = nice;
+		receiver_settings_dirty = true;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetLowLatencyMode )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
+		bool enabled = LUA->GetBool( 1 );
+		int32_t busy_poll = 0, spin = 0;
+		if( enabled )
+		{
+			busy_poll = static_cast<int32_t>( LUA->CheckNumber( 2 ) );
+			spin = static_cast<int32_t>( LUA->CheckNumber( 3 ) );
+		}
+
+		AUTO_LOCK( receiver_settings_mutex );
+		receiver_settings.busy_poll_usec = busy_poll;
+		receiver_settings.spin_usec = spin;
+		receiver_settings_dirty = true;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetWorkerCount )
+	{
+		double count = LUA->CheckNumber( 1 );
+		if( count < 0 || count > WorkerPool::max_workers )
+			LUA->ArgError( 1, "worker count must be between 0 and 64" );
+
+		AUTO_LOCK( receiver_settings_mutex );
+		receiver_settings.workers = static_cast<size_t>( count );
+		receiver_settings_dirty = true;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( GetWorkerStats )
+	{
+		LUA->CreateTable( );
+
+		LUA->PushNumber( static_cast<double>( worker_pool.GetCount( ) ) );
+		LUA->SetField( -2, "workers" );
+
+		LUA->PushNumber( static_cast<double>( worker_pool.GetDropped( ) ) );
+		LUA->SetField( -2, "dropped" );
+
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( SetLatencyTracing )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
+		bool enabled = LUA->GetBool( 1 );
+
+#if defined SYSTEM_LINUX && defined SO_TIMESTAMPNS
+
+		int32_t value = enabled ? 1 : 0;
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			if( setsockopt(
+				engine_sockets[k]->handle, SOL_SOCKET, SO_TIMESTAMPNS, &value, sizeof( value )
+			) == -1 )
+				DebugWarning(
+					"[spoof] Failed to set SO_TIMESTAMPNS on socket %d\n", engine_sockets[k]->index
+				);
+
+#endif
+
+		latency_tracing_enabled = enabled;
+		UpdateReceiveDetour( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( GetLatencyHistograms )
+	{
+		LatencyHistogram histograms[LatencyStageCount][traffic_class_count];
+
+		{
+			AUTO_LOCK( latency_histograms_mutex );
+			memcpy( histograms, latency_histograms, sizeof( histograms ) );
+		}
+
+		// { stage = { class = { count = n, total = ns,
+		//     buckets = { [k + 1] = samples in [2^k, 2^(k+1)) ns } } } }
+		LUA->CreateTable( );
+		for( size_t stage = 0; stage < LatencyStageCount; ++stage )
+		{
+			LUA->CreateTable( );
+			for( size_t type = 0; type < traffic_class_count; ++type )
+			{
+				const LatencyHistogram &histogram = histograms[stage][type];
+
+				LUA->CreateTable( );
+
+				LUA->PushNumber( static_cast<double>( histogram.GetCount( ) ) );
+				LUA->SetField( -2, "count" );
+
+				LUA->PushNumber( static_cast<double>( histogram.GetTotal( ) ) );
+				LUA->SetField( -2, "total" );
+
+				LUA->CreateTable( );
+				for( size_t k = 0; k < LatencyHistogram::bucket_count; ++k )
+				{
+					LUA->PushNumber( static_cast<double>( k + 1 ) );
+					LUA->PushNumber( static_cast<double>( histogram.GetBucket( k ) ) );
+					LUA->SetTable( -3 );
+				}
+
+				LUA->SetField( -2, "buckets" );
+
+				LUA->SetField( -2, traffic_class_names[type] );
+			}
+
+			LUA->SetField( -2, latency_stage_names[stage] );
+		}
+
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( ResetLatencyHistograms )
+	{
+		AUTO_LOCK( latency_histograms_mutex );
+		for( size_t stage = 0; stage < LatencyStageCount; ++stage )
+			for( size_t type = 0; type < traffic_class_count; ++type )
+				latency_histograms[stage][type].Reset( );
+
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetWakeupLatencyTracking )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
+		wakeup_latency_enabled = LUA->GetBool( 1 );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( GetWakeupLatency )
+	{
+		wakeup_latency_t latency;
+
+		{
+			AUTO_LOCK( wakeup_latency_mutex );
+			latency = wakeup_latency;
+		}
+
+		LUA->CreateTable( );
+
+		LUA->PushNumber( static_cast<double>( latency.count ) );
+		LUA->SetField( -2, "count" );
+
+		// microseconds
+		LUA->PushNumber( latency.min / 1000.0 );
+		LUA->SetField( -2, "min" );
+
+		LUA->PushNumber( latency.max / 1000.0 );
+		LUA->SetField( -2, "max" );
+
+		LUA->PushNumber( latency.count != 0 ? latency.total / 1000.0 / latency.count : 0.0 );
+		LUA->SetField( -2, "average" );
+
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( ResetWakeupLatency )
+	{
+		AUTO_LOCK( wakeup_latency_mutex );
+		wakeup_latency = wakeup_latency_t( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( AddRequesterClass )
+	{
+		const char *name = LUA->CheckString( 1 );
+
+		AUTO_LOCK( requester_class_mutex );
+		requester_classes.push_back( requester_class_t( name ) );
+		++info_cache_version;
+		++player_cache_version;
+		snapshot::SaveClass(
+			static_cast<uint32_t>( requester_classes.size( ) - 1 ),
+			name,
+			requester_classes.back( ).spoof_count
+		);
+
+		LUA->PushNumber( static_cast<double>( requester_classes.size( ) - 1 ) );
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( AddRequesterRange )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::NUMBER );
+		size_t class_index = CheckRequesterClass( LUA, 1 );
+		const char *cidr = LUA->CheckString( 2 );
+
+		uint32_t network = 0, mask = 0;
+		if( !ParseCIDR( cidr, network, mask ) )
+			LUA->ArgError( 2, "invalid CIDR" );
+
+		requester_cidr_t range;
+		range.first = network;
+		range.last = range.first | ~mask;
+		range.class_index = class_index;
+
+		AUTO_LOCK( requester_class_mutex );
+		requester_cidrs.push_back( range );
+		BuildRequesterRanges( );
+		snapshot::SaveCIDR(
+			static_cast<uint32_t>( requester_cidrs.size( ) - 1 ),
+			range.first,
+			range.last,
+			static_cast<uint32_t>( class_index )
+		);
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( ResetRequesterClasses )
+	{
+		AUTO_LOCK( requester_class_mutex );
+		requester_classes.erase( requester_classes.begin( ) + 1, requester_classes.end( ) );
+		requester_cidrs.clear( );
+		BuildRequesterRanges( );
+		++info_cache_version;
+		++player_cache_version;
+		snapshot::SaveClassCount( 1 );
+		snapshot::SaveCIDRCount( 0 );
+		return 0;
+	}
+
+
+	static int32_t ParseTrafficClass( const char *name )
+	{
+		for( size_t k = 0; k < traffic_class_count; ++k )
+			if( strcmp( traffic_class_names[k], name ) == 0 )
+				return static_cast<int32_t>( k );
+
+		return -1;
+	}
+
+	// SetPacketSampling( "off" | "rate" | "reservoir", [1 in N], [{
+	//     types = { "invalid", "good", "info", "player" }, oob = "T", cidr = "a.b.c.d/n"
+	// }] )
+	LUA_FUNCTION_STATIC( SetPacketSampling )
+	{
+		const char *mode_name = LUA->CheckString( 1 );
+		sampling::Mode mode = sampling::ModeDisabled;
+		if( strcmp( mode_name, "rate" ) == 0 )
+			mode = sampling::ModeRate;
+		else if( strcmp( mode_name, "reservoir" ) == 0 )
+			mode = sampling::ModeReservoir;
+		else if( strcmp( mode_name, "off" ) != 0 )
+			LUA->ArgError( 1, "unknown sampling mode (off, rate or reservoir)" );
+
+		uint32_t rate = 1;
+		if( mode == sampling::ModeRate )
+		{
+			double n = LUA->CheckNumber( 2 );
+			if( n < 1 )
+				LUA->ArgError( 2, "sampling rate must be at least 1" );
+
+			rate = static_cast<uint32_t>( n );
+		}
+
+		sampling::filter_t filter;
+		if( !LUA->IsType( 3, GarrysMod::Lua::Type::NIL ) )
+		{
+			LUA->CheckType( 3, GarrysMod::Lua::Type::TABLE );
+
+			LUA->GetField( 3, "types" );
+			if( LUA->IsType( -1, GarrysMod::Lua::Type::TABLE ) )
+			{
+				filter.types = 0;
+				int32_t count = LUA->ObjLen( -1 );
+				for( int32_t k = 1; k <= count; ++k )
+				{
+					LUA->PushNumber( k );
+					LUA->GetTable( -2 );
+					int32_t type = LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) ?
+						ParseTrafficClass( LUA->GetString( -1 ) ) : -1;
+					LUA->Pop( 1 );
+					if( type == -1 )
+						LUA->ArgError( 3, "types must only contain invalid, good, info or player" );
+
+					filter.types |= 1U << type;
+				}
+			}
+			LUA->Pop( 1 );
+
+			LUA->GetField( 3, "oob" );
+			if( LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) )
+				filter.oob_type = static_cast<uint8_t>( LUA->GetString( -1 )[0] );
+			else if( LUA->IsType( -1, GarrysMod::Lua::Type::NUMBER ) )
+				filter.oob_type = static_cast<uint8_t>( LUA->GetNumber( -1 ) );
+			LUA->Pop( 1 );
+
+			LUA->GetField( 3, "cidr" );
+			bool valid = !LUA->IsType( -1, GarrysMod::Lua::Type::STRING ) ||
+				ParseCIDR( LUA->GetString( -1 ), filter.network, filter.mask );
+			LUA->Pop( 1 );
+			if( !valid )
+				LUA->ArgError( 3, "invalid CIDR" );
+		}
+
+		sampling::Configure( mode, rate, filter );
+		UpdateReceiveDetour( );
+		return 0;
+	}
+
+	// GetPacketSamples( [max] ) returns { { ip, port, length, type, oob, data, sequence } },
+	// oldest first, oob is only set for connectionless packets
+	LUA_FUNCTION_STATIC( GetPacketSamples )
+	{
+		size_t max = sampling::max_samples;
+		if( !LUA->IsType( 1, GarrysMod::Lua::Type::NIL ) )
+			max = static_cast<size_t>( std::max( LUA->CheckNumber( 1 ), 0.0 ) );
+
+		std::vector<sampling::sample_t> samples;
+		sampling::Drain( samples, max );
+
+		LUA->CreateTable( );
+		for( size_t k = 0; k < samples.size( ); ++k )
+		{
+			const sampling::sample_t &sample = samples[k];
+
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
+
+			char ip[ip_string_size];
+			LUA->PushString( IPToString( sample.address.sin_addr, ip, sizeof( ip ) ) );
+			LUA->SetField( -2, "ip" );
+
+			LUA->PushNumber( ntohs( sample.address.sin_port ) );
+			LUA->SetField( -2, "port" );
+
+			LUA->PushNumber( sample.length );
+			LUA->SetField( -2, "length" );
+
+			LUA->PushString( traffic_class_names[sample.type + 1] );
+			LUA->SetField( -2, "type" );
+
+			if( sample.data.size( ) >= 5 &&
+				*reinterpret_cast<const int32_t *>( &sample.data[0] ) == -1 )
+			{
+				LUA->PushNumber( static_cast<uint8_t>( sample.data[4] ) );
+				LUA->SetField( -2, "oob" );
+			}
+
+			if( sample.data.empty( ) )
+				LUA->PushString( "" );
+			else
+				LUA->PushString( &sample.data[0], static_cast<unsigned int>( sample.data.size( ) ) );
+			LUA->SetField( -2, "data" );
+
+			LUA->PushNumber( sample.sequence );
+			LUA->SetField( -2, "sequence" );
+
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	// Parses a dotted IPv4 address into host byte order.
+	static uint32_t CheckAddress( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+	{
+		in_addr address;
+		if( inet_pton( AF_INET, LUA->CheckString( index ), &address ) != 1 )
+			LUA->ArgError( index, "invalid IPv4 address" );
+
+		return ntohl( address.s_addr );
+	}
+
+	// SetBanThreshold( invalid packets, seconds ), 0 packets disables automatic bans
+	LUA_FUNCTION_STATIC( SetBanThreshold )
+	{
+		double count = LUA->CheckNumber( 1 );
+		double seconds = LUA->CheckNumber( 2 );
+		if( count < 0 )
+			LUA->ArgError( 1, "packet count must be positive" );
+
+		if( seconds <= 0 )
+			LUA->ArgError( 2, "window must be positive" );
+
+		bans::SetThreshold(
+			static_cast<uint32_t>( count ),
+			static_cast<uint32_t>( seconds * 1000 )
+		);
+		UpdateReceiveDetour( );
+
+		snapshot_settings.ban_threshold = static_cast<uint32_t>( count );
+		snapshot_settings.ban_window = static_cast<uint32_t>( seconds * 1000 );
+		snapshot::SaveSettings( snapshot_settings );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetBanDuration )
+	{
+		double seconds = LUA->CheckNumber( 1 );
+		if( seconds <= 0 )
+			LUA->ArgError( 1, "duration must be positive" );
+
+		bans::SetDuration( static_cast<uint32_t>( seconds * 1000 ) );
+
+		snapshot_settings.ban_duration = static_cast<uint32_t>( seconds * 1000 );
+		snapshot::SaveSettings( snapshot_settings );
+		return 0;
+	}
+
+	// SetHandshakeCoalescing( milliseconds ), 0 disables it
+	LUA_FUNCTION_STATIC( SetHandshakeCoalescing )
+	{
+		double ms = LUA->CheckNumber( 1 );
+		if( ms < 0 )
+			LUA->ArgError( 1, "window must be positive" );
+
+		handshakes::SetWindow( static_cast<uint32_t>( ms ) );
+		UpdateReceiveDetour( );
+
+		snapshot_settings.handshake_window = static_cast<uint32_t>( ms );
+		snapshot::SaveSettings( snapshot_settings );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( GetCoalescedHandshakes )
+	{
+		LUA->PushNumber( static_cast<double>( handshakes::GetCoalesced( ) ) );
+		return 1;
+	}
+
+	// SetEgressBudget( bytes per second, replies per second, [burst milliseconds],
+	//     ["challenge" | "drop"] ), 0 leaves a rate unlimited. Challenged queries
+	// are answered once they come back with the challenge.
+	LUA_FUNCTION_STATIC( SetEgressBudget )
+	{
+		double bytes = LUA->CheckNumber( 1 );
+		if( bytes < 0 )
+			LUA->ArgError( 1, "rate must be positive" );
+
+		double replies = LUA->CheckNumber( 2 );
+		if( replies < 0 )
+			LUA->ArgError( 2, "rate must be positive" );
+
+		uint32_t burst = 200;
+		if( !LUA->IsType( 3, GarrysMod::Lua::Type::NIL ) )
+		{
+			double ms = LUA->CheckNumber( 3 );
+			if( ms <= 0 )
+				LUA->ArgError( 3, "burst must be positive" );
+
+			burst = static_cast<uint32_t>( ms );
+		}
+
+		egress::Fallback fallback = egress::FallbackChallenge;
+		if( !LUA->IsType( 4, GarrysMod::Lua::Type::NIL ) )
+		{
+			const char *name = LUA->CheckString( 4 );
+			if( strcmp( name, "drop" ) == 0 )
+				fallback = egress::FallbackDrop;
+			else if( strcmp( name, "challenge" ) != 0 )
+				LUA->ArgError( 4, "unknown fallback (challenge or drop)" );
+		}
+
+		snapshot_settings.egress_bytes = static_cast<uint32_t>( std::min( bytes, 4294967295.0 ) );
+		snapshot_settings.egress_replies =
+			static_cast<uint32_t>( std::min( replies, 4294967295.0 ) );
+		snapshot_settings.egress_burst = burst;
+		snapshot_settings.egress_fallback = fallback;
+		snapshot::SaveSettings( snapshot_settings );
+
+		egress::SetBudget(
+			snapshot_settings.egress_bytes,
+			snapshot_settings.egress_replies,
+			burst,
+			fallback
+		);
+		return 0;
+	}
+
+	// { bytes_in, bytes_out, replies, challenges, dropped, amplification }, for the
+	// queries the module answers itself
+	LUA_FUNCTION_STATIC( GetEgressStats )
+	{
+		egress::totals_t totals;
+		egress::GetTotals( totals );
+
+		LUA->CreateTable( );
+
+		LUA->PushNumber( static_cast<double>( totals.bytes_in ) );
+		LUA->SetField( -2, "bytes_in" );
+
+		LUA->PushNumber( static_cast<double>( totals.bytes_out ) );
+		LUA->SetField( -2, "bytes_out" );
+
+		LUA->PushNumber( static_cast<double>( totals.replies ) );
+		LUA->SetField( -2, "replies" );
+
+		LUA->PushNumber( static_cast<double>( totals.challenges ) );
+		LUA->SetField( -2, "challenges" );
+
+		LUA->PushNumber( static_cast<double>( totals.dropped ) );
+		LUA->SetField( -2, "dropped" );
+
+		LUA->PushNumber(
+			totals.bytes_in != 0 ?
+				static_cast<double>( totals.bytes_out ) / totals.bytes_in : 0.0
+		);
+		LUA->SetField( -2, "amplification" );
+
+		return 1;
+	}
+
+	// Whether this load picked up the state of the last one, so Lua can skip
+	// configuring everything again.
+	LUA_FUNCTION_STATIC( IsRestored )
+	{
+		LUA->PushBool( snapshot_restored );
+		return 1;
+	}
+
+	// AddBan( ip, [seconds] ), defaults to the automatic ban duration
+	LUA_FUNCTION_STATIC( AddBan )
+	{
+		uint32_t address = CheckAddress( LUA, 1 );
+		uint32_t duration = bans::GetDuration( );
+		if( !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+		{
+			double seconds = LUA->CheckNumber( 2 );
+			if( seconds <= 0 )
+				LUA->ArgError( 2, "duration must be positive" );
+
+			duration = static_cast<uint32_t>( seconds * 1000 );
+		}
+
+		shared::Ban( address, duration );
+		bool added = bans::Add( address, duration, clock::Now( ) );
+		if( added )
+			snapshot::SaveBan( address, duration );
+
+		UpdateReceiveDetour( );
+
+		LUA->PushBool( added );
+		return 1;
+	}
+
+	// ClearBans( [ip] ), clears every ban without an address
+	LUA_FUNCTION_STATIC( ClearBans )
+	{
+		if( LUA->IsType( 1, GarrysMod::Lua::Type::NIL ) )
+		{
+			bans::Clear( );
+			shared::Clear( );
+			snapshot::ClearBans( );
+			UpdateReceiveDetour( );
+			return 0;
+		}
+
+		uint32_t address = CheckAddress( LUA, 1 );
+		shared::Unban( address );
+		snapshot::RemoveBan( address );
+		LUA->PushBool( bans::Remove( address ) );
+		UpdateReceiveDetour( );
+		return 1;
+	}
+
+	// GetBans( ) returns { { ip, remaining = seconds, hits } }
+	LUA_FUNCTION_STATIC( GetBans )
+	{
+		std::vector<bans::ban_t> list;
+		bans::List( list, clock::Now( ) );
+
+		LUA->CreateTable( );
+		for( size_t k = 0; k < list.size( ); ++k )
+		{
+			const bans::ban_t &ban = list[k];
+
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
+
+			in_addr address;
+			address.s_addr = htonl( ban.address );
+			char ip[ip_string_size];
+			LUA->PushString( IPToString( address, ip, sizeof( ip ) ) );
+			LUA->SetField( -2, "ip" );
+
+			LUA->PushNumber( ban.remaining / 1000.0 );
+			LUA->SetField( -2, "remaining" );
+
+			LUA->PushNumber( ban.hits );
+			LUA->SetField( -2, "hits" );
+
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	// AttachSharedMemory( name ) shares bans and stats with the other instances
+	// on this host mapping the same name, returns false and an error on failure
+	LUA_FUNCTION_STATIC( AttachSharedMemory )
+	{
+		const char *name = LUA->CheckString( 1 );
+
+		const char *error = nullptr;
+		if( !shared::Attach( name, reply_info.udp_port, error ) )
+		{
+			LUA->PushBool( false );
+			LUA->PushString( error );
+			return 2;
+		}
+
+		UpdateReceiveDetour( );
+		LUA->PushBool( true );
+		return 1;
+	}
+
+	// OpenStatsPage( path, [interval ms] ), publishes stats to a memory mapped file
+	LUA_FUNCTION_STATIC( OpenStatsPage )
+	{
+		const char *path = LUA->CheckString( 1 );
+		double interval = 250;
+		if( LUA->Top( ) >= 2 && !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+		{
+			interval = LUA->CheckNumber( 2 );
+			if( interval < 1 )
+				LUA->ArgError( 2, "interval must be at least 1 millisecond" );
+		}
+
+		stats_interval = static_cast<uint32_t>( interval );
+
+		const char *error = nullptr;
+		if( !stats::Open( path, error ) )
+		{
+			LUA->PushBool( false );
+			LUA->PushString( error );
+			return 2;
+		}
+
+		LUA->PushBool( true );
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( CloseStatsPage )
+	{
+		stats::Close( );
 		return 0;
 	}
 
-	LUA_FUNCTION_STATIC( SetPlayerCount )
+	// GetSharedStats( ) returns { { pid, port, age = seconds, received, invalid, banned,
+	// info, player, bans } } for every instance attached to the segment
+	LUA_FUNCTION_STATIC( GetSharedStats )
 	{
-		LUA->CheckType( 1, GarrysMod::Lua::Type::NUMBER );
-		player_spoof_count = static_cast<uint32_t>( LUA->GetNumber( 1 ) );
+		std::vector<shared::instance_t> instances;
+		shared::GetInstances( instances );
+
+		LUA->CreateTable( );
+		for( size_t k = 0; k < instances.size( ); ++k )
+		{
+			const shared::instance_t &instance = instances[k];
+
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
+
+			LUA->PushNumber( instance.pid );
+			LUA->SetField( -2, "pid" );
+
+			LUA->PushNumber( instance.port );
+			LUA->SetField( -2, "port" );
+
+			LUA->PushNumber( instance.age );
+			LUA->SetField( -2, "age" );
+
+			for( size_t c = 0; c < shared::CounterCount; ++c )
+			{
+				LUA->PushNumber( static_cast<double>( instance.counters[c] ) );
+				LUA->SetField( -2, stats::counter_names[c] );
+			}
+
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	// { { index = net_sockets slot, port = n, queued = n, answers_queries = bool,
+	//     received = n, invalid = n, ... }, ... }, the game socket comes first
+	LUA_FUNCTION_STATIC( GetSocketStats )
+	{
+		LUA->CreateTable( );
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+		{
+			engine_socket_t &socket = *engine_sockets[k];
+
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
+
+			LUA->PushNumber( socket.index );
+			LUA->SetField( -2, "index" );
+
+			LUA->PushNumber( socket.port );
+			LUA->SetField( -2, "port" );
+
+			LUA->PushNumber( static_cast<double>( socket.queue.Size( ) ) );
+			LUA->SetField( -2, "queued" );
+
+			LUA->PushBool( socket.answer_queries );
+			LUA->SetField( -2, "answers_queries" );
+
+			for( size_t c = 0; c < shared::CounterCount; ++c )
+			{
+				LUA->PushNumber( static_cast<double>( socket.counters[c].load( ) ) );
+				LUA->SetField( -2, stats::counter_names[c] );
+			}
+
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	// SetSocketQueryCaching( port, enabled ), only the game socket answers queries from
+	// the module's caches by default, SourceTV's own replies differ from the game's.
+	LUA_FUNCTION_STATIC( SetSocketQueryCaching )
+	{
+		int32_t port = static_cast<int32_t>( LUA->CheckNumber( 1 ) );
+		LUA->CheckType( 2, GarrysMod::Lua::Type::BOOL );
+
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			if( engine_sockets[k]->port == port )
+			{
+				engine_sockets[k]->answer_queries = LUA->GetBool( 2 );
+				return 0;
+			}
+
+		LUA->ArgError( 1, "no filtered socket uses this port" );
 		return 0;
 	}
 
-	LUA_FUNCTION_STATIC( ResetPlayerList )
+	// SetHeavyHitterTracking( enabled, [window seconds] ), counts halve every window
+	LUA_FUNCTION_STATIC( SetHeavyHitterTracking )
 	{
-		game_players.players.clear();
-		game_players.count = 0;
+		LUA->CheckType( 1, GarrysMod::Lua::Type::BOOL );
+		double window = 10;
+		if( !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+		{
+			window = LUA->CheckNumber( 2 );
+			if( window <= 0 )
+				LUA->ArgError( 2, "window must be positive" );
+		}
+
+		hitters::SetEnabled( LUA->GetBool( 1 ), static_cast<uint32_t>( window * 1000 ) );
+		UpdateReceiveDetour( );
+
 		return 0;
 	}
 
-	LUA_FUNCTION_STATIC( AddPlayer )
+	// GetHeavyHitters( type, [n], [by /24] ) returns { { ip, pps, bps, packets, error } },
+	// heaviest first, type is one of invalid, good, info or player
+	LUA_FUNCTION_STATIC( GetHeavyHitters )
 	{
-		player_t player;
+		int32_t type = ParseTrafficClass( LUA->CheckString( 1 ) );
+		if( type == -1 )
+			LUA->ArgError( 1, "unknown traffic class (invalid, good, info or player)" );
+
+		size_t count = 10;
+		if( !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+			count = static_cast<size_t>( std::max( LUA->CheckNumber( 2 ), 0.0 ) );
+
+		bool prefix = LUA->IsType( 3, GarrysMod::Lua::Type::BOOL ) && LUA->GetBool( 3 );
+
+		std::vector<hitters::hitter_t> top;
+		hitters::GetTop(
+			static_cast<PacketType>( type - 1 ),
+			prefix ? hitters::AggregatePrefix : hitters::AggregateSource,
+			count,
+			clock::Now( ),
+			top
+		);
 
-		LUA->CheckType(1, GarrysMod::Lua::Type::STRING);
-		player.name = LUA->GetString(1);
+		LUA->CreateTable( );
+		for( size_t k = 0; k < top.size( ); ++k )
+		{
+			const hitters::hitter_t &hitter = top[k];
 
-		LUA->CheckType(2, GarrysMod::Lua::Type::NUMBER);
-		player.score = LUA->GetNumber(2);
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
 
-		LUA->CheckType(3, GarrysMod::Lua::Type::NUMBER);
-		player.time = LUA->GetNumber(3);
+			in_addr address;
+			address.s_addr = htonl( hitter.address );
+			char ip[ip_string_size];
+			if( prefix )
+			{
+				std::string cidr = IPToString( address, ip, sizeof( ip ) );
+				cidr += "/24";
+				LUA->PushString( cidr.c_str( ) );
+			}
+			else
+			{
+				LUA->PushString( IPToString( address, ip, sizeof( ip ) ) );
+			}
+			LUA->SetField( -2, "ip" );
 
-		game_players.players.push_back(player);
-		game_players.count = game_players.players.size();
+			LUA->PushNumber( hitter.pps );
+			LUA->SetField( -2, "pps" );
+
+			LUA->PushNumber( hitter.bps );
+			LUA->SetField( -2, "bps" );
+
+			LUA->PushNumber( hitter.packets );
+			LUA->SetField( -2, "packets" );
+
+			LUA->PushNumber( hitter.error );
+			LUA->SetField( -2, "error" );
+
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	static const char *event_kind_names[events::KindCount] = {
+		"query",
+		"handshake",
+		"rejected"
+	};
+
+	static const char *event_reason_names[events::ReasonCount] = {
+		"invalid",
+		"banned"
+	};
+
+	static const char event_hook_name[] = "spoof.events";
+	static int32_t event_callback = -1;
+	static uint32_t event_batch_size = 4096;
+	static std::vector<events::event_t> event_batch;
+
+	// Runs on the Tick hook. Calls the event callback with a flat array,
+	// { kind, ip, port, detail, kind, ip, ... }, and how many events were
+	// dropped since the last batch. Skipped when there's nothing to report.
+	LUA_FUNCTION_STATIC( DeliverEvents )
+	{
+		if( event_callback == -1 )
+			return 0;
+
+		event_batch.clear( );
+		events::Drain( event_batch, event_batch_size );
+		uint32_t overflow = events::TakeOverflow( );
+		if( event_batch.empty( ) && overflow == 0 )
+			return 0;
+
+		LUA->ReferencePush( event_callback );
+
+		LUA->CreateTable( );
+		int32_t index = 0;
+		for( size_t k = 0; k < event_batch.size( ); ++k )
+		{
+			const events::event_t &event = event_batch[k];
+
+			LUA->PushNumber( ++index );
+			LUA->PushString( event_kind_names[event.kind] );
+			LUA->SetTable( -3 );
+
+			in_addr address;
+			address.s_addr = htonl( event.address );
+			char ip[ip_string_size];
+			LUA->PushNumber( ++index );
+			LUA->PushString( IPToString( address, ip, sizeof( ip ) ) );
+			LUA->SetTable( -3 );
+
+			LUA->PushNumber( ++index );
+			LUA->PushNumber( event.port );
+			LUA->SetTable( -3 );
 
+			LUA->PushNumber( ++index );
+			if( event.kind == events::KindRejected )
+			{
+				LUA->PushString( event_reason_names[event.detail] );
+			}
+			else
+			{
+				char detail[2] = { static_cast<char>( event.detail ), '\0' };
+				LUA->PushString( detail );
+			}
+			LUA->SetTable( -3 );
+		}
+
+		LUA->PushNumber( overflow );
+
+		if( LUA->PCall( 2, 0, 0 ) != 0 )
+		{
+			DebugWarning( "[spoof] Event callback failed: %s\n", LUA->GetString( -1 ) );
+			LUA->Pop( 1 );
+		}
+
+		return 0;
+	}
+
+	static void SetEventHook( GarrysMod::Lua::ILuaBase *LUA, bool enabled )
+	{
+		LUA->PushSpecial( GarrysMod::Lua::SPECIAL_GLOB );
+		LUA->GetField( -1, "hook" );
+		if( !LUA->IsType( -1, GarrysMod::Lua::Type::TABLE ) )
+		{
+			LUA->Pop( 2 );
+			DebugWarning( "[spoof] The hook library isn't available, events won't be delivered\n" );
+			return;
+		}
+
+		LUA->GetField( -1, enabled ? "Add" : "Remove" );
+		LUA->PushString( "Tick" );
+		LUA->PushString( event_hook_name );
+		if( enabled )
+		{
+			LUA->PushCFunction( DeliverEvents );
+			LUA->Call( 3, 0 );
+		}
+		else
+		{
+			LUA->Call( 2, 0 );
+		}
+
+		LUA->Pop( 2 );
+	}
+
+	// SetEventCallback( function( events, overflow ) end, [cap] ), nil disables events.
+	// cap is the most events waiting for the next tick, defaults to 4096.
+	LUA_FUNCTION_STATIC( SetEventCallback )
+	{
+		bool enabled = !LUA->IsType( 1, GarrysMod::Lua::Type::NIL );
+		uint32_t cap = 4096;
+		if( enabled )
+		{
+			LUA->CheckType( 1, GarrysMod::Lua::Type::FUNCTION );
+			if( !LUA->IsType( 2, GarrysMod::Lua::Type::NIL ) )
+			{
+				double value = LUA->CheckNumber( 2 );
+				if( value < 1 || value > events::max_events )
+					LUA->ArgError( 2, "cap must be between 1 and 16384" );
+
+				cap = static_cast<uint32_t>( value );
+			}
+		}
+
+		if( event_callback != -1 )
+		{
+			LUA->ReferenceFree( event_callback );
+			event_callback = -1;
+		}
+
+		events::SetEnabled( enabled, cap );
+		event_batch_size = cap;
+		if( enabled )
+		{
+			LUA->Push( 1 );
+			event_callback = LUA->ReferenceCreate( );
+		}
+
+		UpdateReceiveDetour( );
+		SetEventHook( LUA, enabled );
 		return 0;
+	}
+
+	// Everything the snapshot mirrors, for a file that had nothing to restore.
+	static void SaveSnapshot( )
+	{
+		snapshot_settings.spoofing_enabled = player_spoofing_enabled;
+		snapshot_settings.info_cache_time = info_cache_time;
+		snapshot_settings.player_cache_time = player_cache_time;
+		bans::GetThreshold( snapshot_settings.ban_threshold, snapshot_settings.ban_window );
+		snapshot_settings.ban_duration = bans::GetDuration( );
+		snapshot::SaveSettings( snapshot_settings );
+
+		for( size_t k = 0; k < requester_classes.size( ); ++k )
+		{
+			const requester_class_t &requester = requester_classes[k];
+			uint32_t index = static_cast<uint32_t>( k );
+			snapshot::SaveClass( index, requester.name.c_str( ), requester.spoof_count );
+
+			for( size_t p = 0; p < requester.players.players.size( ); ++p )
+			{
+				const player_t &player = requester.players.players[p];
+				snapshot::SavePlayer(
+					index,
+					static_cast<uint32_t>( p ),
+					player.name.c_str( ),
+					player.name.size( ),
+					player.score,
+					player.time
+				);
+			}
+
+			snapshot::SavePlayerCount( index, requester.players.count );
+		}
 
+		snapshot::SaveClassCount( static_cast<uint32_t>( requester_classes.size( ) ) );
 	}
 
-	inline packet_t GetSamplePacket( )
+	// Straight from the mapped records, before the receiver thread starts.
+	static void RestoreSnapshot( const snapshot::file_t &file )
 	{
-		AUTO_LOCK( packet_sampling_mutex );
+		snapshot_settings = file.settings;
+
+		player_spoofing_enabled = snapshot_settings.spoofing_enabled != 0;
+		threaded_socket_enabled = snapshot_settings.spoofing_enabled != 0;
+		info_cache_time = snapshot_settings.info_cache_time;
+		player_cache_time = snapshot_settings.player_cache_time;
+
+		bans::SetThreshold( snapshot_settings.ban_threshold, snapshot_settings.ban_window );
+		bans::SetDuration( snapshot_settings.ban_duration );
+		handshakes::SetWindow( snapshot_settings.handshake_window );
+		if( snapshot_settings.egress_bytes != 0 || snapshot_settings.egress_replies != 0 )
+			egress::SetBudget(
+				snapshot_settings.egress_bytes,
+				snapshot_settings.egress_replies,
+				snapshot_settings.egress_burst,
+				static_cast<egress::Fallback>( snapshot_settings.egress_fallback )
+			);
+
+		requester_classes.clear( );
+		for( uint32_t k = 0; k < file.class_count; ++k )
+		{
+			const snapshot::class_record_t &record = file.classes[k];
+			requester_classes.push_back( requester_class_t( record.name ) );
+
+			requester_class_t &requester = requester_classes.back( );
+			requester.spoof_count = record.spoof_count;
+			requester.players.players.resize( record.player_count );
+			requester.players.count = static_cast<uint8_t>( record.player_count );
+			for( uint32_t p = 0; p < record.player_count; ++p )
+			{
+				player_t &player = requester.players.players[p];
+				player.index = 0;
+				player.name = record.players[p].name;
+				player.score = record.players[p].score;
+				player.time = record.players[p].time;
+			}
+		}
+
+		requester_cidrs.clear( );
+		for( uint32_t k = 0; k < file.cidr_count; ++k )
+		{
+			requester_cidr_t cidr;
+			cidr.first = file.cidrs[k].first;
+			cidr.last = file.cidrs[k].last;
+			cidr.class_index = file.cidrs[k].class_index;
+			requester_cidrs.push_back( cidr );
+		}
 
-		if( packet_sampling_queue.empty( ) )
-			return packet_t( );
+		std::vector<bans::ban_t> restored_bans;
+		snapshot::TakeBans( restored_bans );
+		for( size_t k = 0; k < restored_bans.size( ); ++k )
+			if( bans::Add( restored_bans[k].address, restored_bans[k].remaining, clock::Now( ) ) )
+				snapshot::SaveBan( restored_bans[k].address, restored_bans[k].remaining );
 
-		packet_t p = packet_sampling_queue.front( );
-		packet_sampling_queue.pop_front( );
-		return p;
+		UpdateReceiveDetour( );
+		DebugMsg( "[spoof] Restored %u requester classes and %u bans from the snapshot\n",
+			file.class_count, static_cast<uint32_t>( restored_bans.size( ) ) );
 	}
-	
 
 	void Initialize( GarrysMod::Lua::ILuaBase *LUA )
 	{
@@ -845,16 +2730,6 @@ namespace netfilter
 		if( engine_server == nullptr )
 			LUA->ThrowError( "failed to load required IVEngineServer interface" );
 
-		IPlayerInfoManager *playerinfo = server_loader.GetInterface<IPlayerInfoManager>(
-			INTERFACEVERSION_PLAYERINFOMANAGER
-			);
-		if( playerinfo == nullptr )
-			LUA->ThrowError( "failed to load required IPlayerInfoManager interface" );
-
-		globalvars = playerinfo->GetGlobalVars( );
-		if( globalvars == nullptr )
-			LUA->ThrowError( "failed to load required CGlobalVars interface" );
-
 		netsockets_t *net_sockets = nullptr;
 
 		{
@@ -932,17 +2807,56 @@ namespace netfilter
 		if( net_sockets == nullptr )
 			LUA->ThrowError( "got an invalid pointer to net_sockets" );
 
-		game_socket = net_sockets->Element( 1 ).hUDP;
-		if( game_socket == INVALID_SOCKET )
+		if( net_sockets->Count( ) < 2 || net_sockets->Element( 1 ).hUDP == INVALID_SOCKET )
 			LUA->ThrowError( "got an invalid server socket" );
 
+		// slot 0 is the client socket, it only talks to servers we connect to and
+		// validation would reject their replies
+		for( int32_t k = 1; k < net_sockets->Count( ); ++k )
+		{
+			const netsocket_t &netsocket = net_sockets->Element( k );
+			if( netsocket.hUDP == INVALID_SOCKET || FindSocket( netsocket.hUDP ) != nullptr )
+				continue;
+
+			engine_socket_t *socket = new engine_socket_t( k, netsocket.hUDP, netsocket.nPort );
+			socket->answer_queries = k == 1;
+			engine_sockets.push_back( socket );
+		}
+
+		BuildStaticReplyInfo( );
+
+		// -spoof_snapshot <path> moves the file, -nospoofsnapshot always starts cold
+		if( CommandLine( )->FindParm( "-nospoofsnapshot" ) == 0 )
+		{
+			const char *path =
+				CommandLine( )->ParmValue( "-spoof_snapshot", default_snapshot_path );
+			const char *error = nullptr;
+			const snapshot::file_t *file = snapshot::Open( path, error );
+			if( file != nullptr )
+			{
+				RestoreSnapshot( *file );
+				snapshot_restored = true;
+			}
+			else if( snapshot::IsOpen( ) )
+			{
+				SaveSnapshot( );
+			}
+			else
+			{
+				DebugWarning( "[spoof] Snapshot unavailable: %s\n", error );
+			}
+		}
+
+		BuildRequesterRanges( );
+
+		// players only start accumulating time from here
+		a2s_player_last_send = clock::Refresh( );
+
 		threaded_socket_execute = true;
 		threaded_socket_handle = CreateSimpleThread( PacketReceiverThread, nullptr );
 		if( threaded_socket_handle == nullptr )
 			LUA->ThrowError( "unable to create thread" );
 
-		BuildStaticReplyInfo( );
-
 		LUA->PushCFunction( EnablePlayerSpoofing );
 		LUA->SetField( -2, "SetEnabled" );
 
@@ -954,10 +2868,129 @@ namespace netfilter
 
 		LUA->PushCFunction(AddPlayer);
 		LUA->SetField(-2, "AddPlayer");
+
+		LUA->PushCFunction( AddRequesterClass );
+		LUA->SetField( -2, "AddRequesterClass" );
+
+		LUA->PushCFunction( AddRequesterRange );
+		LUA->SetField( -2, "AddRequesterRange" );
+
+		LUA->PushCFunction( ResetRequesterClasses );
+		LUA->SetField( -2, "ResetRequesterClasses" );
+
+		LUA->PushCFunction( SetInfoCacheTime );
+		LUA->SetField( -2, "SetInfoCacheTime" );
+
+		LUA->PushCFunction( SetPlayerCacheTime );
+		LUA->SetField( -2, "SetPlayerCacheTime" );
+
+		LUA->PushCFunction( SetReceiverAffinity );
+		LUA->SetField( -2, "SetReceiverAffinity" );
+
+		LUA->PushCFunction( SetReceiverPriority );
+		LUA->SetField( -2, "SetReceiverPriority" );
+
+		LUA->PushCFunction( SetLowLatencyMode );
+		LUA->SetField( -2, "SetLowLatencyMode" );
+
+		LUA->PushCFunction( SetWorkerCount );
+		LUA->SetField( -2, "SetWorkerCount" );
+
+		LUA->PushCFunction( GetWorkerStats );
+		LUA->SetField( -2, "GetWorkerStats" );
+
+		LUA->PushCFunction( SetLatencyTracing );
+		LUA->SetField( -2, "SetLatencyTracing" );
+
+		LUA->PushCFunction( GetLatencyHistograms );
+		LUA->SetField( -2, "GetLatencyHistograms" );
+
+		LUA->PushCFunction( ResetLatencyHistograms );
+		LUA->SetField( -2, "ResetLatencyHistograms" );
+
+		LUA->PushCFunction( SetWakeupLatencyTracking );
+		LUA->SetField( -2, "SetWakeupLatencyTracking" );
+
+		LUA->PushCFunction( GetWakeupLatency );
+		LUA->SetField( -2, "GetWakeupLatency" );
+
+		LUA->PushCFunction( ResetWakeupLatency );
+		LUA->SetField( -2, "ResetWakeupLatency" );
+
+		LUA->PushCFunction( SetPacketSampling );
+		LUA->SetField( -2, "SetPacketSampling" );
+
+		LUA->PushCFunction( GetPacketSamples );
+		LUA->SetField( -2, "GetPacketSamples" );
+
+		LUA->PushCFunction( SetBanThreshold );
+		LUA->SetField( -2, "SetBanThreshold" );
+
+		LUA->PushCFunction( SetBanDuration );
+		LUA->SetField( -2, "SetBanDuration" );
+
+		LUA->PushCFunction( SetHandshakeCoalescing );
+		LUA->SetField( -2, "SetHandshakeCoalescing" );
+
+		LUA->PushCFunction( GetCoalescedHandshakes );
+		LUA->SetField( -2, "GetCoalescedHandshakes" );
+
+		LUA->PushCFunction( SetEgressBudget );
+		LUA->SetField( -2, "SetEgressBudget" );
+
+		LUA->PushCFunction( GetEgressStats );
+		LUA->SetField( -2, "GetEgressStats" );
+
+		LUA->PushCFunction( IsRestored );
+		LUA->SetField( -2, "IsRestored" );
+
+		LUA->PushCFunction( AddBan );
+		LUA->SetField( -2, "AddBan" );
+
+		LUA->PushCFunction( ClearBans );
+		LUA->SetField( -2, "ClearBans" );
+
+		LUA->PushCFunction( GetBans );
+		LUA->SetField( -2, "GetBans" );
+
+		LUA->PushCFunction( AttachSharedMemory );
+		LUA->SetField( -2, "AttachSharedMemory" );
+
+		LUA->PushCFunction( GetSharedStats );
+		LUA->SetField( -2, "GetSharedStats" );
+
+		LUA->PushCFunction( OpenStatsPage );
+		LUA->SetField( -2, "OpenStatsPage" );
+
+		LUA->PushCFunction( CloseStatsPage );
+		LUA->SetField( -2, "CloseStatsPage" );
+
+		LUA->PushCFunction( GetSocketStats );
+		LUA->SetField( -2, "GetSocketStats" );
+
+		LUA->PushCFunction( SetSocketQueryCaching );
+		LUA->SetField( -2, "SetSocketQueryCaching" );
+
+		LUA->PushCFunction( SetHeavyHitterTracking );
+		LUA->SetField( -2, "SetHeavyHitterTracking" );
+
+		LUA->PushCFunction( GetHeavyHitters );
+		LUA->SetField( -2, "GetHeavyHitters" );
+
+		LUA->PushCFunction( SetEventCallback );
+		LUA->SetField( -2, "SetEventCallback" );
 	}
 
-	void Deinitialize( GarrysMod::Lua::ILuaBase * )
+	void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
 	{
+		if( event_callback != -1 )
+		{
+			events::SetEnabled( false, 0 );
+			SetEventHook( LUA, false );
+			LUA->ReferenceFree( event_callback );
+			event_callback = -1;
+		}
+
 		if( threaded_socket_handle != nullptr )
 		{
 			threaded_socket_execute = false;
@@ -967,5 +3000,15 @@ namespace netfilter
 		}
 
 		VCRHook_recvfrom = Hook_recvfrom;
+
+		for( size_t k = 0; k < engine_sockets.size( ); ++k )
+			delete engine_sockets[k];
+
+		engine_sockets.clear( );
+
+		// nothing can be reading the segment anymore
+		shared::Detach( );
+		stats::Close( );
+		snapshot::Close( );
 	}
 }
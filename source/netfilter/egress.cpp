@@ -0,0 +1,245 @@
+#include <netfilter/egress.hpp>
+#include <netfilter/atomic.hpp>
+#include <netfilter/clock.hpp>
+#include <string.h>
+#include <random>
+
+namespace netfilter
+{
+	namespace egress
+	{
+		static const uint32_t max_burst = 4000; // milliseconds, keeps budgets in 32 bits
+		static const uint32_t max_stale = 1000; // how far behind a cached time can be
+
+		// Token bucket holding up to burst milliseconds of its rate, kept as
+		// nanoseconds of budget next to the time it was last refilled, so both are
+		// updated by one compare and swap: last refill << 32 | budget.
+		struct bucket_t
+		{
+			bucket_t( ) :
+				state( 0 ),
+				cost( 0 ),
+				capacity( 0 )
+			{ }
+
+			Atomic<uint64_t> state;
+			Atomic<uint32_t> cost; // nanoseconds per unit, 0 is unlimited
+			Atomic<uint32_t> capacity; // nanoseconds
+		};
+
+		static bucket_t byte_bucket;
+		static bucket_t reply_bucket;
+		static Atomic<uint32_t> fallback_mode( FallbackChallenge );
+
+		static Atomic<uint64_t> bytes_in( 0 );
+		static Atomic<uint64_t> bytes_out( 0 );
+		static Atomic<uint64_t> replies( 0 );
+		static Atomic<uint64_t> challenges( 0 );
+		static Atomic<uint64_t> dropped( 0 );
+
+		inline uint64_t Refill( uint64_t state, uint32_t capacity, uint32_t now, uint32_t &last )
+		{
+			last = static_cast<uint32_t>( state >> 32 );
+			uint64_t budget = static_cast<uint32_t>( state );
+
+			// another thread may have refilled with a slightly newer cached time
+			uint32_t elapsed = now - last;
+			if( elapsed > 0xFFFFFFFF - max_stale )
+				return budget;
+
+			last = now;
+			budget += static_cast<uint64_t>( elapsed ) * 1000000;
+			return budget < capacity ? budget : capacity;
+		}
+
+		static bool Take( bucket_t &bucket, uint64_t units, uint32_t now, uint32_t &taken )
+		{
+			taken = 0;
+			uint64_t unit_cost = bucket.cost;
+			if( unit_cost == 0 )
+				return true;
+
+			// a reply costing more than the whole burst empties it instead
+			uint32_t capacity = bucket.capacity;
+			uint64_t cost = units * unit_cost;
+			if( cost > capacity )
+				cost = capacity;
+
+			uint64_t state = bucket.state;
+			while( true )
+			{
+				uint32_t last;
+				uint64_t budget = Refill( state, capacity, now, last );
+				bool fits = budget >= cost;
+				if( fits )
+					budget -= cost;
+
+				// stored either way so a long idle period is only measured once
+				uint64_t next = static_cast<uint64_t>( last ) << 32 | budget;
+				if( next == state || bucket.state.compare_exchange_strong( state, next ) )
+				{
+					if( fits )
+						taken = static_cast<uint32_t>( cost );
+
+					return fits;
+				}
+			}
+		}
+
+		static void Refund( bucket_t &bucket, uint32_t amount )
+		{
+			if( amount == 0 )
+				return;
+
+			uint64_t capacity = bucket.capacity;
+			uint64_t state = bucket.state;
+			while( true )
+			{
+				uint64_t budget = static_cast<uint32_t>( state ) + static_cast<uint64_t>( amount );
+				if( budget > capacity )
+					budget = capacity;
+
+				uint64_t next = ( state & 0xFFFFFFFF00000000ULL ) | budget;
+				if( bucket.state.compare_exchange_strong( state, next ) )
+					return;
+			}
+		}
+
+		static void Configure( bucket_t &bucket, uint32_t rate, uint32_t burst )
+		{
+			bucket.cost = 0;
+			if( rate == 0 )
+				return;
+
+			uint64_t cost = 1000000000ULL / rate;
+			bucket.capacity = burst * 1000000;
+			bucket.state = static_cast<uint64_t>( clock::Now( ) ) << 32 | bucket.capacity; // full
+			bucket.cost = static_cast<uint32_t>( cost != 0 ? cost : 1 );
+		}
+
+		void SetBudget(
+			uint32_t bytes_per_second,
+			uint32_t replies_per_second,
+			uint32_t burst,
+			Fallback fallback
+		)
+		{
+			if( burst == 0 )
+				burst = 1;
+			else if( burst > max_burst )
+				burst = max_burst;
+
+			fallback_mode = fallback;
+			Configure( byte_bucket, bytes_per_second, burst );
+			Configure( reply_bucket, replies_per_second, burst );
+		}
+
+		bool IsEnabled( )
+		{
+			return byte_bucket.cost != 0 || reply_bucket.cost != 0;
+		}
+
+		Fallback GetFallback( )
+		{
+			return static_cast<Fallback>( static_cast<uint32_t>( fallback_mode ) );
+		}
+
+		bool Spend( uint32_t bytes, uint32_t now )
+		{
+			uint32_t taken;
+			if( !Take( byte_bucket, bytes, now, taken ) )
+				return false;
+
+			uint32_t unused;
+			if( !Take( reply_bucket, 1, now, unused ) )
+			{
+				Refund( byte_bucket, taken );
+				return false;
+			}
+
+			return true;
+		}
+
+		void RecordQuery( uint32_t bytes )
+		{
+			bytes_in.fetch_add( bytes );
+		}
+
+		void RecordReply( uint32_t bytes )
+		{
+			bytes_out.fetch_add( bytes );
+			replies.fetch_add( 1 );
+		}
+
+		void RecordChallenge( uint32_t bytes )
+		{
+			bytes_out.fetch_add( bytes );
+			challenges.fetch_add( 1 );
+		}
+
+		void RecordDropped( )
+		{
+			dropped.fetch_add( 1 );
+		}
+
+		void GetTotals( totals_t &totals )
+		{
+			totals.bytes_in = bytes_in;
+			totals.bytes_out = bytes_out;
+			totals.replies = replies;
+			totals.challenges = challenges;
+			totals.dropped = dropped;
+		}
+
+		struct secret_t
+		{
+			secret_t( )
+			{
+				std::random_device device;
+				for( size_t k = 0; k < 2; ++k )
+					words[k] = static_cast<uint64_t>( device( ) ) << 32 | device( );
+			}
+
+			uint64_t words[2];
+		};
+
+		inline uint64_t Mix( uint64_t key )
+		{
+			key ^= key >> 33;
+			key *= 0xFF51AFD7ED558CCDULL;
+			key ^= key >> 33;
+			key *= 0xC4CEB9FE1A85EC53ULL;
+			key ^= key >> 33;
+			return key;
+		}
+
+		// Spoofed sources never see the challenges sent to the address they pretend
+		// to be, and without the secret they can't derive them either.
+		static uint32_t MakeChallenge( const sockaddr_in &from, uint32_t period )
+		{
+			static const secret_t secret;
+			uint64_t key = static_cast<uint64_t>( from.sin_addr.s_addr ) << 16 | from.sin_port;
+			key = Mix( Mix( key ^ secret.words[0] ) ^ secret.words[1] ^ period );
+
+			// 0xFFFFFFFF is what a query asking for a challenge carries
+			uint32_t challenge = static_cast<uint32_t>( key );
+			return challenge != 0xFFFFFFFF ? challenge : 0;
+		}
+
+		bool CheckChallenge( const sockaddr_in &from, uint32_t challenge, uint32_t now )
+		{
+			uint32_t period = now >> challenge_period_bits;
+			return challenge == MakeChallenge( from, period ) ||
+				challenge == MakeChallenge( from, period - 1 );
+		}
+
+		void WriteChallenge( const sockaddr_in &from, uint32_t now, uint8_t *buf )
+		{
+			uint32_t challenge = MakeChallenge( from, now >> challenge_period_bits );
+
+			memset( buf, 0xFF, 4 );
+			buf[4] = 'A'; // S2C_CHALLENGE
+			memcpy( buf + 5, &challenge, sizeof( challenge ) );
+		}
+	}
+}
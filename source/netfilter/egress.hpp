@@ -0,0 +1,59 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+#include <stdint.h>
+
+namespace netfilter
+{
+	// Global budget for the replies the module sends itself (cached A2S_INFO and
+	// A2S_PLAYER), so many spoofed sources together can't use the server as an
+	// amplifier against its own uplink. Sizes are UDP payload bytes and times are
+	// netfilter::clock milliseconds.
+	namespace egress
+	{
+		enum Fallback
+		{
+			FallbackChallenge, // answer with a 9 byte S2C_CHALLENGE instead
+			FallbackDrop
+		};
+
+		struct totals_t
+		{
+			uint64_t bytes_in; // queries the module answered itself
+			uint64_t bytes_out; // replies and challenges
+			uint64_t replies;
+			uint64_t challenges;
+			uint64_t dropped;
+		};
+
+		// A rate of 0 leaves that side unlimited, both 0 disable the budget. burst
+		// is how many milliseconds of either rate can be spent at once.
+		void SetBudget(
+			uint32_t bytes_per_second,
+			uint32_t replies_per_second,
+			uint32_t burst,
+			Fallback fallback
+		);
+		bool IsEnabled( );
+		Fallback GetFallback( );
+
+		// Lock-free, takes one reply of the given size from the budget and
+		// returns false without taking anything when it doesn't fit.
+		bool Spend( uint32_t bytes, uint32_t now );
+
+		void RecordQuery( uint32_t bytes );
+		void RecordReply( uint32_t bytes );
+		void RecordChallenge( uint32_t bytes );
+		void RecordDropped( );
+
+		void GetTotals( totals_t &totals );
+
+		// Engine style challenge for a query that won't get its reply, writes
+		// 9 bytes to buf. Keyed by a per process secret, the source and the time, a
+		// challenge is accepted back for between one and two challenge periods.
+		void WriteChallenge( const sockaddr_in &from, uint32_t now, uint8_t *buf );
+		bool CheckChallenge( const sockaddr_in &from, uint32_t challenge, uint32_t now );
+		static const uint32_t challenge_size = 9;
+		static const uint32_t challenge_period_bits = 15; // about 33 seconds
+	}
+}
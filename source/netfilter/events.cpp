@@ -0,0 +1,105 @@
+#include <netfilter/events.hpp>
+#include <netfilter/atomic.hpp>
+
+namespace netfilter
+{
+	namespace events
+	{
+		// Bounded multi producer queue, each slot's sequence says whose turn it is:
+		// position when free for the producer claiming it, position + 1 once the
+		// consumer can read it.
+		struct slot_t
+		{
+			Atomic<uint32_t> sequence;
+			event_t event;
+		};
+
+		static slot_t event_slots[max_events];
+		static Atomic<uint32_t> enqueue_position( 0 );
+		static Atomic<uint32_t> dequeue_position( 0 );
+		static Atomic<uint32_t> event_cap( 0 );
+		static Atomic<uint32_t> event_overflow( 0 );
+		static AtomicBool events_enabled( false );
+		static AtomicBool events_initialized( false );
+
+		void SetEnabled( bool enabled, uint32_t cap )
+		{
+			if( !events_initialized )
+			{
+				for( uint32_t k = 0; k < max_events; ++k )
+					event_slots[k].sequence = k;
+
+				events_initialized = true;
+			}
+
+			event_cap = cap < max_events ? cap : max_events;
+			events_enabled = enabled;
+		}
+
+		bool IsEnabled( )
+		{
+			return events_enabled;
+		}
+
+		void Push( Kind kind, uint32_t address, uint16_t port, uint8_t detail )
+		{
+			uint32_t position = enqueue_position;
+			while( true )
+			{
+				if( position - dequeue_position.load( ) >= event_cap.load( ) )
+				{
+					event_overflow.fetch_add( 1 );
+					return;
+				}
+
+				slot_t &slot = event_slots[position & ( max_events - 1 )];
+				int32_t turn = static_cast<int32_t>( slot.sequence.load( ) - position );
+				if( turn == 0 )
+				{
+					if( enqueue_position.compare_exchange_strong( position, position + 1 ) )
+					{
+						slot.event.address = address;
+						slot.event.port = port;
+						slot.event.kind = static_cast<uint8_t>( kind );
+						slot.event.detail = detail;
+						slot.sequence = position + 1;
+						return;
+					}
+				}
+				else if( turn < 0 )
+				{
+					// a full lap behind the consumer
+					event_overflow.fetch_add( 1 );
+					return;
+				}
+				else
+				{
+					position = enqueue_position;
+				}
+			}
+		}
+
+		size_t Drain( std::vector<event_t> &list, size_t max )
+		{
+			uint32_t position = dequeue_position;
+			size_t drained = 0;
+			for( ; drained < max; ++drained, ++position )
+			{
+				slot_t &slot = event_slots[position & ( max_events - 1 )];
+				if( slot.sequence.load( ) != position + 1 )
+					break;
+
+				list.push_back( slot.event );
+				slot.sequence = position + max_events;
+			}
+
+			dequeue_position = position;
+			return drained;
+		}
+
+		uint32_t TakeOverflow( )
+		{
+			return event_overflow.exchange( 0 );
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Compact records of interesting connectionless traffic, appended by whichever
+	// thread receives packets and drained in batches by the game thread.
+	namespace events
+	{
+		// power of 2, the configurable cap only limits how much of it is used
+		static const uint32_t max_events = 16384;
+
+		enum Kind
+		{
+			KindQuery, // detail is the query type byte
+			KindHandshake, // detail is the handshake type byte
+			KindRejected, // detail is a Reason
+			KindCount
+		};
+
+		enum Reason
+		{
+			ReasonInvalid,
+			ReasonBanned,
+			ReasonCount
+		};
+
+		struct event_t
+		{
+			uint32_t address; // host byte order
+			uint16_t port; // host byte order
+			uint8_t kind;
+			uint8_t detail;
+		};
+
+		// cap is the most events that can be waiting, the rest only count as overflow
+		void SetEnabled( bool enabled, uint32_t cap );
+		bool IsEnabled( );
+
+		// Lock-free, never blocks or allocates.
+		void Push( Kind kind, uint32_t address, uint16_t port, uint8_t detail );
+
+		// Single consumer, appends up to max events, oldest first.
+		size_t Drain( std::vector<event_t> &list, size_t max );
+
+		// Events dropped since the last call.
+		uint32_t TakeOverflow( );
+	}
+}
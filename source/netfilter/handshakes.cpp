@@ -0,0 +1,72 @@
+#include <netfilter/handshakes.hpp>
+#include <netfilter/atomic.hpp>
+
+namespace netfilter
+{
+	namespace handshakes
+	{
+		// Each entry is fingerprint << 32 | time of the forwarded handshake, so one
+		// word updates atomically. Different sources sharing an entry only evict each
+		// other, which at worst forwards a duplicate.
+		static Atomic<uint64_t> entries[table_size];
+		static Atomic<uint32_t> handshake_window( 0 );
+		static Atomic<uint32_t> coalesced( 0 );
+
+		// Murmur3 finalizer over address, port and type, the top half picks the
+		// entry and the bottom half identifies the handshake within it.
+		inline uint64_t Hash( const sockaddr_in &from, uint8_t type )
+		{
+			uint64_t key = static_cast<uint64_t>( from.sin_addr.s_addr ) << 32 |
+				static_cast<uint64_t>( from.sin_port ) << 8 | type;
+			key ^= key >> 33;
+			key *= 0xFF51AFD7ED558CCDULL;
+			key ^= key >> 33;
+			key *= 0xC4CEB9FE1A85EC53ULL;
+			key ^= key >> 33;
+			return key;
+		}
+
+		void SetWindow( uint32_t window )
+		{
+			handshake_window = 0;
+			for( uint32_t k = 0; k < table_size; ++k )
+				entries[k] = 0;
+
+			coalesced = 0;
+			handshake_window = window;
+		}
+
+		bool IsEnabled( )
+		{
+			return handshake_window != 0;
+		}
+
+		bool Coalesce( const sockaddr_in &from, uint8_t type, uint32_t now )
+		{
+			uint32_t window = handshake_window;
+			if( window == 0 )
+				return false;
+
+			uint64_t hash = Hash( from, type );
+			uint32_t fingerprint = static_cast<uint32_t>( hash ) | 1; // 0 is an empty entry
+			Atomic<uint64_t> &entry = entries[( hash >> 32 ) & ( table_size - 1 )];
+
+			uint64_t current = entry;
+			if( static_cast<uint32_t>( current >> 32 ) == fingerprint &&
+				now - static_cast<uint32_t>( current ) < window )
+			{
+				coalesced.fetch_add( 1 );
+				return true;
+			}
+
+			// racing the same handshake on another thread only forwards it twice
+			entry = static_cast<uint64_t>( fingerprint ) << 32 | now;
+			return false;
+		}
+
+		uint32_t GetCoalesced( )
+		{
+			return coalesced;
+		}
+	}
+}
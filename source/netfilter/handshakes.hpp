@@ -0,0 +1,26 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+#include <stdint.h>
+
+namespace netfilter
+{
+	// Suppresses resent connection handshakes ('q' challenge requests and 'k'
+	// connects), only the first one from an address and port within the window
+	// reaches the engine. Times are netfilter::clock milliseconds.
+	namespace handshakes
+	{
+		static const uint32_t table_size = 4096; // power of 2
+
+		// 0 disables coalescing and forgets every handshake seen so far.
+		void SetWindow( uint32_t window );
+		bool IsEnabled( );
+
+		// Lock-free, true when the packet repeats a handshake forwarded less than
+		// window milliseconds ago and should be dropped.
+		bool Coalesce( const sockaddr_in &from, uint8_t type, uint32_t now );
+
+		// Handshakes dropped since coalescing was last enabled.
+		uint32_t GetCoalesced( );
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace netfilter
+{
+	// Log2 bucketed latency histogram in nanoseconds, bucket k counts samples in
+	// [2^k, 2^(k+1)) and the last bucket also takes everything bigger.
+	// Not synchronized, the owner serializes Record( ), Reset( ) and reads.
+	class LatencyHistogram
+	{
+	public:
+		static const size_t bucket_count = 40; // last bucket starts at ~9 minutes
+
+		LatencyHistogram( )
+		{
+			Reset( );
+		}
+
+		void Record( uint64_t ns )
+		{
+			uint64_t sample = ns;
+			size_t bucket = 0;
+			while( ns > 1 && bucket < bucket_count - 1 )
+			{
+				ns >>= 1;
+				++bucket;
+			}
+
+			++buckets[bucket];
+			++count;
+			total += sample;
+		}
+
+		void Reset( )
+		{
+			memset( buckets, 0, sizeof( buckets ) );
+			count = 0;
+			total = 0;
+		}
+
+		uint64_t GetBucket( size_t bucket ) const
+		{
+			return buckets[bucket];
+		}
+
+		uint64_t GetCount( ) const
+		{
+			return count;
+		}
+
+		// nanoseconds of every sample together
+		uint64_t GetTotal( ) const
+		{
+			return total;
+		}
+
+	private:
+		uint64_t buckets[bucket_count];
+		uint64_t count;
+		uint64_t total;
+	};
+}
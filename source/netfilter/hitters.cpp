@@ -0,0 +1,160 @@
+#include <netfilter/hitters.hpp>
+#include <netfilter/atomic.hpp>
+#include <netfilter/clock.hpp>
+#include <netfilter/spacesaving.hpp>
+#include <algorithm>
+#include <threadtools.h>
+
+namespace netfilter
+{
+	namespace hitters
+	{
+		static const uint32_t stripe_bits = 4;
+		static const uint32_t stripe_count = 1 << stripe_bits;
+		static const uint32_t sketch_capacity = 128; // per stripe
+		static const size_t type_count = 4; // PacketType + 1
+
+		// Each /24 always lands in the same stripe, so a key is only ever counted by
+		// one of them and workers recording different sources rarely share a lock.
+		// Every stripe decays on the same window boundaries since enabling.
+		struct stripe_t
+		{
+			stripe_t( ) :
+				window( 10000 ),
+				last_decay( 0 ),
+				decay_count( 0 ),
+				sketches( type_count * AggregationCount, SpaceSaving( sketch_capacity ) )
+			{ }
+
+			CThreadFastMutex mutex;
+			uint32_t window;
+			uint32_t last_decay;
+			uint32_t decay_count;
+			std::vector<SpaceSaving> sketches;
+		};
+
+		static AtomicBool hitters_enabled( false );
+		static stripe_t stripes[stripe_count];
+
+		inline stripe_t &GetStripe( uint32_t address )
+		{
+			return stripes[( ( address >> 8 ) * 0x9E3779B1U ) >> ( 32 - stripe_bits )];
+		}
+
+		inline SpaceSaving &GetSketch( stripe_t &stripe, PacketType type, Aggregation aggregation )
+		{
+			return stripe.sketches[( type + 1 ) * AggregationCount + aggregation];
+		}
+
+		// Must be called with the stripe's mutex held. Workers may pass a cached time
+		// slightly older than the last decay, which counts as no time.
+		static void Decay( stripe_t &stripe, uint32_t now )
+		{
+			int32_t elapsed = static_cast<int32_t>( now - stripe.last_decay );
+			if( elapsed < 0 || static_cast<uint32_t>( elapsed ) < stripe.window )
+				return;
+
+			uint32_t windows = static_cast<uint32_t>( elapsed ) / stripe.window;
+			for( size_t k = 0; k < stripe.sketches.size( ); ++k )
+				stripe.sketches[k].Decay( windows );
+
+			stripe.last_decay += windows * stripe.window;
+			stripe.decay_count = std::min( stripe.decay_count + windows, 32U );
+		}
+
+		void SetEnabled( bool enabled, uint32_t window )
+		{
+			hitters_enabled = false;
+
+			uint32_t now = clock::Now( );
+			for( size_t k = 0; k < stripe_count; ++k )
+			{
+				stripe_t &stripe = stripes[k];
+				AUTO_LOCK( stripe.mutex );
+				for( size_t s = 0; s < stripe.sketches.size( ); ++s )
+					stripe.sketches[s].Reset( );
+
+				stripe.window = window != 0 ? window : 1;
+				stripe.last_decay = now;
+				stripe.decay_count = 0;
+			}
+
+			hitters_enabled = enabled;
+		}
+
+		bool IsEnabled( )
+		{
+			return hitters_enabled;
+		}
+
+		void Record( uint32_t address, int32_t len, PacketType type, uint32_t now )
+		{
+			stripe_t &stripe = GetStripe( address );
+			AUTO_LOCK( stripe.mutex );
+
+			Decay( stripe, now );
+			GetSketch( stripe, type, AggregateSource ).Add( address, static_cast<uint32_t>( len ) );
+			GetSketch( stripe, type, AggregatePrefix ).Add(
+				address & 0xFFFFFF00, static_cast<uint32_t>( len )
+			);
+		}
+
+		static bool CompareCount( const hitter_t &a, const hitter_t &b )
+		{
+			return a.packets > b.packets;
+		}
+
+		void GetTop(
+			PacketType type,
+			Aggregation aggregation,
+			size_t count,
+			uint32_t now,
+			std::vector<hitter_t> &top
+		)
+		{
+			std::vector<hitter_t> hitters;
+			std::vector<SpaceSaving::counter_t> counters;
+			for( size_t k = 0; k < stripe_count; ++k )
+			{
+				stripe_t &stripe = stripes[k];
+				double seconds = 0.0;
+
+				{
+					AUTO_LOCK( stripe.mutex );
+					Decay( stripe, now );
+					counters = GetSketch( stripe, type, aggregation ).GetCounters( );
+
+					// a constant rate r leaves r * window * ( 1 - 2^-decays ) in a counter
+					// at the last decay, plus r * ( now - last_decay ) since then
+					int32_t since = static_cast<int32_t>( now - stripe.last_decay );
+					double decayed = 1.0 - 1.0 / static_cast<double>( 1ULL << stripe.decay_count );
+					seconds = ( stripe.window * decayed + std::max( since, 0 ) ) / 1000.0;
+				}
+
+				if( seconds <= 0.0 )
+					seconds = 0.001;
+
+				for( size_t c = 0; c < counters.size( ); ++c )
+				{
+					const SpaceSaving::counter_t &counter = counters[c];
+					if( counter.count == 0 )
+						continue;
+
+					hitter_t hitter;
+					hitter.address = counter.key;
+					hitter.pps = counter.count / seconds;
+					hitter.bps = counter.bytes / seconds;
+					hitter.packets = counter.count;
+					hitter.error = counter.error;
+					hitters.push_back( hitter );
+				}
+			}
+
+			count = std::min( count, hitters.size( ) );
+			std::partial_sort(
+				hitters.begin( ), hitters.begin( ) + count, hitters.end( ), CompareCount
+			);
+			top.insert( top.end( ), hitters.begin( ), hitters.begin( ) + count );
+		}
+	}
+}
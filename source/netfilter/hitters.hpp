@@ -0,0 +1,46 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Heavy hitter sources per traffic class, by address and by /24, counted by
+	// Space-Saving sketches that halve every window so old traffic fades out.
+	// Addresses are in host byte order, times are netfilter::clock milliseconds.
+	namespace hitters
+	{
+		enum Aggregation
+		{
+			AggregateSource,
+			AggregatePrefix, // /24
+			AggregationCount
+		};
+
+		struct hitter_t
+		{
+			uint32_t address;
+			double pps;
+			double bps; // bytes per second
+			uint32_t packets; // decayed count, overestimated by at most error
+			uint32_t error;
+		};
+
+		void SetEnabled( bool enabled, uint32_t window );
+		bool IsEnabled( );
+
+		// Only locks the stripe the source's /24 maps to, so workers handling
+		// different sources mostly don't contend.
+		void Record( uint32_t address, int32_t len, PacketType type, uint32_t now );
+
+		// Heaviest first, at most count entries.
+		void GetTop(
+			PacketType type,
+			Aggregation aggregation,
+			size_t count,
+			uint32_t now,
+			std::vector<hitter_t> &top
+		);
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <Platform.hpp>
+
+#if defined SYSTEM_WINDOWS
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+
+#elif defined SYSTEM_POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#endif
+
+namespace netfilter
+{
+	enum PacketType
+	{
+		PacketTypeInvalid = -1,
+		PacketTypeGood,
+		PacketTypeInfo,
+		PacketTypePlayer
+	};
+
+	struct packet_t
+	{
+		packet_t( ) :
+			address( ),
+			address_size( sizeof( address ) ),
+			socket( 0 ),
+			type( PacketTypeGood ),
+			kernel_time( 0 ),
+			receive_time( 0 )
+		{ }
+
+		sockaddr_in address;
+		int32_t address_size;
+		size_t socket; // which of the filtered engine sockets received it
+		PacketType type; // traffic class it was analyzed as, for the latency histograms
+		std::vector<char> buffer;
+
+		// realtime nanoseconds, 0 when latency tracing is disabled or unsupported
+		uint64_t kernel_time;
+		uint64_t receive_time;
+	};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+#include <stddef.h>
+#include <queue>
+#include <threadtools.h>
+
+namespace netfilter
+{
+	// Packets accepted by the receiver thread, waiting for the engine to recvfrom them.
+	class PacketQueue
+	{
+	public:
+		PacketQueue( size_t max ) :
+			max_size( max )
+		{ }
+
+		bool Empty( )
+		{
+			AUTO_LOCK( mutex );
+			return queue.empty( );
+		}
+
+		// testing for maximum queue size, this is a very cheap "fix"
+		// the socket itself has a queue too but will start dropping packets when full
+		bool Full( )
+		{
+			AUTO_LOCK( mutex );
+			return queue.size( ) >= max_size;
+		}
+
+		size_t Size( )
+		{
+			AUTO_LOCK( mutex );
+			return queue.size( );
+		}
+
+		// checked under the same lock, Full( ) alone can be outdated by the
+		// time another thread pushes
+		bool Push( const packet_t &p )
+		{
+			AUTO_LOCK( mutex );
+			if( queue.size( ) >= max_size )
+				return false;
+
+			queue.push( p );
+			return true;
+		}
+
+		bool Pop( packet_t &p )
+		{
+			AUTO_LOCK( mutex );
+			if( queue.empty( ) )
+				return false;
+
+			p = queue.front( );
+			queue.pop( );
+			return true;
+		}
+
+	private:
+		size_t max_size;
+		std::queue<packet_t> queue;
+		CThreadFastMutex mutex;
+	};
+}
@@ -0,0 +1,180 @@
+#include <netfilter/reply.hpp>
+#include <main.hpp>
+#include <string.h>
+#include <Platform.hpp>
+
+namespace netfilter
+{
+
+#if defined SYSTEM_WINDOWS
+
+	static const char operating_system_char = 'w';
+
+#elif defined SYSTEM_LINUX
+
+	static const char operating_system_char = 'l';
+
+#elif defined SYSTEM_MACOSX
+
+	static const char operating_system_char = 'm';
+
+#endif
+
+	static const uint8_t default_proto_version = 17;
+
+	static uint32_t split_packet_sequence = 0;
+
+	// maybe divide into low priority and high priority data?
+	// low priority would be VAC protection status for example
+	// updated on a much bigger period
+	size_t WriteInfoReply(
+		a2s::Writer &packet,
+		const reply_info_t &info,
+		const reply_state_t &state
+	)
+	{
+		packet.Reset( );
+
+		size_t name_len = strlen( state.name );
+		size_t map_len = strlen( state.map );
+		bool notags = info.tags.empty( );
+
+		size_t size =
+			a2s::layout::InfoHeader::size +
+			name_len + 1 +
+			map_len + 1 +
+			info.game_dir.size( ) + 1 +
+			info.game_desc.size( ) + 1 +
+			a2s::layout::InfoDetails::size +
+			info.game_version.size( ) + 1 +
+			a2s::layout::InfoExtra::size +
+			( notags ? 0 : info.tags.size( ) + 1 ) +
+			a2s::layout::InfoGameID::size;
+		if( !packet.Reserve( size ) )
+		{
+			DebugWarning( "[spoof] A2S_INFO reply of %u bytes doesn't fit\n", static_cast<uint32_t>( size ) );
+			return 0;
+		}
+
+		// connectionless packet header, packet type is always 'I'
+		packet.Put<a2s::layout::InfoHeader>( -1, 'I', default_proto_version );
+		packet.PutString( state.name, name_len );
+		packet.PutString( state.map, map_len );
+		packet.PutString( info.game_dir.c_str( ), info.game_dir.size( ) );
+		packet.PutString( info.game_desc.c_str( ), info.game_desc.size( ) );
+
+		size_t players_offset = packet.GetSize( ) + a2s::Short::size;
+		packet.Put<a2s::layout::InfoDetails>(
+			state.appid,
+			state.players,
+			state.max_players,
+			state.bots,
+			'd', // dedicated server identifier
+			operating_system_char,
+			state.password ? 1 : 0,
+			// if vac protected, it activates itself some time after startup
+			state.secure ? 1 : 0
+		);
+		packet.PutString( info.game_version.c_str( ), info.game_version.size( ) );
+
+		// 0x80 - port number is present
+		// 0x10 - server steamid is present
+		// 0x20 - tags are present
+		// 0x01 - game long appid is present
+		packet.Put<a2s::layout::InfoExtra>(
+			0x80 | 0x10 | ( notags ? 0x00 : 0x20 ) | 0x01,
+			info.udp_port,
+			state.steamid
+		);
+		if( !notags )
+			packet.PutString( info.tags.c_str( ), info.tags.size( ) );
+		packet.Put<a2s::layout::InfoGameID>( state.appid );
+
+		return players_offset;
+	}
+
+	int32_t WritePlayerReply(a2s::Writer &packet, player_table &game_players, uint32_t elapsed)
+	{
+		packet.Reset();
+		if (!packet.Reserve<a2s::layout::PlayerHeader>())
+			return 0;
+
+		// player count is patched below if not every player fits in the reply
+		packet.Put<a2s::layout::PlayerHeader>(-1, 'D', game_players.count);
+
+		int32_t written = 0;
+		for (int i=0; i<game_players.count; i++) 
+		{
+			game_players.players[i].time += elapsed / 1000.0;
+
+			const player_t &player = game_players.players[i];
+
+			size_t needed =
+				a2s::layout::PlayerIndex::size +
+				player.name.size() + 1 +
+				a2s::layout::PlayerStats::size;
+			if (!packet.Reserve(needed))
+				continue;
+
+			packet.Put<a2s::layout::PlayerIndex>(written);
+			packet.PutString(player.name.c_str(), player.name.size());
+			packet.Put<a2s::layout::PlayerStats>(player.score, player.time);
+			++written;
+		}
+
+		if (written != game_players.count)
+		{
+			DebugWarning("[spoof] Only %d of %d players fit in the A2S_PLAYER reply\n",
+				written, game_players.count);
+			packet.GetData()[5] = static_cast<char>(written);
+		}
+
+		return written;
+	}
+
+	void BuildReplyFragments( const a2s::Writer &packet, reply_cache_t &cache )
+	{
+		const char *data = packet.GetData( );
+		int32_t len = static_cast<int32_t>( packet.GetSize( ) );
+
+		cache.fragments.clear( );
+
+		if( len <= split_packet_max_routable )
+		{
+			cache.fragments.push_back( std::vector<char>( data, data + len ) );
+			return;
+		}
+
+		int32_t total =
+			( len + split_packet_max_payload - 1 ) / split_packet_max_payload;
+		if( total > split_packet_max_fragments )
+		{
+			DebugWarning( "[spoof] Reply of %d bytes is too big to be split\n", len );
+			return;
+		}
+
+		// the highest bit of the sequence flags compressed payloads
+		int32_t sequence = static_cast<int32_t>( ++split_packet_sequence & 0x7FFFFFFF );
+		cache.fragments.resize( total );
+		for( int32_t k = 0; k < total; ++k )
+		{
+			int32_t offset = k * split_packet_max_payload;
+			int32_t size = len - offset;
+			if( size > split_packet_max_payload )
+				size = split_packet_max_payload;
+
+			std::vector<char> &fragment = cache.fragments[k];
+			fragment.resize( split_packet_header_size + size );
+
+			a2s::Writer writer( &fragment[0], fragment.size( ) );
+			writer.Put<a2s::layout::SplitHeader>(
+				-2, // split packet header
+				sequence,
+				total,
+				k,
+				split_packet_max_payload
+			);
+			memcpy( &fragment[split_packet_header_size], data + offset, size );
+		}
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <netfilter/a2s.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace netfilter
+{
+	// same values the engine uses for its own split packets (net_maxroutable default)
+	static const int32_t split_packet_max_routable = 1260;
+	static const int32_t split_packet_header_size = 12;
+	static const int32_t split_packet_max_payload =
+		split_packet_max_routable - split_packet_header_size;
+	static const int32_t split_packet_max_fragments = 32;
+
+	// gathered once on load
+	struct reply_info_t
+	{
+		std::string game_dir;
+		std::string game_version;
+		std::string game_desc;
+		int32_t max_clients;
+		int32_t udp_port;
+		std::string tags;
+	};
+
+	// sampled from the engine on every A2S_INFO rebuild
+	struct reply_state_t
+	{
+		const char *name;
+		const char *map;
+		int32_t appid;
+		int32_t players;
+		int32_t max_players;
+		int32_t bots;
+		bool password;
+		bool secure;
+		uint64_t steamid;
+	};
+
+	struct player_t
+	{
+		uint8_t index;
+		std::string name;
+		double score;
+		double time;
+	};
+
+	struct player_table
+	{
+		uint8_t count;
+		std::vector<player_t> players;
+	};
+
+	struct reply_cache_t
+	{
+		std::vector< std::vector<char> > fragments;
+	};
+
+	// Serializes A2S_INFO and returns the offset of the player count byte,
+	// so it can be patched per requester class without reserializing.
+	// Returns 0 and leaves the writer empty when the reply doesn't fit.
+	size_t WriteInfoReply(
+		a2s::Writer &packet,
+		const reply_info_t &info,
+		const reply_state_t &state
+	);
+
+	// Serializes A2S_PLAYER after adding elapsed milliseconds to every player's time.
+	// Players that don't fit are skipped, returns how many were written.
+	int32_t WritePlayerReply( a2s::Writer &packet, player_table &players, uint32_t elapsed );
+
+	// Cuts a serialized reply into the fragments that get sent for every query.
+	// Replies that fit in a single datagram are kept as is, bigger ones are framed
+	// with the split packet header (-2, sequence, total, number, split size).
+	void BuildReplyFragments( const a2s::Writer &packet, reply_cache_t &cache );
+}
@@ -0,0 +1,187 @@
+#include <netfilter/sampling.hpp>
+#include <netfilter/atomic.hpp>
+#include <string.h>
+#include <algorithm>
+
+namespace netfilter
+{
+	namespace sampling
+	{
+		enum SlotState
+		{
+			SlotEmpty,
+			SlotWriting,
+			SlotFull,
+			SlotReading
+		};
+
+		// Preallocated so capturing is a copy, slots are owned by whoever moved
+		// their state out of SlotEmpty/SlotFull.
+		struct slot_t
+		{
+			Atomic<uint32_t> state;
+			uint32_t sequence;
+			sockaddr_in address;
+			PacketType type;
+			int32_t length;
+			char data[max_sample_size];
+		};
+
+		static slot_t sampling_slots[max_samples];
+
+		static Atomic<uint32_t> sampling_mode( ModeDisabled );
+		static Atomic<uint32_t> sampling_rate( 1 );
+		static Atomic<uint32_t> sampling_types( ~0U );
+		static Atomic<int32_t> sampling_oob_type( -1 );
+		static Atomic<uint32_t> sampling_network( 0 );
+		static Atomic<uint32_t> sampling_mask( 0 );
+
+		static Atomic<uint32_t> sampling_random( 0 );
+		static Atomic<uint32_t> sampling_captured( 0 );
+		static Atomic<uint32_t> reservoir_seen( 0 );
+
+		// splitmix style, shared by every receiving thread at the cost of one atomic add
+		inline uint32_t Random( )
+		{
+			uint32_t x = sampling_random.fetch_add( 0x9E3779B9U ) + 0x9E3779B9U;
+			x ^= x >> 16;
+			x *= 0x7FEB352DU;
+			x ^= x >> 15;
+			x *= 0x846CA68BU;
+			x ^= x >> 16;
+			return x;
+		}
+
+		inline bool Matches( const sockaddr_in &from, const char *data, int32_t len, PacketType type )
+		{
+			if( ( sampling_types.load( ) & ( 1U << ( type + 1 ) ) ) == 0 )
+				return false;
+
+			int32_t oob_type = sampling_oob_type;
+			if( oob_type != -1 )
+			{
+				if( len < 5 || *reinterpret_cast<const int32_t *>( data ) != -1 ||
+					static_cast<uint8_t>( data[4] ) != oob_type )
+					return false;
+			}
+
+			uint32_t mask = sampling_mask;
+			return ( ntohl( from.sin_addr.s_addr ) & mask ) == sampling_network.load( );
+		}
+
+		void Configure( Mode mode, uint32_t rate, const filter_t &filter )
+		{
+			sampling_mode = ModeDisabled;
+
+			sampling_rate = rate != 0 ? rate : 1;
+			sampling_types = filter.types;
+			sampling_oob_type = filter.oob_type;
+			sampling_mask = filter.mask;
+			sampling_network = filter.network & filter.mask;
+			reservoir_seen = 0;
+
+			sampling_mode = mode;
+		}
+
+		bool IsEnabled( )
+		{
+			return sampling_mode.load( ) != ModeDisabled;
+		}
+
+		void Sample( const sockaddr_in &from, const char *data, int32_t len, PacketType type )
+		{
+			uint32_t mode = sampling_mode;
+			if( mode == ModeDisabled || !Matches( from, data, len, type ) )
+				return;
+
+			uint32_t index = 0, sequence = 0;
+			if( mode == ModeRate )
+			{
+				if( Random( ) % sampling_rate.load( ) != 0 )
+					return;
+
+				sequence = sampling_captured.fetch_add( 1 );
+				index = sequence % max_samples;
+			}
+			else
+			{
+				// Algorithm R, the n-th packet replaces a random slot with probability k/n
+				sequence = reservoir_seen.fetch_add( 1 );
+				index = sequence;
+				if( index >= max_samples )
+				{
+					index = Random( ) % ( sequence + 1 );
+					if( index >= max_samples )
+						return;
+				}
+			}
+
+			slot_t &slot = sampling_slots[index];
+			uint32_t state = slot.state;
+			do
+			{
+				// being written by another thread or drained, losing this one is fine
+				if( state == SlotWriting || state == SlotReading )
+					return;
+			}
+			while( !slot.state.compare_exchange_strong( state, SlotWriting ) );
+
+			size_t size = std::min( static_cast<size_t>( len ), max_sample_size );
+			slot.sequence = sequence;
+			slot.address = from;
+			slot.type = type;
+			slot.length = len;
+			memcpy( slot.data, data, size );
+
+			slot.state = SlotFull;
+		}
+
+		static bool CompareSequence( const slot_t *a, const slot_t *b )
+		{
+			return a->sequence < b->sequence;
+		}
+
+		size_t Drain( std::vector<sample_t> &samples, size_t max )
+		{
+			reservoir_seen = 0;
+
+			slot_t *full[max_samples];
+			size_t count = 0;
+			for( size_t k = 0; k < max_samples; ++k )
+			{
+				uint32_t state = SlotFull;
+				if( sampling_slots[k].state.compare_exchange_strong( state, SlotReading ) )
+					full[count++] = &sampling_slots[k];
+			}
+
+			std::sort( full, full + count, CompareSequence );
+
+			size_t drained = 0;
+			for( size_t k = 0; k < count; ++k )
+			{
+				slot_t &slot = *full[k];
+				if( drained < max )
+				{
+					samples.push_back( sample_t( ) );
+					sample_t &sample = samples.back( );
+					sample.sequence = slot.sequence;
+					sample.address = slot.address;
+					sample.type = slot.type;
+					sample.length = slot.length;
+					sample.data.assign(
+						slot.data,
+						slot.data + std::min( static_cast<size_t>( slot.length ), max_sample_size )
+					);
+					++drained;
+					slot.state = SlotEmpty;
+				}
+				else
+				{
+					slot.state = SlotFull;
+				}
+			}
+
+			return drained;
+		}
+	}
+}
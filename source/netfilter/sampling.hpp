@@ -0,0 +1,57 @@
+#pragma once
+
+#include <netfilter/packet.hpp>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	namespace sampling
+	{
+		static const size_t max_samples = 64;
+		// longer packets are truncated, sample_t::length keeps the real size
+		static const size_t max_sample_size = 2048;
+
+		enum Mode
+		{
+			ModeDisabled,
+			ModeRate, // 1 in N of the matching packets, newest samples replace the oldest
+			ModeReservoir // uniform over the matching packets seen since the last drain
+		};
+
+		struct filter_t
+		{
+			filter_t( ) :
+				types( ~0U ),
+				oob_type( -1 ),
+				network( 0 ),
+				mask( 0 )
+			{ }
+
+			uint32_t types; // bit PacketType + 1 set for every accepted type
+			int32_t oob_type; // connectionless packet type byte, -1 accepts anything
+			uint32_t network; // host byte order, a mask of 0 accepts every source
+			uint32_t mask;
+		};
+
+		struct sample_t
+		{
+			uint32_t sequence; // capture order
+			sockaddr_in address;
+			PacketType type;
+			int32_t length;
+			std::vector<char> data;
+		};
+
+		void Configure( Mode mode, uint32_t rate, const filter_t &filter );
+		bool IsEnabled( );
+
+		// Called by the receiving thread(s) with the classification verdict of every
+		// packet while sampling is enabled, never blocks or allocates.
+		void Sample( const sockaddr_in &from, const char *data, int32_t len, PacketType type );
+
+		// Moves up to max samples into samples, oldest first. Also starts a new
+		// reservoir window.
+		size_t Drain( std::vector<sample_t> &samples, size_t max );
+	}
+}
@@ -0,0 +1,210 @@
+#include <netfilter/scheduling.hpp>
+#include <Platform.hpp>
+#include <string.h>
+
+#if defined SYSTEM_WINDOWS
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <WinSock2.h>
+#include <Windows.h>
+
+#elif defined SYSTEM_LINUX
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#elif defined SYSTEM_MACOSX
+
+#include <sched.h>
+#include <pthread.h>
+
+#endif
+
+namespace netfilter
+{
+	namespace scheduling
+	{
+		Policy ParsePolicy( const char *name )
+		{
+			if( strcmp( name, "default" ) == 0 || strcmp( name, "other" ) == 0 )
+				return PolicyDefault;
+			else if( strcmp( name, "batch" ) == 0 )
+				return PolicyBatch;
+			else if( strcmp( name, "idle" ) == 0 )
+				return PolicyIdle;
+			else if( strcmp( name, "fifo" ) == 0 )
+				return PolicyFifo;
+			else if( strcmp( name, "rr" ) == 0 )
+				return PolicyRoundRobin;
+
+			return PolicyInvalid;
+		}
+
+#if defined SYSTEM_WINDOWS
+
+		bool SetCurrentThreadAffinity( const std::vector<int32_t> &cpus )
+		{
+			DWORD_PTR mask = 0;
+			if( cpus.empty( ) )
+			{
+				DWORD_PTR system_mask = 0;
+				if( GetProcessAffinityMask( GetCurrentProcess( ), &mask, &system_mask ) == 0 )
+					return false;
+			}
+			else
+			{
+				for( size_t k = 0; k < cpus.size( ); ++k )
+				{
+					if( cpus[k] < 0 || cpus[k] >= static_cast<int32_t>( sizeof( mask ) * 8 ) )
+						return false;
+
+					mask |= static_cast<DWORD_PTR>( 1 ) << cpus[k];
+				}
+			}
+
+			return SetThreadAffinityMask( GetCurrentThread( ), mask ) != 0;
+		}
+
+		bool SetCurrentThreadPriority( Policy policy, int32_t, int32_t nice )
+		{
+			// Windows has no scheduling policies, map them to priority levels instead
+			int32_t priority = THREAD_PRIORITY_NORMAL;
+			if( policy == PolicyFifo || policy == PolicyRoundRobin )
+				priority = THREAD_PRIORITY_TIME_CRITICAL;
+			else if( policy == PolicyIdle )
+				priority = THREAD_PRIORITY_IDLE;
+			else if( nice <= -10 )
+				priority = THREAD_PRIORITY_HIGHEST;
+			else if( nice < 0 )
+				priority = THREAD_PRIORITY_ABOVE_NORMAL;
+			else if( nice >= 10 || policy == PolicyBatch )
+				priority = THREAD_PRIORITY_LOWEST;
+			else if( nice > 0 )
+				priority = THREAD_PRIORITY_BELOW_NORMAL;
+
+			return SetThreadPriority( GetCurrentThread( ), priority ) != 0;
+		}
+
+		bool SetSocketBusyPoll( int32_t, int32_t usec )
+		{
+			return usec == 0;
+		}
+
+#elif defined SYSTEM_POSIX
+
+		static int32_t GetNativePolicy( Policy policy )
+		{
+			switch( policy )
+			{
+
+#if defined SYSTEM_LINUX
+
+			case PolicyBatch:
+				return SCHED_BATCH;
+
+			case PolicyIdle:
+				return SCHED_IDLE;
+
+#endif
+
+			case PolicyFifo:
+				return SCHED_FIFO;
+
+			case PolicyRoundRobin:
+				return SCHED_RR;
+
+			default:
+				return SCHED_OTHER;
+			}
+		}
+
+		bool SetCurrentThreadPriority( Policy policy, int32_t priority, int32_t nice )
+		{
+			int32_t native = GetNativePolicy( policy );
+			sched_param param;
+			memset( &param, 0, sizeof( param ) );
+			if( native == SCHED_FIFO || native == SCHED_RR )
+				param.sched_priority = priority;
+
+			if( pthread_setschedparam( pthread_self( ), native, &param ) != 0 )
+				return false;
+
+#if defined SYSTEM_LINUX
+
+			// nice values are per thread on Linux, it only matters for non realtime policies
+			if( native != SCHED_FIFO && native != SCHED_RR &&
+				setpriority( PRIO_PROCESS, static_cast<id_t>( syscall( SYS_gettid ) ), nice ) != 0 )
+				return false;
+
+#endif
+
+			return true;
+		}
+
+#if defined SYSTEM_LINUX
+
+		bool SetCurrentThreadAffinity( const std::vector<int32_t> &cpus )
+		{
+			cpu_set_t set;
+			CPU_ZERO( &set );
+
+			if( cpus.empty( ) )
+			{
+				long count = sysconf( _SC_NPROCESSORS_CONF );
+				for( long k = 0; k < count && k < CPU_SETSIZE; ++k )
+					CPU_SET( k, &set );
+			}
+			else
+			{
+				for( size_t k = 0; k < cpus.size( ); ++k )
+				{
+					if( cpus[k] < 0 || cpus[k] >= CPU_SETSIZE )
+						return false;
+
+					CPU_SET( cpus[k], &set );
+				}
+			}
+
+			return pthread_setaffinity_np( pthread_self( ), sizeof( set ), &set ) == 0;
+		}
+
+		bool SetSocketBusyPoll( int32_t socket, int32_t usec )
+		{
+
+#if defined SO_BUSY_POLL
+
+			return setsockopt( socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof( usec ) ) == 0;
+
+#else
+
+			return usec == 0;
+
+#endif
+
+		}
+
+#else
+
+		// OSX only has affinity tags, which are hints and not CPU sets
+		bool SetCurrentThreadAffinity( const std::vector<int32_t> &cpus )
+		{
+			return cpus.empty( );
+		}
+
+		bool SetSocketBusyPoll( int32_t, int32_t usec )
+		{
+			return usec == 0;
+		}
+
+#endif
+
+#endif
+
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace netfilter
+{
+	namespace scheduling
+	{
+		enum Policy
+		{
+			PolicyInvalid = -1,
+			PolicyDefault,
+			PolicyBatch,
+			PolicyIdle,
+			PolicyFifo,
+			PolicyRoundRobin
+		};
+
+		Policy ParsePolicy( const char *name );
+
+		// These apply to the calling thread, so they're meant to be called from the
+		// receiver and worker threads themselves. An empty CPU list means every CPU
+		// is allowed.
+		bool SetCurrentThreadAffinity( const std::vector<int32_t> &cpus );
+		bool SetCurrentThreadPriority( Policy policy, int32_t priority, int32_t nice );
+
+		// SO_BUSY_POLL, 0 microseconds disables it.
+		bool SetSocketBusyPoll( int32_t socket, int32_t usec );
+	}
+}
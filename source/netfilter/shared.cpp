@@ -0,0 +1,410 @@
+#include <netfilter/shared.hpp>
+#include <netfilter/atomic.hpp>
+#include <Platform.hpp>
+
+#if defined SYSTEM_LINUX
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#endif
+
+namespace netfilter
+{
+	namespace shared
+	{
+
+#if defined SYSTEM_LINUX
+
+		// bump when the layout below changes, instances refuse mismatched segments
+		static const uint64_t segment_signature = 0x53504F4F00000002ULL; // "SPOO", version 2
+
+		static const uint32_t ban_bits = 16;
+		static const uint32_t ban_capacity = 1U << ban_bits;
+		static const uint32_t ban_probe_limit = 16;
+
+		// instances that stopped heartbeating for this long give up their slot
+		static const uint32_t instance_timeout = 60; // seconds
+
+		// The owner is its pid namespace << 32 | pid, claimed with one compare and
+		// swap so nobody sees a pid paired with another instance's namespace.
+		// Containers sharing /dev/shm can't see each other's pids.
+		struct instance_slot_t
+		{
+			Atomic<uint64_t> owner; // 0 is a free slot
+			Atomic<uint32_t> heartbeat;
+			Atomic<uint32_t> port;
+			Atomic<uint64_t> counters[CounterCount];
+		};
+
+		// A ban is address << 32 | expiry in monotonic seconds, both change together
+		// with one compare and swap. Addresses are never removed from a slot, only
+		// expired or replaced, so probe chains stay intact.
+		struct segment_t
+		{
+			Atomic<uint64_t> signature;
+			instance_slot_t instances[max_instances];
+			Atomic<uint64_t> bans[ban_capacity];
+		};
+
+		// Other processes map the same words, which only works for plain lock-free
+		// words laid out the same by every build.
+		static_assert(
+			sizeof( Atomic<uint64_t> ) == sizeof( uint64_t ) &&
+				alignof( Atomic<uint64_t> ) == sizeof( uint64_t ) &&
+				sizeof( Atomic<uint32_t> ) == sizeof( uint32_t ) &&
+				alignof( Atomic<uint32_t> ) == sizeof( uint32_t ),
+			"shared memory atomics must be naturally aligned plain words"
+		);
+		static_assert(
+			offsetof( instance_slot_t, counters ) % sizeof( uint64_t ) == 0 &&
+				sizeof( instance_slot_t ) % sizeof( uint64_t ) == 0 &&
+				offsetof( segment_t, bans ) % sizeof( uint64_t ) == 0,
+			"shared memory layout must keep every 64 bit word aligned"
+		);
+
+		static segment_t *segment = nullptr;
+		static instance_slot_t *instance = nullptr;
+		static uint64_t instance_owner = 0;
+		static AtomicBool attached( false );
+
+		// CLOCK_MONOTONIC is shared by every process on the host
+		inline uint32_t Now( )
+		{
+			timespec now;
+
+#if defined CLOCK_MONOTONIC_COARSE
+
+			clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+
+#else
+
+			clock_gettime( CLOCK_MONOTONIC, &now );
+
+#endif
+
+			return static_cast<uint32_t>( now.tv_sec );
+		}
+
+		inline uint64_t MakeBan( uint32_t address, uint32_t expiry )
+		{
+			return static_cast<uint64_t>( address ) << 32 | expiry;
+		}
+
+		inline bool IsActive( uint64_t ban, uint32_t now )
+		{
+			return static_cast<int32_t>( static_cast<uint32_t>( ban ) - now ) > 0;
+		}
+
+		inline uint32_t HashAddress( uint32_t address )
+		{
+			return ( address * 0x9E3779B1U ) >> ( 32 - ban_bits );
+		}
+
+		inline Atomic<uint64_t> &GetBanSlot( uint32_t address, uint32_t probe )
+		{
+			return segment->bans[( HashAddress( address ) + probe ) & ( ban_capacity - 1 )];
+		}
+
+		// 0 when it can't be told, then only heartbeats decide whether a slot is stale
+		static uint32_t GetPidNamespace( )
+		{
+			struct stat info;
+			if( stat( "/proc/self/ns/pid", &info ) == -1 )
+				return 0;
+
+			return static_cast<uint32_t>( info.st_ino );
+		}
+
+		// A heartbeat written by another instance after now was read counts as fresh.
+		inline uint32_t GetHeartbeatAge( const instance_slot_t &slot, uint32_t now )
+		{
+			int32_t age = static_cast<int32_t>( now - slot.heartbeat.load( ) );
+			return age > 0 ? static_cast<uint32_t>( age ) : 0;
+		}
+
+		// Pids are only checked within the same namespace, anything else has to stop
+		// heartbeating first.
+		static bool IsStale( const instance_slot_t &slot, uint64_t owner, uint32_t now )
+		{
+			if( owner == 0 || owner == instance_owner )
+				return true;
+
+			uint32_t pid_namespace = static_cast<uint32_t>( owner >> 32 );
+			if( pid_namespace != 0 && pid_namespace == static_cast<uint32_t>( instance_owner >> 32 ) &&
+				kill( static_cast<pid_t>( static_cast<uint32_t>( owner ) ), 0 ) == -1 &&
+				errno == ESRCH )
+				return true;
+
+			return GetHeartbeatAge( slot, now ) > instance_timeout;
+		}
+
+		static instance_slot_t *ClaimInstance( uint16_t port )
+		{
+			instance_owner =
+				static_cast<uint64_t>( GetPidNamespace( ) ) << 32 | static_cast<uint32_t>( getpid( ) );
+
+			uint32_t now = Now( );
+			for( size_t k = 0; k < max_instances; ++k )
+			{
+				instance_slot_t &slot = segment->instances[k];
+				uint64_t owner = slot.owner;
+				if( !IsStale( slot, owner, now ) ||
+					!slot.owner.compare_exchange_strong( owner, instance_owner ) )
+					continue;
+
+				for( size_t c = 0; c < CounterCount; ++c )
+					slot.counters[c] = 0;
+
+				slot.port = port;
+				slot.heartbeat = now;
+				return &slot;
+			}
+
+			return nullptr;
+		}
+
+		bool Attach( const char *name, uint16_t port, const char *&error )
+		{
+			if( attached )
+			{
+				error = "already attached to a shared memory segment";
+				return false;
+			}
+
+			int fd = shm_open( name, O_RDWR | O_CREAT, 0600 );
+			if( fd == -1 )
+			{
+				error = "failed to open the shared memory segment";
+				return false;
+			}
+
+			// a new segment is zero filled, which is an empty table
+			struct stat info;
+			if( fstat( fd, &info ) == -1 ||
+				( info.st_size == 0 && ftruncate( fd, sizeof( segment_t ) ) == -1 ) ||
+				( info.st_size != 0 && info.st_size != static_cast<off_t>( sizeof( segment_t ) ) ) )
+			{
+				close( fd );
+				error = "shared memory segment has the wrong size";
+				return false;
+			}
+
+			void *memory = mmap(
+				nullptr, sizeof( segment_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+			);
+			close( fd );
+			if( memory == MAP_FAILED )
+			{
+				error = "failed to map the shared memory segment";
+				return false;
+			}
+
+			segment_t *mapped = static_cast<segment_t *>( memory );
+			uint64_t signature = 0;
+			if( !mapped->signature.compare_exchange_strong( signature, segment_signature ) &&
+				signature != segment_signature )
+			{
+				munmap( memory, sizeof( segment_t ) );
+				error = "shared memory segment was created by an incompatible version";
+				return false;
+			}
+
+			segment = mapped;
+			instance = ClaimInstance( port );
+			if( instance == nullptr )
+			{
+				segment = nullptr;
+				munmap( memory, sizeof( segment_t ) );
+				error = "no free instance slot in the shared memory segment";
+				return false;
+			}
+
+			attached = true;
+			return true;
+		}
+
+		void Detach( )
+		{
+			if( !attached )
+				return;
+
+			attached = false;
+			instance->owner = 0;
+			munmap( segment, sizeof( segment_t ) );
+			segment = nullptr;
+			instance = nullptr;
+		}
+
+		bool IsAttached( )
+		{
+			return attached;
+		}
+
+		bool IsBanned( uint32_t address )
+		{
+			if( !attached || address == 0 )
+				return false;
+
+			uint32_t now = Now( );
+			for( uint32_t probe = 0; probe < ban_probe_limit; ++probe )
+			{
+				uint64_t ban = GetBanSlot( address, probe );
+				if( ban == 0 )
+					return false;
+
+				if( static_cast<uint32_t>( ban >> 32 ) == address && IsActive( ban, now ) )
+					return true;
+			}
+
+			return false;
+		}
+
+		bool Ban( uint32_t address, uint32_t duration )
+		{
+			if( !attached || address == 0 )
+				return false;
+
+			uint32_t now = Now( );
+			uint32_t expiry = now + ( duration + 999 ) / 1000;
+			uint64_t wanted = MakeBan( address, expiry );
+
+			// extend an existing ban first, so an address doesn't end up in two slots
+			for( uint32_t probe = 0; probe < ban_probe_limit; ++probe )
+			{
+				Atomic<uint64_t> &slot = GetBanSlot( address, probe );
+				uint64_t ban = slot;
+				if( ban == 0 )
+					break;
+
+				while( static_cast<uint32_t>( ban >> 32 ) == address )
+				{
+					if( static_cast<int32_t>( static_cast<uint32_t>( ban ) - expiry ) >= 0 ||
+						slot.compare_exchange_strong( ban, wanted ) )
+						return true;
+				}
+			}
+
+			for( uint32_t probe = 0; probe < ban_probe_limit; ++probe )
+			{
+				Atomic<uint64_t> &slot = GetBanSlot( address, probe );
+				uint64_t ban = slot;
+				while( ban == 0 || !IsActive( ban, now ) )
+					if( slot.compare_exchange_strong( ban, wanted ) )
+						return true;
+			}
+
+			return false;
+		}
+
+		void Unban( uint32_t address )
+		{
+			if( !attached )
+				return;
+
+			for( uint32_t probe = 0; probe < ban_probe_limit; ++probe )
+			{
+				Atomic<uint64_t> &slot = GetBanSlot( address, probe );
+				uint64_t ban = slot;
+				if( ban == 0 )
+					return;
+
+				// keeps the address so the probe chain isn't cut short
+				while( static_cast<uint32_t>( ban >> 32 ) == address &&
+					!slot.compare_exchange_strong( ban, MakeBan( address, 0 ) ) );
+			}
+		}
+
+		void Clear( )
+		{
+			if( !attached )
+				return;
+
+			for( uint32_t k = 0; k < ban_capacity; ++k )
+			{
+				uint64_t ban = segment->bans[k];
+				while( ban != 0 && static_cast<uint32_t>( ban ) != 0 &&
+					!segment->bans[k].compare_exchange_strong( ban, ban & 0xFFFFFFFF00000000ULL ) );
+			}
+		}
+
+		void Increment( Counter counter )
+		{
+			if( attached )
+				instance->counters[counter].fetch_add( 1 );
+		}
+
+		void Heartbeat( )
+		{
+			if( attached )
+				instance->heartbeat = Now( );
+		}
+
+		void GetInstances( std::vector<instance_t> &instances )
+		{
+			if( !attached )
+				return;
+
+			uint32_t now = Now( );
+			for( size_t k = 0; k < max_instances; ++k )
+			{
+				instance_slot_t &slot = segment->instances[k];
+				instance_t info;
+				uint64_t owner = slot.owner;
+				if( owner == 0 )
+					continue;
+
+				info.pid = static_cast<uint32_t>( owner );
+				info.port = slot.port;
+				info.age = GetHeartbeatAge( slot, now );
+				for( size_t c = 0; c < CounterCount; ++c )
+					info.counters[c] = slot.counters[c];
+
+				instances.push_back( info );
+			}
+		}
+
+#else
+
+		bool Attach( const char *, uint16_t, const char *&error )
+		{
+			error = "shared memory is only supported on Linux";
+			return false;
+		}
+
+		void Detach( ) { }
+
+		bool IsAttached( )
+		{
+			return false;
+		}
+
+		bool IsBanned( uint32_t )
+		{
+			return false;
+		}
+
+		bool Ban( uint32_t, uint32_t )
+		{
+			return false;
+		}
+
+		void Unban( uint32_t ) { }
+
+		void Clear( ) { }
+
+		void Increment( Counter ) { }
+
+		void Heartbeat( ) { }
+
+		void GetInstances( std::vector<instance_t> & ) { }
+
+#endif
+
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Optional POSIX shared memory segment mapped by every instance on the host,
+	// holding a ban table checked on the hot path and one stats slot per instance.
+	// Every update is a single word atomic, so an instance dying at any point
+	// can't leave the segment inconsistent. Only available on Linux.
+	namespace shared
+	{
+		static const size_t max_instances = 64;
+
+		enum Counter
+		{
+			CounterReceived,
+			CounterInvalid,
+			CounterBanned, // dropped because the source was banned
+			CounterInfoQueries,
+			CounterPlayerQueries,
+			CounterBans, // sources banned by this instance
+			CounterCount
+		};
+
+		struct instance_t
+		{
+			uint32_t pid; // in the instance's own pid namespace
+			uint32_t port;
+			uint32_t age; // seconds since the last heartbeat
+			uint64_t counters[CounterCount];
+		};
+
+		// name is a shm_open name, like "/gmsv_spoof". Attaching is only done once,
+		// the segment stays mapped until Detach( ) is called on shutdown.
+		bool Attach( const char *name, uint16_t port, const char *&error );
+		void Detach( );
+		bool IsAttached( );
+
+		// addresses are in host byte order
+		bool IsBanned( uint32_t address );
+		bool Ban( uint32_t address, uint32_t duration );
+		void Unban( uint32_t address );
+		void Clear( );
+
+		void Increment( Counter counter );
+
+		// Called periodically by the receiver so other instances can tell it's alive.
+		void Heartbeat( );
+
+		void GetInstances( std::vector<instance_t> &instances );
+	}
+}
@@ -0,0 +1,475 @@
+#include <netfilter/snapshot.hpp>
+#include <netfilter/atomic.hpp>
+#include <main.hpp>
+#include <Platform.hpp>
+#include <string.h>
+#include <threadtools.h>
+
+#if defined SYSTEM_LINUX
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#endif
+
+namespace netfilter
+{
+	namespace snapshot
+	{
+
+#if defined SYSTEM_LINUX
+
+		static file_t *file = nullptr;
+		static AtomicBool file_open( false );
+		static CThreadFastMutex file_mutex;
+
+		// Bans are kept in wall clock time, the monotonic clock starts over on reboot.
+		inline uint64_t GetRealtimeMilliseconds( )
+		{
+			timespec now;
+			clock_gettime( CLOCK_REALTIME, &now );
+			return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+		}
+
+		static_assert( ban_slots == 1 << 15, "GetBanSlot takes the top 15 bits" );
+
+		inline uint32_t GetBanSlot( uint32_t address )
+		{
+			return ( address * 0x9E3779B1U ) >> 17;
+		}
+
+		static bool IsTerminated( const char *name )
+		{
+			return memchr( name, 0, max_name ) != nullptr;
+		}
+
+		// Anything a crashed or different build could have left behind is rejected.
+		static bool IsRestorable( const file_t &snapshot, off_t size )
+		{
+			if( size != static_cast<off_t>( sizeof( file_t ) ) ||
+				snapshot.magic != file_magic ||
+				snapshot.version != file_version ||
+				snapshot.size != sizeof( file_t ) ||
+				snapshot.dirty != 0 ||
+				snapshot.unrepresentable != 0 ||
+				snapshot.populated == 0 )
+				return false;
+
+			if( snapshot.class_count == 0 || snapshot.class_count > max_classes ||
+				snapshot.cidr_count > max_cidrs )
+				return false;
+
+			for( uint32_t k = 0; k < snapshot.class_count; ++k )
+			{
+				const class_record_t &requester = snapshot.classes[k];
+				if( !IsTerminated( requester.name ) || requester.player_count > max_players )
+					return false;
+
+				for( uint32_t p = 0; p < requester.player_count; ++p )
+					if( !IsTerminated( requester.players[p].name ) )
+						return false;
+			}
+
+			for( uint32_t k = 0; k < snapshot.cidr_count; ++k )
+				if( snapshot.cidrs[k].class_index >= snapshot.class_count ||
+					snapshot.cidrs[k].first > snapshot.cidrs[k].last )
+					return false;
+
+			return true;
+		}
+
+		// Must be called with file_mutex held, every write in between is covered by
+		// dirty so a process dying halfway leaves a file that won't be restored.
+		inline bool BeginUpdate( )
+		{
+			if( file == nullptr )
+				return false;
+
+			__atomic_store_n( &file->dirty, 1, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+			return true;
+		}
+
+		inline void EndUpdate( )
+		{
+			file->populated = 1;
+			__atomic_store_n( &file->dirty, 0, __ATOMIC_RELEASE );
+		}
+
+		static void MarkUnrepresentable( const char *what )
+		{
+			if( file->unrepresentable == 0 )
+				DebugWarning( "[spoof] %s doesn't fit in the snapshot, it won't be restored\n", what );
+
+			file->unrepresentable = 1;
+		}
+
+		const file_t *Open( const char *path, const char *&error )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( file != nullptr )
+			{
+				error = "a snapshot is already open";
+				return nullptr;
+			}
+
+			int fd = open( path, O_RDWR | O_CREAT, 0644 );
+			if( fd == -1 )
+			{
+				error = "failed to open the snapshot file";
+				return nullptr;
+			}
+
+			struct stat info;
+			if( fstat( fd, &info ) == -1 ||
+				( info.st_size != static_cast<off_t>( sizeof( file_t ) ) &&
+					ftruncate( fd, sizeof( file_t ) ) == -1 ) )
+			{
+				close( fd );
+				error = "failed to resize the snapshot file";
+				return nullptr;
+			}
+
+			void *memory = mmap(
+				nullptr, sizeof( file_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+			);
+			close( fd );
+			if( memory == MAP_FAILED )
+			{
+				error = "failed to map the snapshot file";
+				return nullptr;
+			}
+
+			file = static_cast<file_t *>( memory );
+			file_open = true;
+
+			bool restorable = IsRestorable( *file, info.st_size );
+			if( !restorable )
+			{
+				memset( file, 0, sizeof( file_t ) );
+				file->magic = file_magic;
+				file->version = file_version;
+				file->size = sizeof( file_t );
+			}
+
+			file->pid = static_cast<uint32_t>( getpid( ) );
+			return restorable ? file : nullptr;
+		}
+
+		void Close( )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( file == nullptr )
+				return;
+
+			file_open = false;
+			munmap( file, sizeof( file_t ) );
+			file = nullptr;
+		}
+
+		bool IsOpen( )
+		{
+			return file_open;
+		}
+
+		void SaveSettings( const settings_t &settings )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			file->settings = settings;
+			EndUpdate( );
+		}
+
+		void SaveClass( uint32_t index, const char *name, int32_t spoof_count )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			size_t length = strlen( name );
+			if( index >= max_classes || length >= max_name )
+			{
+				MarkUnrepresentable( "requester class" );
+				EndUpdate( );
+				return;
+			}
+
+			class_record_t &requester = file->classes[index];
+			memcpy( requester.name, name, length + 1 );
+			requester.spoof_count = spoof_count;
+			requester.player_count = 0;
+			if( index >= file->class_count )
+				file->class_count = index + 1;
+
+			EndUpdate( );
+		}
+
+		void SaveSpoofCount( uint32_t index, int32_t spoof_count )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( index < max_classes )
+				file->classes[index].spoof_count = spoof_count;
+
+			EndUpdate( );
+		}
+
+		void SaveClassCount( uint32_t count )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( count > max_classes )
+				MarkUnrepresentable( "requester class" );
+			else
+				file->class_count = count;
+
+			EndUpdate( );
+		}
+
+		void SavePlayer(
+			uint32_t class_index,
+			uint32_t index,
+			const char *name,
+			size_t name_size,
+			double score,
+			double time
+		)
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			// names are kept terminated, so ones with a 0 in them can't be restored
+			if( class_index >= max_classes || index >= max_players || name_size >= max_name ||
+				memchr( name, 0, name_size ) != nullptr )
+			{
+				MarkUnrepresentable( "spoofed player" );
+				EndUpdate( );
+				return;
+			}
+
+			player_record_t &player = file->classes[class_index].players[index];
+			memcpy( player.name, name, name_size );
+			player.name[name_size] = '\0';
+			player.score = score;
+			player.time = time;
+			EndUpdate( );
+		}
+
+		void SavePlayerTime( uint32_t class_index, uint32_t index, double time )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( class_index < max_classes && index < max_players )
+				file->classes[class_index].players[index].time = time;
+
+			EndUpdate( );
+		}
+
+		void SavePlayerCount( uint32_t class_index, uint32_t count )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( class_index < max_classes && count <= max_players )
+				file->classes[class_index].player_count = count;
+
+			EndUpdate( );
+		}
+
+		void SaveCIDR( uint32_t index, uint32_t first, uint32_t last, uint32_t class_index )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( index >= max_cidrs )
+			{
+				MarkUnrepresentable( "requester range" );
+				EndUpdate( );
+				return;
+			}
+
+			cidr_record_t &cidr = file->cidrs[index];
+			cidr.first = first;
+			cidr.last = last;
+			cidr.class_index = class_index;
+			if( index >= file->cidr_count )
+				file->cidr_count = index + 1;
+
+			EndUpdate( );
+		}
+
+		void SaveCIDRCount( uint32_t count )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			if( count <= max_cidrs )
+				file->cidr_count = count;
+
+			EndUpdate( );
+		}
+
+		void SaveBan( uint32_t address, uint32_t duration )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( address == 0 || !BeginUpdate( ) )
+				return;
+
+			uint64_t now = GetRealtimeMilliseconds( );
+			uint32_t slot = GetBanSlot( address ), reuse = ban_slots;
+			for( uint32_t k = 0; k < ban_slots; ++k )
+			{
+				uint32_t index = ( slot + k ) & ( ban_slots - 1 );
+				ban_record_t &ban = file->bans[index];
+				if( ban.address == address )
+				{
+					reuse = index;
+					break;
+				}
+
+				// removed and expired bans are reused, but only the first empty slot
+				// proves the address isn't further along
+				if( ban.address == 0 || ban.expires <= now )
+				{
+					if( reuse == ban_slots )
+						reuse = index;
+
+					if( ban.address == 0 )
+						break;
+				}
+			}
+
+			if( reuse == ban_slots )
+			{
+				MarkUnrepresentable( "ban" );
+				EndUpdate( );
+				return;
+			}
+
+			ban_record_t &ban = file->bans[reuse];
+			ban.address = address;
+			ban.expires = now + duration;
+			EndUpdate( );
+		}
+
+		void RemoveBan( uint32_t address )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( address == 0 || !BeginUpdate( ) )
+				return;
+
+			uint32_t slot = GetBanSlot( address );
+			for( uint32_t k = 0; k < ban_slots; ++k )
+			{
+				ban_record_t &ban = file->bans[( slot + k ) & ( ban_slots - 1 )];
+				if( ban.address == 0 )
+					break;
+
+				if( ban.address == address )
+				{
+					ban.expires = 0;
+					break;
+				}
+			}
+
+			EndUpdate( );
+		}
+
+		void ClearBans( )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			memset( file->bans, 0, sizeof( file->bans ) );
+			EndUpdate( );
+		}
+
+		void TakeBans( std::vector<bans::ban_t> &list )
+		{
+			AUTO_LOCK( file_mutex );
+
+			if( !BeginUpdate( ) )
+				return;
+
+			uint64_t now = GetRealtimeMilliseconds( );
+			for( uint32_t k = 0; k < ban_slots; ++k )
+			{
+				const ban_record_t &record = file->bans[k];
+				if( record.address == 0 || record.expires <= now )
+					continue;
+
+				uint64_t remaining = record.expires - now;
+				bans::ban_t ban;
+				ban.address = record.address;
+				ban.remaining = remaining < 0xFFFFFFFF ? static_cast<uint32_t>( remaining ) : 0xFFFFFFFF;
+				ban.hits = 0;
+				list.push_back( ban );
+			}
+
+			memset( file->bans, 0, sizeof( file->bans ) );
+			EndUpdate( );
+		}
+
+#else
+
+		const file_t *Open( const char *, const char *&error )
+		{
+			error = "snapshots are only supported on Linux";
+			return nullptr;
+		}
+
+		void Close( ) { }
+
+		bool IsOpen( )
+		{
+			return false;
+		}
+
+		void SaveSettings( const settings_t & ) { }
+		void SaveClass( uint32_t, const char *, int32_t ) { }
+		void SaveSpoofCount( uint32_t, int32_t ) { }
+		void SaveClassCount( uint32_t ) { }
+		void SavePlayer( uint32_t, uint32_t, const char *, size_t, double, double ) { }
+		void SavePlayerTime( uint32_t, uint32_t, double ) { }
+		void SavePlayerCount( uint32_t, uint32_t ) { }
+		void SaveCIDR( uint32_t, uint32_t, uint32_t, uint32_t ) { }
+		void SaveCIDRCount( uint32_t ) { }
+		void SaveBan( uint32_t, uint32_t ) { }
+		void RemoveBan( uint32_t ) { }
+		void ClearBans( ) { }
+		void TakeBans( std::vector<bans::ban_t> & ) { }
+
+#endif
+
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <netfilter/bans.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Memory mapped file mirroring the state Lua configures (spoofing, requester
+	// classes and their players, bans and filter settings), updated in place by
+	// every change, so a reloaded module or restarted server picks up where the
+	// last one left off before Lua runs again. Reply caches aren't kept, they're
+	// rebuilt from this state on the first query. Only available on Linux.
+	namespace snapshot
+	{
+		static const uint64_t file_magic = 0x50414E53464F4F50ULL; // "POOFSNAP"
+		static const uint32_t file_version = 1;
+
+		static const uint32_t max_classes = 16;
+		static const uint32_t max_players = 255;
+		static const uint32_t max_cidrs = 1024;
+		static const uint32_t max_name = 128; // including the terminator
+		static const uint32_t ban_slots = bans::max_bans * 2; // power of 2
+
+		struct settings_t
+		{
+			uint32_t spoofing_enabled;
+			uint32_t info_cache_time; // milliseconds
+			uint32_t player_cache_time;
+			uint32_t ban_threshold;
+			uint32_t ban_window;
+			uint32_t ban_duration;
+			uint32_t handshake_window;
+			uint32_t egress_bytes; // per second
+			uint32_t egress_replies;
+			uint32_t egress_burst;
+			uint32_t egress_fallback; // egress::Fallback
+		};
+
+		struct player_record_t
+		{
+			char name[max_name];
+			double score;
+			double time;
+		};
+
+		struct class_record_t
+		{
+			char name[max_name];
+			int32_t spoof_count;
+			uint32_t player_count;
+			player_record_t players[max_players];
+		};
+
+		struct cidr_record_t
+		{
+			uint32_t first; // host byte order
+			uint32_t last;
+			uint32_t class_index;
+		};
+
+		// Open addressing by address, 0 ends a probe, expires == 0 is a removed ban.
+		struct ban_record_t
+		{
+			uint32_t address; // host byte order
+			uint32_t padding;
+			uint64_t expires; // realtime milliseconds
+		};
+
+		struct file_t
+		{
+			uint64_t magic;
+			uint32_t version;
+			uint32_t size; // sizeof( file_t )
+			uint32_t pid; // of the last process that opened it
+			uint32_t dirty; // set while an update is half written
+			uint32_t unrepresentable; // some state didn't fit, never restored
+			uint32_t populated; // anything was saved since the file was created
+
+			settings_t settings;
+			uint32_t class_count;
+			uint32_t cidr_count;
+			class_record_t classes[max_classes];
+			cidr_record_t cidrs[max_cidrs];
+			ban_record_t bans[ban_slots];
+		};
+
+		// Maps the file at path, creating it when needed. Returns the previous
+		// contents when they are complete and from this layout, nullptr otherwise,
+		// in which case the file starts over empty. Valid until Close( ).
+		const file_t *Open( const char *path, const char *&error );
+		void Close( );
+		bool IsOpen( );
+
+		void SaveSettings( const settings_t &settings );
+
+		// Saving a class past the end appends it, class_count only ever grows by one.
+		void SaveClass( uint32_t index, const char *name, int32_t spoof_count );
+		void SaveSpoofCount( uint32_t index, int32_t spoof_count );
+		void SaveClassCount( uint32_t count );
+
+		void SavePlayer(
+			uint32_t class_index,
+			uint32_t index,
+			const char *name,
+			size_t name_size,
+			double score,
+			double time
+		);
+		void SavePlayerTime( uint32_t class_index, uint32_t index, double time );
+		void SavePlayerCount( uint32_t class_index, uint32_t count );
+
+		void SaveCIDR( uint32_t index, uint32_t first, uint32_t last, uint32_t class_index );
+		void SaveCIDRCount( uint32_t count );
+
+		// addresses are in host byte order, durations in milliseconds
+		void SaveBan( uint32_t address, uint32_t duration );
+		void RemoveBan( uint32_t address );
+		void ClearBans( );
+
+		// Bans of the restored file that haven't expired yet, with the time they
+		// have left, and empties the table so they can be saved again in order.
+		void TakeBans( std::vector<bans::ban_t> &list );
+	}
+}
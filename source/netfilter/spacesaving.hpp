@@ -0,0 +1,203 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Space-Saving top-k sketch over uint32_t keys in fixed memory. Counters live
+	// in a min-heap so a new key replaces the smallest one in O(log k), and an
+	// open addressed index finds existing keys in O(1). Counts are overestimates
+	// by at most the counter's error. Not synchronized.
+	class SpaceSaving
+	{
+	public:
+		struct counter_t
+		{
+			uint32_t key;
+			uint32_t count;
+			uint32_t error;
+			uint32_t slot; // position in the index
+			uint64_t bytes;
+		};
+
+		// capacity must be a power of 2
+		SpaceSaving( uint32_t capacity ) :
+			heap_capacity( capacity ),
+			index_mask( capacity * 2 - 1 ),
+			index_shift( 32 - Log2( capacity * 2 ) ),
+			index( capacity * 2, none )
+		{
+			heap.reserve( capacity );
+		}
+
+		void Add( uint32_t key, uint32_t bytes )
+		{
+			uint32_t slot = Find( key );
+			if( index[slot] != none )
+			{
+				uint32_t position = index[slot];
+				++heap[position].count;
+				heap[position].bytes += bytes;
+				SiftDown( position );
+				return;
+			}
+
+			if( heap.size( ) < heap_capacity )
+			{
+				counter_t counter = { key, 1, 0, slot, bytes };
+				index[slot] = static_cast<uint32_t>( heap.size( ) );
+				heap.push_back( counter );
+				SiftUp( static_cast<uint32_t>( heap.size( ) - 1 ) );
+				return;
+			}
+
+			// replace the smallest counter, inheriting its count as error
+			counter_t &smallest = heap[0];
+			Unindex( smallest.slot );
+			slot = Find( key );
+			smallest.key = key;
+			smallest.error = smallest.count;
+			++smallest.count;
+			smallest.bytes += bytes;
+			smallest.slot = slot;
+			index[slot] = 0;
+			SiftDown( 0 );
+		}
+
+		// Divides every counter by 2^shift, halving keeps the heap ordered.
+		void Decay( uint32_t shift )
+		{
+			if( shift > 31 )
+				shift = 31;
+
+			for( size_t k = 0; k < heap.size( ); ++k )
+			{
+				heap[k].count >>= shift;
+				heap[k].error >>= shift;
+				heap[k].bytes >>= shift;
+			}
+		}
+
+		void Reset( )
+		{
+			heap.clear( );
+			index.assign( index.size( ), none );
+		}
+
+		// unordered
+		const std::vector<counter_t> &GetCounters( ) const
+		{
+			return heap;
+		}
+
+	private:
+		enum : uint32_t
+		{
+			none = 0xFFFFFFFF
+		};
+
+		static uint32_t Log2( uint32_t value )
+		{
+			uint32_t bits = 0;
+			while( ( 1U << bits ) < value )
+				++bits;
+
+			return bits;
+		}
+
+		// Fibonacci hashing takes the top bits, the low ones only depend on the low
+		// bits of the key and every /24 prefix has 8 zeroes there
+		uint32_t Home( uint32_t key ) const
+		{
+			return ( key * 0x9E3779B1U ) >> index_shift;
+		}
+
+		// the index slot holding key, or the empty slot where it would go
+		uint32_t Find( uint32_t key ) const
+		{
+			uint32_t slot = Home( key );
+			while( index[slot] != none && heap[index[slot]].key != key )
+				slot = ( slot + 1 ) & index_mask;
+
+			return slot;
+		}
+
+		// linear probing removal, later entries of the cluster shift back
+		void Unindex( uint32_t slot )
+		{
+			uint32_t next = slot;
+			while( true )
+			{
+				index[slot] = none;
+				while( true )
+				{
+					next = ( next + 1 ) & index_mask;
+					if( index[next] == none )
+						return;
+
+					uint32_t home = Home( heap[index[next]].key );
+					// stays unless its home is cyclically outside ( slot, next ]
+					if( slot <= next ? ( slot < home && home <= next ) : ( slot < home || home <= next ) )
+						continue;
+
+					break;
+				}
+
+				index[slot] = index[next];
+				heap[index[slot]].slot = slot;
+				slot = next;
+			}
+		}
+
+		void Swap( uint32_t a, uint32_t b )
+		{
+			counter_t temp = heap[a];
+			heap[a] = heap[b];
+			heap[b] = temp;
+			index[heap[a].slot] = a;
+			index[heap[b].slot] = b;
+		}
+
+		void SiftUp( uint32_t position )
+		{
+			while( position > 0 )
+			{
+				uint32_t parent = ( position - 1 ) / 2;
+				if( heap[parent].count <= heap[position].count )
+					return;
+
+				Swap( parent, position );
+				position = parent;
+			}
+		}
+
+		void SiftDown( uint32_t position )
+		{
+			uint32_t size = static_cast<uint32_t>( heap.size( ) );
+			while( true )
+			{
+				uint32_t smallest = position;
+				uint32_t left = position * 2 + 1, right = left + 1;
+				if( left < size && heap[left].count < heap[smallest].count )
+					smallest = left;
+
+				if( right < size && heap[right].count < heap[smallest].count )
+					smallest = right;
+
+				if( smallest == position )
+					return;
+
+				Swap( smallest, position );
+				position = smallest;
+			}
+		}
+
+		uint32_t heap_capacity;
+		uint32_t index_mask;
+		uint32_t index_shift;
+		std::vector<counter_t> heap;
+		std::vector<uint32_t> index;
+	};
+}
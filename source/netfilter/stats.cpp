@@ -0,0 +1,142 @@
+#include <netfilter/stats.hpp>
+#include <netfilter/atomic.hpp>
+#include <Platform.hpp>
+#include <stddef.h>
+#include <string.h>
+#include <threadtools.h>
+
+#if defined SYSTEM_LINUX
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#endif
+
+namespace netfilter
+{
+	namespace stats
+	{
+
+#if defined SYSTEM_LINUX
+
+		// everything from here on is covered by the seqlock
+		static const size_t body_offset = offsetof( page_t, updated );
+
+		static page_t *page = nullptr;
+		static AtomicBool page_open( false );
+		static CThreadFastMutex page_mutex;
+
+		bool Open( const char *path, const char *&error )
+		{
+			AUTO_LOCK( page_mutex );
+
+			if( page != nullptr )
+			{
+				error = "a stats page is already open";
+				return false;
+			}
+
+			int fd = open( path, O_RDWR | O_CREAT, 0644 );
+			if( fd == -1 )
+			{
+				error = "failed to open the stats page file";
+				return false;
+			}
+
+			if( ftruncate( fd, sizeof( page_t ) ) == -1 )
+			{
+				close( fd );
+				error = "failed to resize the stats page file";
+				return false;
+			}
+
+			void *memory = mmap(
+				nullptr, sizeof( page_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+			);
+			close( fd );
+			if( memory == MAP_FAILED )
+			{
+				error = "failed to map the stats page file";
+				return false;
+			}
+
+			page = static_cast<page_t *>( memory );
+
+			// an odd sequence keeps readers away until the first publish, bumping
+			// instead of resetting it so readers of the last run notice the change
+			uint32_t sequence = __atomic_load_n( &page->sequence, __ATOMIC_RELAXED );
+			__atomic_store_n( &page->sequence, ( sequence | 1 ) + 2, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+
+			memset(
+				reinterpret_cast<char *>( page ) + body_offset, 0, sizeof( page_t ) - body_offset
+			);
+			page->magic = page_magic;
+			page->version = page_version;
+			page->size = sizeof( page_t );
+			page->pid = static_cast<uint32_t>( getpid( ) );
+
+			page_open = true;
+			return true;
+		}
+
+		void Close( )
+		{
+			AUTO_LOCK( page_mutex );
+
+			if( page == nullptr )
+				return;
+
+			page_open = false;
+			munmap( page, sizeof( page_t ) );
+			page = nullptr;
+		}
+
+		bool IsOpen( )
+		{
+			return page_open;
+		}
+
+		void Publish( const page_t &source )
+		{
+			AUTO_LOCK( page_mutex );
+
+			if( page == nullptr )
+				return;
+
+			uint32_t sequence = __atomic_load_n( &page->sequence, __ATOMIC_RELAXED ) | 1;
+			__atomic_store_n( &page->sequence, sequence, __ATOMIC_RELAXED );
+			__atomic_thread_fence( __ATOMIC_RELEASE );
+
+			memcpy(
+				reinterpret_cast<char *>( page ) + body_offset,
+				reinterpret_cast<const char *>( &source ) + body_offset,
+				sizeof( page_t ) - body_offset
+			);
+
+			__atomic_store_n( &page->sequence, sequence + 1, __ATOMIC_RELEASE );
+		}
+
+#else
+
+		bool Open( const char *, const char *&error )
+		{
+			error = "stats pages are only supported on Linux";
+			return false;
+		}
+
+		void Close( ) { }
+
+		bool IsOpen( )
+		{
+			return false;
+		}
+
+		void Publish( const page_t & ) { }
+
+#endif
+
+	}
+}
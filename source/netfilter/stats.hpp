@@ -0,0 +1,21 @@
+#pragma once
+
+#include <netfilter/statspage.hpp>
+
+namespace netfilter
+{
+	// Publishes a stats::page_t into a memory mapped file, so external monitoring
+	// can read it without talking to the server. Only available on Linux.
+	namespace stats
+	{
+		// The file is created or truncated to the page size, readers may already
+		// have it mapped from a previous run.
+		bool Open( const char *path, const char *&error );
+		void Close( );
+		bool IsOpen( );
+
+		// Copies everything after the header fields into the mapping under the
+		// seqlock, the sequence, magic, version, size and pid fields are ignored.
+		void Publish( const page_t &page );
+	}
+}
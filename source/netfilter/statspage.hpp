@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+
+// Layout of the memory mapped stats page, shared by the module and the reader
+// tool so it can't depend on anything else. Every field has a fixed size and
+// offset, bump page_version whenever any of them changes.
+namespace netfilter
+{
+	namespace stats
+	{
+		static const uint64_t page_magic = 0x45474150464F4F50ULL; // "POOFPAGE"
+		static const uint32_t page_version = 3;
+
+		static const uint32_t max_sockets = 8;
+		static const uint32_t counter_count = 6; // shared::Counter
+		static const uint32_t stage_count = 3; // LatencyStage
+		static const uint32_t class_count = 4; // PacketType + 1
+		static const uint32_t bucket_count = 40; // LatencyHistogram
+
+		static const char *const counter_names[counter_count] = {
+			"received",
+			"invalid",
+			"banned",
+			"info",
+			"player",
+			"bans"
+		};
+
+		static const char *const stage_names[stage_count] = {
+			"kernel_to_receiver",
+			"receiver_to_dequeue",
+			"query_turnaround"
+		};
+
+		static const char *const class_names[class_count] = {
+			"invalid",
+			"good",
+			"info",
+			"player"
+		};
+
+		struct socket_stats_t
+		{
+			int32_t index; // in net_sockets
+			int32_t port;
+			uint32_t queued;
+			uint32_t answer_queries;
+			uint32_t info_cache_age; // milliseconds, 0xFFFFFFFF until first built
+			uint32_t player_cache_age;
+			uint64_t counters[counter_count];
+		};
+
+		struct histogram_t
+		{
+			uint64_t count;
+			uint64_t total; // nanoseconds
+			uint64_t buckets[bucket_count]; // bucket k counts [2^k, 2^(k+1)) ns
+		};
+
+		// Seqlock: sequence is odd while the module writes, readers copy the page
+		// and retry unless sequence was even and unchanged across the copy.
+		struct page_t
+		{
+			uint64_t magic;
+			uint32_t version;
+			uint32_t size; // sizeof( page_t )
+			uint32_t sequence;
+			uint32_t pid;
+			uint64_t updated; // realtime milliseconds of the last publish
+
+			uint64_t counters[counter_count]; // all sockets together
+			uint32_t socket_count;
+			uint32_t workers;
+			uint64_t worker_dropped;
+			uint64_t handshakes_coalesced;
+			uint64_t egress_bytes_in; // queries answered by the module
+			uint64_t egress_bytes_out; // its replies and challenges
+			uint64_t egress_replies;
+			uint64_t egress_challenges;
+			uint64_t egress_dropped;
+			socket_stats_t sockets[max_sockets];
+
+			histogram_t latency[stage_count][class_count];
+			uint64_t wakeup_count;
+			uint64_t wakeup_total; // nanoseconds
+			uint64_t wakeup_min;
+			uint64_t wakeup_max;
+		};
+	}
+}
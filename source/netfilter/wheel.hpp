@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace netfilter
+{
+	// Hierarchical timing wheel over a fixed set of timer ids [0, capacity).
+	// Scheduling and cancelling are O(1), Advance( ) only touches the slots that
+	// come due, far away timers cascade down one level every 64^level ticks.
+	// Not synchronized, the owner serializes every call.
+	class TimerWheel
+	{
+	public:
+		static const uint32_t slot_bits = 6;
+		static const uint32_t slot_count = 1 << slot_bits;
+		static const uint32_t slot_mask = slot_count - 1;
+		static const uint32_t level_count = 4;
+		// timers further away than this are clamped to it
+		static const uint32_t max_delay = ( 1U << ( slot_bits * level_count ) ) - 1;
+		static const uint32_t none = 0xFFFFFFFF;
+
+		TimerWheel( uint32_t capacity ) :
+			timers( capacity ),
+			current( 0 )
+		{
+			for( uint32_t l = 0; l < level_count; ++l )
+				for( uint32_t s = 0; s < slot_count; ++s )
+					slots[l][s] = none;
+		}
+
+		uint32_t GetTick( ) const
+		{
+			return current;
+		}
+
+		bool IsScheduled( uint32_t id ) const
+		{
+			return timers[id].scheduled;
+		}
+
+		uint32_t GetExpiry( uint32_t id ) const
+		{
+			return timers[id].expiry;
+		}
+
+		// Reschedules the timer if it was already scheduled, expiries at or before
+		// the current tick fire on the next one.
+		void Schedule( uint32_t id, uint32_t expiry )
+		{
+			Cancel( id );
+
+			uint32_t delay = expiry - current;
+			if( delay == 0 || delay > 0x7FFFFFFF )
+				delay = 1;
+			else if( delay > max_delay )
+				delay = max_delay;
+
+			timers[id].expiry = current + delay;
+			Link( id );
+		}
+
+		void Cancel( uint32_t id )
+		{
+			timer_t &timer = timers[id];
+			if( !timer.scheduled )
+				return;
+
+			if( timer.prev != none )
+				timers[timer.prev].next = timer.next;
+			else
+				slots[timer.level][timer.slot] = timer.next;
+
+			if( timer.next != none )
+				timers[timer.next].prev = timer.prev;
+
+			timer.scheduled = false;
+		}
+
+		// Moves time forward to tick now and calls expired( id ) for every timer
+		// that came due, in tick order. Callbacks may schedule or cancel timers.
+		template<typename Function>
+		void Advance( uint32_t now, Function expired )
+		{
+			while( current != now )
+			{
+				++current;
+
+				// refill the lower levels from the top down, a timer cascaded from
+				// level 2 may land in the level 1 slot that's cascaded right after
+				uint32_t level = 1;
+				while( level < level_count &&
+					( current & ( ( 1U << ( slot_bits * level ) ) - 1 ) ) == 0 )
+					++level;
+
+				for( uint32_t l = level - 1; l > 0; --l )
+					Cascade( l );
+
+				uint32_t &slot = slots[0][current & slot_mask];
+				while( slot != none )
+				{
+					uint32_t id = slot;
+					Cancel( id );
+					expired( id );
+				}
+			}
+		}
+
+	private:
+		struct timer_t
+		{
+			timer_t( ) :
+				next( none ),
+				prev( none ),
+				expiry( 0 ),
+				level( 0 ),
+				slot( 0 ),
+				scheduled( false )
+			{ }
+
+			uint32_t next;
+			uint32_t prev;
+			uint32_t expiry;
+			uint8_t level;
+			uint8_t slot;
+			bool scheduled;
+		};
+
+		void Link( uint32_t id )
+		{
+			timer_t &timer = timers[id];
+			uint32_t delay = timer.expiry - current;
+
+			uint32_t level = 0;
+			while( level < level_count - 1 && delay >= ( 1U << ( slot_bits * ( level + 1 ) ) ) )
+				++level;
+
+			timer.level = static_cast<uint8_t>( level );
+			timer.slot = static_cast<uint8_t>( ( timer.expiry >> ( slot_bits * level ) ) & slot_mask );
+			timer.prev = none;
+			timer.next = slots[level][timer.slot];
+			if( timer.next != none )
+				timers[timer.next].prev = id;
+
+			slots[level][timer.slot] = id;
+			timer.scheduled = true;
+		}
+
+		void Cascade( uint32_t level )
+		{
+			uint32_t id = slots[level][( current >> ( slot_bits * level ) ) & slot_mask];
+			slots[level][( current >> ( slot_bits * level ) ) & slot_mask] = none;
+			while( id != none )
+			{
+				uint32_t next = timers[id].next;
+				Link( id );
+				id = next;
+			}
+		}
+
+		std::vector<timer_t> timers;
+		uint32_t slots[level_count][slot_count];
+		uint32_t current;
+	};
+}
@@ -0,0 +1,179 @@
+#include <netfilter/workers.hpp>
+#include <netfilter/scheduling.hpp>
+#include <main.hpp>
+#include <utility>
+
+namespace netfilter
+{
+	WorkerPool::WorkerPool( Handler h, size_t shard_capacity ) :
+		handler( h ),
+		capacity( shard_capacity ),
+		running( false ),
+		worker_count( 0 ),
+		dropped( 0 )
+	{ }
+
+	WorkerPool::~WorkerPool( )
+	{
+		Stop( );
+	}
+
+	bool WorkerPool::Start( size_t count )
+	{
+		Stop( );
+
+		if( count > max_workers )
+			count = max_workers;
+
+		running = true;
+		for( size_t k = 0; k < count; ++k )
+		{
+			shard_t *shard = new shard_t( this );
+			shard->pending.reserve( capacity );
+			shard->thread = CreateSimpleThread( WorkerThread, shard );
+			if( shard->thread == nullptr )
+			{
+				delete shard;
+				Stop( );
+				DebugWarning( "[spoof] Failed to create packet worker thread\n" );
+				return false;
+			}
+
+			shards.push_back( shard );
+		}
+
+		worker_count = static_cast<uint32_t>( shards.size( ) );
+		return true;
+	}
+
+	void WorkerPool::Stop( )
+	{
+		worker_count = 0;
+		running = false;
+		for( size_t k = 0; k < shards.size( ); ++k )
+			shards[k]->ready.Set( );
+
+		for( size_t k = 0; k < shards.size( ); ++k )
+		{
+			shard_t *shard = shards[k];
+			ThreadJoin( shard->thread );
+			ReleaseThreadHandle( shard->thread );
+			delete shard;
+		}
+
+		shards.clear( );
+	}
+
+	size_t WorkerPool::GetCount( ) const
+	{
+		return worker_count;
+	}
+
+	uint32_t WorkerPool::GetDropped( ) const
+	{
+		return dropped;
+	}
+
+	size_t WorkerPool::Dispatch( std::vector<packet_t> &batch )
+	{
+		size_t count = shards.size( ), lost = 0;
+		if( count == 0 )
+		{
+			lost = batch.size( );
+			batch.clear( );
+			dropped.fetch_add( static_cast<uint32_t>( lost ) );
+			return lost;
+		}
+
+		batch_shards.resize( batch.size( ) );
+		for( size_t k = 0; k < batch.size( ); ++k )
+			batch_shards[k] = GetShard( batch[k].address, count );
+
+		// one lock and one wake up per worker and batch, not per packet
+		for( size_t s = 0; s < count; ++s )
+		{
+			shard_t &shard = *shards[s];
+			bool added = false;
+
+			{
+				AUTO_LOCK( shard.mutex );
+				for( size_t k = 0; k < batch.size( ); ++k )
+				{
+					if( batch_shards[k] != s )
+						continue;
+
+					if( shard.pending.size( ) >= capacity )
+					{
+						++lost;
+						continue;
+					}
+
+					shard.pending.push_back( std::move( batch[k] ) );
+					added = true;
+				}
+			}
+
+			if( added )
+				shard.ready.Set( );
+		}
+
+		batch.clear( );
+		if( lost != 0 )
+			dropped.fetch_add( static_cast<uint32_t>( lost ) );
+
+		return lost;
+	}
+
+	size_t WorkerPool::GetShard( const sockaddr_in &address, size_t count )
+	{
+		// Fibonacci hashing, neighbouring addresses land on different workers
+		uint32_t hash = ntohl( address.sin_addr.s_addr ) * 2654435769U;
+		return static_cast<size_t>( ( static_cast<uint64_t>( hash ) * count ) >> 32 );
+	}
+
+	uint32_t WorkerPool::WorkerThread( void *param )
+	{
+		shard_t &shard = *static_cast<shard_t *>( param );
+		WorkerPool &pool = *shard.pool;
+
+		// new threads inherit the CPU set and realtime policy of whoever started
+		// them, usually the pinned receiver, which would put every worker on its cores
+		if( !scheduling::SetCurrentThreadAffinity( std::vector<int32_t>( ) ) ||
+			!scheduling::SetCurrentThreadPriority( scheduling::PolicyDefault, 0, 0 ) )
+			DebugWarning( "[spoof] Failed to reset packet worker thread scheduling\n" );
+
+		std::vector<packet_t> work;
+		work.reserve( pool.capacity );
+
+		while( true )
+		{
+			shard.ready.Wait( 100 );
+
+			{
+				AUTO_LOCK( shard.mutex );
+				work.swap( shard.pending );
+			}
+
+			// only leaves once everything dispatched to it was handled
+			if( work.empty( ) )
+			{
+				if( !pool.running )
+					break;
+
+				continue;
+			}
+
+			uint32_t lost = 0;
+			for( size_t k = 0; k < work.size( ); ++k )
+				if( !pool.handler( work[k] ) )
+					++lost;
+
+			if( lost != 0 )
+				pool.dropped.fetch_add( lost );
+
+			work.clear( );
+		}
+
+		return 0;
+	}
+}
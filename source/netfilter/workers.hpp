@@ -0,0 +1,69 @@
+#pragma once
+
+#include <netfilter/atomic.hpp>
+#include <netfilter/packet.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <threadtools.h>
+
+namespace netfilter
+{
+	// Threads that each own the packets of a slice of the source address space,
+	// every packet from an address goes through the same thread in arrival order.
+	class WorkerPool
+	{
+	public:
+		// returns false when the packet had to be dropped, which is counted
+		typedef bool ( *Handler )( packet_t &p );
+
+		static const size_t max_workers = 64;
+
+		// shard_capacity is the most packets that can wait for each worker
+		WorkerPool( Handler handler, size_t shard_capacity );
+		~WorkerPool( );
+
+		// Stops the current workers (after they finish their pending packets) and
+		// starts count new ones, 0 leaves the pool stopped.
+		bool Start( size_t count );
+		void Stop( );
+
+		size_t GetCount( ) const;
+		uint32_t GetDropped( ) const;
+
+		// Single producer, moves every packet to the worker owning its source and
+		// leaves batch empty. Returns how many were dropped because it was full.
+		// Dropped counts these and the ones the handler gave up on.
+		size_t Dispatch( std::vector<packet_t> &batch );
+
+		static size_t GetShard( const sockaddr_in &address, size_t count );
+
+	private:
+		struct shard_t
+		{
+			shard_t( WorkerPool *p ) :
+				pool( p ),
+				thread( nullptr )
+			{ }
+
+			WorkerPool *pool;
+			CThreadFastMutex mutex;
+			std::vector<packet_t> pending;
+			CThreadEvent ready;
+			ThreadHandle_t thread;
+		};
+
+		static uint32_t WorkerThread( void *param );
+
+		WorkerPool( const WorkerPool & );
+		WorkerPool &operator=( const WorkerPool & );
+
+		Handler handler;
+		size_t capacity;
+		std::vector<shard_t *> shards;
+		std::vector<size_t> batch_shards;
+		AtomicBool running;
+		Atomic<uint32_t> worker_count; // readable from any thread, unlike shards
+		Atomic<uint32_t> dropped;
+	};
+}
@@ -0,0 +1,681 @@
+// Loopback traffic generator for stress testing servers running the spoof module.
+// Sends a configurable mix of A2S queries, handshakes, malformed OOB packets and
+// netchannel-looking garbage from many source ports using sendmmsg, then reports
+// the achieved rate, reply rate, reply latency percentiles and amplification.
+// Replies are matched to the oldest query of a kind that could have caused them,
+// queries left unanswered for a second count as lost.
+//
+// usage: loadgen [-t host:port] [-p pps] [-d seconds] [-j threads] [-s sources]
+//                [-m info=40,player=20,rules=5,challenge=10,connect=5,malformed=10,netchan=10]
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+namespace loadgen
+{
+	enum PacketKind
+	{
+		KindInfo,
+		KindPlayer,
+		KindRules,
+		KindChallenge,
+		KindConnect,
+		KindMalformed,
+		KindNetchan,
+		KindCount
+	};
+
+	static const char *kind_names[KindCount] = {
+		"info",
+		"player",
+		"rules",
+		"challenge",
+		"connect",
+		"malformed",
+		"netchan"
+	};
+
+	// packets the server is expected to answer
+	static const bool kind_replies[KindCount] = {
+		true,
+		true,
+		true,
+		true,
+		true,
+		false,
+		false
+	};
+
+	static const size_t batch_size = 32;
+	static const size_t max_packet_size = 1400;
+	static const size_t max_outstanding = 4096; // per source and kind
+	static const uint64_t reply_timeout = 1000000000ULL;
+	static const size_t max_latency_samples = 1 << 20;
+
+	struct options_t
+	{
+		options_t( ) :
+			pps( 10000 ),
+			duration( 10 ),
+			threads( 2 ),
+			sources( 64 )
+		{
+			memset( &target, 0, sizeof( target ) );
+			target.sin_family = AF_INET;
+			target.sin_port = htons( 27015 );
+			target.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+			weights[KindInfo] = 40;
+			weights[KindPlayer] = 20;
+			weights[KindRules] = 5;
+			weights[KindChallenge] = 10;
+			weights[KindConnect] = 5;
+			weights[KindMalformed] = 10;
+			weights[KindNetchan] = 10;
+		}
+
+		sockaddr_in target;
+		uint64_t pps;
+		uint32_t duration;
+		uint32_t threads;
+		uint32_t sources;
+		uint32_t weights[KindCount];
+	};
+
+	struct source_t
+	{
+		int fd;
+		std::deque<uint64_t> outstanding[KindCount]; // send times of packets awaiting replies
+	};
+
+	struct worker_t
+	{
+		worker_t( ) :
+			sent( 0 ),
+			sent_bytes( 0 ),
+			replies( 0 ),
+			reply_bytes( 0 ),
+			lost( 0 ),
+			seen_replies( 0 ),
+			random( 0 )
+		{
+			memset( sent_kind, 0, sizeof( sent_kind ) );
+		}
+
+		std::atomic<uint64_t> sent;
+		std::atomic<uint64_t> sent_bytes;
+		std::atomic<uint64_t> replies;
+		std::atomic<uint64_t> reply_bytes;
+		uint64_t lost;
+		uint64_t sent_kind[KindCount];
+		uint64_t seen_replies;
+		std::vector<uint32_t> latencies; // microseconds
+		uint64_t random;
+		std::thread thread;
+	};
+
+	static std::atomic<bool> running( true );
+
+	inline uint64_t Now( )
+	{
+		timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		return now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+
+	// xorshift64*, every worker has its own state
+	inline uint64_t Random( uint64_t &state )
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	}
+
+	inline void WriteLong( char *data, int32_t value )
+	{
+		memcpy( data, &value, sizeof( value ) );
+	}
+
+	static size_t BuildPacket( PacketKind kind, char *data, uint64_t &random )
+	{
+		switch( kind )
+		{
+		case KindInfo:
+			WriteLong( data, -1 );
+			data[4] = 'T';
+			memcpy( data + 5, "Source Engine Query", 20 );
+			return 25;
+
+		case KindPlayer:
+		case KindRules:
+			WriteLong( data, -1 );
+			data[4] = kind == KindPlayer ? 'U' : 'V';
+			WriteLong( data + 5, -1 ); // challenge request
+			return 9;
+
+		case KindChallenge:
+			WriteLong( data, -1 );
+			data[4] = 'W';
+			return 5;
+
+		case KindConnect:
+			WriteLong( data, -1 );
+			data[4] = 'q';
+			WriteLong( data + 5, static_cast<int32_t>( Random( random ) ) );
+			memcpy( data + 9, "0000000000", 11 );
+			return 20;
+
+		case KindMalformed:
+			switch( Random( random ) % 4 )
+			{
+			case 0: // split packet channel
+				WriteLong( data, -2 );
+				for( size_t k = 4; k < 64; ++k )
+					data[k] = static_cast<char>( Random( random ) );
+				return 64;
+
+			case 1: // info request with a bad length
+				WriteLong( data, -1 );
+				data[4] = 'T';
+				memcpy( data + 5, "Source Engine Query", 20 );
+				return 30 + Random( random ) % 60; // 29 is one with a challenge
+
+			case 2: // oversized challenge request
+				WriteLong( data, -1 );
+				data[4] = 's';
+				memset( data + 5, 'A', 195 );
+				return 200;
+
+			default: // unknown OOB type
+				WriteLong( data, -1 );
+				data[4] = static_cast<char>( 'a' + Random( random ) % 6 );
+				return 5 + Random( random ) % 32;
+			}
+
+		case KindNetchan:
+		default:
+			{
+				// random sequence numbers never collide with the OOB channels
+				int32_t sequence = static_cast<int32_t>( Random( random ) & 0x7FFFFFFF );
+				WriteLong( data, sequence );
+				WriteLong( data + 4, sequence - 1 );
+				size_t len = 20 + Random( random ) % 180;
+				for( size_t k = 8; k < len; ++k )
+					data[k] = static_cast<char>( Random( random ) );
+				return len;
+			}
+		}
+	}
+
+	static PacketKind PickKind( const options_t &options, uint32_t total, uint64_t &random )
+	{
+		uint32_t pick = static_cast<uint32_t>( Random( random ) % total );
+		for( size_t k = 0; k < KindCount; ++k )
+		{
+			if( pick < options.weights[k] )
+				return static_cast<PacketKind>( k );
+
+			pick -= options.weights[k];
+		}
+
+		return KindNetchan;
+	}
+
+	static void RecordLatency( worker_t &worker, uint64_t ns )
+	{
+		uint32_t usec = static_cast<uint32_t>( std::min<uint64_t>( ns / 1000, 0xFFFFFFFF ) );
+		++worker.seen_replies;
+		if( worker.latencies.size( ) < max_latency_samples )
+		{
+			worker.latencies.push_back( usec );
+			return;
+		}
+
+		// reservoir sampling keeps the percentiles representative on long runs
+		uint64_t slot = Random( worker.random ) % worker.seen_replies;
+		if( slot < max_latency_samples )
+			worker.latencies[slot] = usec;
+	}
+
+	// Kinds a reply type can answer, challenges are sent in place of several.
+	static uint32_t GetAnsweredKinds( uint8_t type )
+	{
+		switch( type )
+		{
+		case 'I': // A2S_INFO reply
+			return 1 << KindInfo;
+
+		case 'D': // A2S_PLAYER reply
+			return 1 << KindPlayer;
+
+		case 'E': // A2S_RULES reply
+			return 1 << KindRules;
+
+		case 'A': // S2C_CHALLENGE
+			return 1 << KindInfo | 1 << KindPlayer | 1 << KindRules |
+				1 << KindChallenge | 1 << KindConnect;
+
+		case '9': // S2C_CONNREJECT
+		case 'B': // S2C_CONNECTION
+			return 1 << KindConnect;
+		}
+
+		return 0;
+	}
+
+	static void ExpireOutstanding( worker_t &worker, source_t &source, uint64_t now )
+	{
+		for( size_t k = 0; k < KindCount; ++k )
+		{
+			std::deque<uint64_t> &outstanding = source.outstanding[k];
+			while( !outstanding.empty( ) && now - outstanding.front( ) > reply_timeout )
+			{
+				outstanding.pop_front( );
+				++worker.lost;
+			}
+		}
+	}
+
+	// Pairs a reply with the oldest query it could answer, replies nothing is
+	// waiting for are still counted but not measured.
+	static void MatchReply( worker_t &worker, source_t &source, uint8_t type, uint64_t now )
+	{
+		uint32_t kinds = GetAnsweredKinds( type );
+		std::deque<uint64_t> *oldest = nullptr;
+		for( size_t k = 0; k < KindCount; ++k )
+		{
+			std::deque<uint64_t> &outstanding = source.outstanding[k];
+			if( ( kinds & 1 << k ) != 0 && !outstanding.empty( ) &&
+				( oldest == nullptr || outstanding.front( ) < oldest->front( ) ) )
+				oldest = &outstanding;
+		}
+
+		if( oldest == nullptr )
+			return;
+
+		RecordLatency( worker, now - oldest->front( ) );
+		oldest->pop_front( );
+	}
+
+	static void DrainReplies( worker_t &worker, source_t &source )
+	{
+		static __thread char buffers[batch_size][max_packet_size];
+		mmsghdr msgs[batch_size];
+		iovec iovs[batch_size];
+
+		while( true )
+		{
+			memset( msgs, 0, sizeof( msgs ) );
+			for( size_t k = 0; k < batch_size; ++k )
+			{
+				iovs[k].iov_base = buffers[k];
+				iovs[k].iov_len = max_packet_size;
+				msgs[k].msg_hdr.msg_iov = &iovs[k];
+				msgs[k].msg_hdr.msg_iovlen = 1;
+			}
+
+			int count = recvmmsg( source.fd, msgs, batch_size, MSG_DONTWAIT, nullptr );
+			if( count <= 0 )
+				return;
+
+			uint64_t now = Now( );
+			ExpireOutstanding( worker, source, now );
+			for( int k = 0; k < count; ++k )
+			{
+				size_t len = msgs[k].msg_len;
+				worker.reply_bytes += len;
+
+				// only the first fragment of a split reply counts as the reply, its
+				// payload starts after the 12 byte split header
+				int32_t header = 0;
+				if( len >= 4 )
+					memcpy( &header, buffers[k], sizeof( header ) );
+
+				size_t type_offset = 4;
+				if( header == -2 )
+				{
+					if( len >= 10 && buffers[k][9] != 0 )
+						continue;
+
+					type_offset = 16;
+				}
+
+				++worker.replies;
+				if( len > type_offset )
+					MatchReply( worker, source, static_cast<uint8_t>( buffers[k][type_offset] ), now );
+			}
+
+			if( count < static_cast<int>( batch_size ) )
+				return;
+		}
+	}
+
+	static void RunWorker( const options_t &options, worker_t &worker, uint64_t pps )
+	{
+		uint32_t total_weight = 0;
+		for( size_t k = 0; k < KindCount; ++k )
+			total_weight += options.weights[k];
+
+		int epfd = epoll_create( 1 );
+		std::vector<source_t> sources( options.sources );
+		for( size_t k = 0; k < sources.size( ); ++k )
+		{
+			// every socket gets its own ephemeral port, so the server sees many sources
+			sources[k].fd = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+			if( sources[k].fd == -1 ||
+				connect(
+					sources[k].fd,
+					reinterpret_cast<const sockaddr *>( &options.target ),
+					sizeof( options.target )
+				) == -1 )
+			{
+				fprintf( stderr, "failed to create source socket: %s\n", strerror( errno ) );
+				running = false;
+				return;
+			}
+
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.u64 = k;
+			epoll_ctl( epfd, EPOLL_CTL_ADD, sources[k].fd, &event );
+		}
+
+		static __thread char buffers[batch_size][max_packet_size];
+		mmsghdr msgs[batch_size];
+		iovec iovs[batch_size];
+		PacketKind kinds[batch_size];
+		epoll_event events[64];
+
+		uint64_t interval = pps != 0 ? batch_size * 1000000000ULL / pps : 0;
+		uint64_t next_send = Now( );
+		size_t next_source = 0;
+
+		while( running )
+		{
+			uint64_t now = Now( );
+			if( now >= next_send )
+			{
+				source_t &source = sources[next_source];
+				next_source = ( next_source + 1 ) % sources.size( );
+
+				memset( msgs, 0, sizeof( msgs ) );
+				for( size_t k = 0; k < batch_size; ++k )
+				{
+					kinds[k] = PickKind( options, total_weight, worker.random );
+					iovs[k].iov_base = buffers[k];
+					iovs[k].iov_len = BuildPacket( kinds[k], buffers[k], worker.random );
+					msgs[k].msg_hdr.msg_iov = &iovs[k];
+					msgs[k].msg_hdr.msg_iovlen = 1;
+				}
+
+				ExpireOutstanding( worker, source, now );
+
+				int count = sendmmsg( source.fd, msgs, batch_size, 0 );
+				for( int k = 0; k < count; ++k )
+				{
+					++worker.sent;
+					++worker.sent_kind[kinds[k]];
+					worker.sent_bytes += iovs[k].iov_len;
+
+					if( !kind_replies[kinds[k]] )
+						continue;
+
+					std::deque<uint64_t> &outstanding = source.outstanding[kinds[k]];
+					if( outstanding.size( ) >= max_outstanding )
+					{
+						outstanding.pop_front( );
+						++worker.lost;
+					}
+
+					outstanding.push_back( now );
+				}
+
+				next_send += interval;
+
+				// don't try to catch up on more than a second worth of batches
+				if( now > next_send + 1000000000ULL )
+					next_send = now;
+			}
+
+			int timeout = 0;
+			now = Now( );
+			if( next_send > now )
+				timeout = static_cast<int>( ( next_send - now ) / 1000000 );
+
+			int ready = epoll_wait( epfd, events, 64, timeout );
+			for( int k = 0; k < ready; ++k )
+				DrainReplies( worker, sources[events[k].data.u64] );
+		}
+
+		for( size_t k = 0; k < sources.size( ); ++k )
+		{
+			DrainReplies( worker, sources[k] );
+			for( size_t c = 0; c < KindCount; ++c )
+				worker.lost += sources[k].outstanding[c].size( );
+
+			close( sources[k].fd );
+		}
+
+		close( epfd );
+	}
+
+	static bool ParseTarget( const char *arg, sockaddr_in &target )
+	{
+		std::string host( arg );
+		size_t colon = host.find( ':' );
+		if( colon != host.npos )
+		{
+			target.sin_port = htons( static_cast<uint16_t>( atoi( host.c_str( ) + colon + 1 ) ) );
+			host.erase( colon );
+		}
+
+		return inet_pton( AF_INET, host.c_str( ), &target.sin_addr ) == 1;
+	}
+
+	static bool ParseMix( const char *arg, options_t &options )
+	{
+		memset( options.weights, 0, sizeof( options.weights ) );
+
+		std::string mix( arg );
+		size_t start = 0;
+		while( start < mix.size( ) )
+		{
+			size_t end = mix.find( ',', start );
+			if( end == mix.npos )
+				end = mix.size( );
+
+			std::string entry = mix.substr( start, end - start );
+			size_t equals = entry.find( '=' );
+			if( equals == entry.npos )
+				return false;
+
+			std::string name = entry.substr( 0, equals );
+			size_t k = 0;
+			for( ; k < KindCount; ++k )
+				if( name == kind_names[k] )
+					break;
+
+			if( k == KindCount )
+				return false;
+
+			options.weights[k] = static_cast<uint32_t>( atoi( entry.c_str( ) + equals + 1 ) );
+			start = end + 1;
+		}
+
+		uint32_t total = 0;
+		for( size_t k = 0; k < KindCount; ++k )
+			total += options.weights[k];
+
+		return total != 0;
+	}
+
+	static void PrintUsage( const char *name )
+	{
+		fprintf(
+			stderr,
+			"usage: %s [-t host:port] [-p pps] [-d seconds] [-j threads] [-s sources] [-m mix]\n"
+			"mix is a comma separated list of kind=weight, kinds are:\n"
+			"info, player, rules, challenge, connect, malformed, netchan\n",
+			name
+		);
+	}
+
+	inline uint32_t Percentile( const std::vector<uint32_t> &sorted, double p )
+	{
+		if( sorted.empty( ) )
+			return 0;
+
+		size_t index = static_cast<size_t>( p * ( sorted.size( ) - 1 ) );
+		return sorted[index];
+	}
+}
+
+int main( int argc, char **argv )
+{
+	using namespace loadgen;
+
+	options_t options;
+	int opt;
+	while( ( opt = getopt( argc, argv, "t:p:d:j:s:m:h" ) ) != -1 )
+		switch( opt )
+		{
+		case 't':
+			if( !ParseTarget( optarg, options.target ) )
+			{
+				fprintf( stderr, "invalid target '%s'\n", optarg );
+				return 1;
+			}
+
+			break;
+
+		case 'p':
+			options.pps = strtoull( optarg, nullptr, 10 );
+			break;
+
+		case 'd':
+			options.duration = static_cast<uint32_t>( atoi( optarg ) );
+			break;
+
+		case 'j':
+			options.threads = std::max( 1, atoi( optarg ) );
+			break;
+
+		case 's':
+			options.sources = std::max( 1, atoi( optarg ) );
+			break;
+
+		case 'm':
+			if( !ParseMix( optarg, options ) )
+			{
+				fprintf( stderr, "invalid mix '%s'\n", optarg );
+				return 1;
+			}
+
+			break;
+
+		default:
+			PrintUsage( argv[0] );
+			return 1;
+		}
+
+	std::vector<worker_t> workers( options.threads );
+	uint64_t started = Now( );
+	for( size_t k = 0; k < workers.size( ); ++k )
+	{
+		uint64_t pps = options.pps / options.threads;
+		if( k < options.pps % options.threads )
+			++pps;
+
+		workers[k].random = ( started ^ ( ( k + 1 ) * 0x9E3779B97F4A7C15ULL ) ) | 1;
+		workers[k].thread = std::thread( RunWorker, std::cref( options ), std::ref( workers[k] ), pps );
+	}
+
+	uint64_t last_sent = 0, last_replies = 0;
+	for( uint32_t second = 0; second < options.duration && running; ++second )
+	{
+		sleep( 1 );
+
+		uint64_t sent = 0, replies = 0;
+		for( size_t k = 0; k < workers.size( ); ++k )
+		{
+			sent += workers[k].sent;
+			replies += workers[k].replies;
+		}
+
+		printf(
+			"[%3u s] sent %llu pps, replies %llu pps\n",
+			second + 1,
+			static_cast<unsigned long long>( sent - last_sent ),
+			static_cast<unsigned long long>( replies - last_replies )
+		);
+		last_sent = sent;
+		last_replies = replies;
+	}
+
+	running = false;
+	for( size_t k = 0; k < workers.size( ); ++k )
+		workers[k].thread.join( );
+
+	double elapsed = ( Now( ) - started ) / 1000000000.0;
+
+	uint64_t sent = 0, sent_bytes = 0, replies = 0, reply_bytes = 0, lost = 0;
+	uint64_t sent_kind[KindCount] = { 0 };
+	std::vector<uint32_t> latencies;
+	for( size_t k = 0; k < workers.size( ); ++k )
+	{
+		worker_t &worker = workers[k];
+		sent += worker.sent;
+		sent_bytes += worker.sent_bytes;
+		replies += worker.replies;
+		reply_bytes += worker.reply_bytes;
+		lost += worker.lost;
+		for( size_t n = 0; n < KindCount; ++n )
+			sent_kind[n] += worker.sent_kind[n];
+
+		latencies.insert( latencies.end( ), worker.latencies.begin( ), worker.latencies.end( ) );
+	}
+
+	std::sort( latencies.begin( ), latencies.end( ) );
+
+	printf( "\nduration:      %.2f s\n", elapsed );
+	printf( "sent:          %llu packets, %.0f pps, %llu bytes\n",
+		static_cast<unsigned long long>( sent ),
+		sent / elapsed,
+		static_cast<unsigned long long>( sent_bytes ) );
+	for( size_t k = 0; k < KindCount; ++k )
+		printf( "  %-12s %llu\n", kind_names[k], static_cast<unsigned long long>( sent_kind[k] ) );
+
+	printf( "replies:       %llu, %.0f pps, %llu bytes, %llu unanswered\n",
+		static_cast<unsigned long long>( replies ),
+		replies / elapsed,
+		static_cast<unsigned long long>( reply_bytes ),
+		static_cast<unsigned long long>( lost ) );
+	printf( "latency (us):  p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+		Percentile( latencies, 0.5 ),
+		Percentile( latencies, 0.9 ),
+		Percentile( latencies, 0.99 ),
+		Percentile( latencies, 0.999 ),
+		latencies.empty( ) ? 0 : latencies.back( ) );
+	printf( "amplification: %.2fx (bytes out / bytes in)\n",
+		sent_bytes != 0 ? static_cast<double>( reply_bytes ) / sent_bytes : 0.0 );
+
+	return 0;
+}
@@ -0,0 +1,338 @@
+// Reader for the stats page published by spoof.OpenStatsPage, maps the file
+// read-only and takes seqlock consistent snapshots without involving the server.
+// Prints a summary or Prometheus text exposition format, once or every interval.
+//
+// usage: statsreader [-p] [-w milliseconds] path
+
+#include <netfilter/statspage.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace statsreader
+{
+	using netfilter::stats::page_t;
+
+	static const uint32_t max_attempts = 10000;
+
+	enum ReadResult
+	{
+		ReadOk,
+		ReadIncompatible,
+		ReadUnpublished,
+		ReadBusy
+	};
+
+	// Retries until the copy happened entirely between two publishes.
+	static ReadResult ReadPage( const page_t *mapped, page_t &page )
+	{
+		if( mapped->magic != netfilter::stats::page_magic ||
+			mapped->version != netfilter::stats::page_version ||
+			mapped->size != sizeof( page_t ) )
+			return ReadIncompatible;
+
+		for( uint32_t k = 0; k < max_attempts; ++k )
+		{
+			uint32_t before = __atomic_load_n( &mapped->sequence, __ATOMIC_ACQUIRE );
+			if( ( before & 1 ) != 0 )
+			{
+				// the module opens the page with an odd sequence until it publishes
+				if( mapped->updated == 0 )
+					return ReadUnpublished;
+
+				continue;
+			}
+
+			memcpy( &page, mapped, sizeof( page ) );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &mapped->sequence, __ATOMIC_RELAXED ) == before )
+				return ReadOk;
+		}
+
+		return ReadBusy;
+	}
+
+	inline unsigned long long ULL( uint64_t value )
+	{
+		return static_cast<unsigned long long>( value );
+	}
+
+	// Upper bound of the bucket holding the given fraction of the samples.
+	static uint64_t Quantile( const netfilter::stats::histogram_t &histogram, double fraction )
+	{
+		uint64_t target = static_cast<uint64_t>( histogram.count * fraction + 0.999999 ), seen = 0;
+		for( uint32_t k = 0; k < netfilter::stats::bucket_count; ++k )
+		{
+			seen += histogram.buckets[k];
+			if( seen >= target && seen != 0 )
+				return 2ULL << k;
+		}
+
+		return 2ULL << ( netfilter::stats::bucket_count - 1 );
+	}
+
+	static void PrintSummary( const page_t &page )
+	{
+		using namespace netfilter::stats;
+
+		printf( "pid %u, updated %llu ms (unix)\n", page.pid, ULL( page.updated ) );
+
+		printf( "totals:" );
+		for( uint32_t c = 0; c < counter_count; ++c )
+			printf( " %s %llu", counter_names[c], ULL( page.counters[c] ) );
+
+		printf( "\nworkers %u, worker drops %llu, coalesced handshakes %llu\n",
+			page.workers,
+			ULL( page.worker_dropped ),
+			ULL( page.handshakes_coalesced ) );
+
+		printf( "egress: %llu bytes in, %llu bytes out, %llu replies, %llu challenges, %llu dropped\n",
+			ULL( page.egress_bytes_in ),
+			ULL( page.egress_bytes_out ),
+			ULL( page.egress_replies ),
+			ULL( page.egress_challenges ),
+			ULL( page.egress_dropped ) );
+
+		for( uint32_t k = 0; k < page.socket_count && k < max_sockets; ++k )
+		{
+			const socket_stats_t &socket = page.sockets[k];
+			printf( "socket %d port %d: queued %u, answers queries %s, info cache age ",
+				socket.index,
+				socket.port,
+				socket.queued,
+				socket.answer_queries != 0 ? "yes" : "no" );
+
+			if( socket.info_cache_age == 0xFFFFFFFF )
+				printf( "never built" );
+			else
+				printf( "%u ms", socket.info_cache_age );
+
+			printf( ", player cache age " );
+			if( socket.player_cache_age == 0xFFFFFFFF )
+				printf( "never built" );
+			else
+				printf( "%u ms", socket.player_cache_age );
+
+			printf( "\n" );
+			for( uint32_t c = 0; c < counter_count; ++c )
+				printf( " %s %llu", counter_names[c], ULL( socket.counters[c] ) );
+
+			printf( "\n" );
+		}
+
+		for( uint32_t stage = 0; stage < stage_count; ++stage )
+			for( uint32_t type = 0; type < class_count; ++type )
+			{
+				const histogram_t &histogram = page.latency[stage][type];
+				if( histogram.count == 0 )
+					continue;
+
+				printf( "latency %s/%s: %llu samples, avg %llu ns, p50 < %llu ns, p99 < %llu ns\n",
+					stage_names[stage],
+					class_names[type],
+					ULL( histogram.count ),
+					ULL( histogram.total / histogram.count ),
+					ULL( Quantile( histogram, 0.5 ) ),
+					ULL( Quantile( histogram, 0.99 ) ) );
+			}
+
+		if( page.wakeup_count != 0 )
+			printf( "wakeup latency: %llu samples, min %llu ns, avg %llu ns, max %llu ns\n",
+				ULL( page.wakeup_count ),
+				ULL( page.wakeup_min ),
+				ULL( page.wakeup_total / page.wakeup_count ),
+				ULL( page.wakeup_max ) );
+	}
+
+	static void PrintPrometheus( const page_t &page )
+	{
+		using namespace netfilter::stats;
+
+		printf( "# TYPE spoof_packets_total counter\n" );
+		for( uint32_t k = 0; k < page.socket_count && k < max_sockets; ++k )
+		{
+			const socket_stats_t &socket = page.sockets[k];
+			for( uint32_t c = 0; c < counter_count; ++c )
+				printf( "spoof_packets_total{port=\"%d\",counter=\"%s\"} %llu\n",
+					socket.port,
+					counter_names[c],
+					ULL( socket.counters[c] ) );
+		}
+
+		printf( "# TYPE spoof_queue_depth gauge\n" );
+		for( uint32_t k = 0; k < page.socket_count && k < max_sockets; ++k )
+			printf( "spoof_queue_depth{port=\"%d\"} %u\n",
+				page.sockets[k].port,
+				page.sockets[k].queued );
+
+		printf( "# TYPE spoof_cache_age_seconds gauge\n" );
+		for( uint32_t k = 0; k < page.socket_count && k < max_sockets; ++k )
+		{
+			const socket_stats_t &socket = page.sockets[k];
+			if( socket.info_cache_age != 0xFFFFFFFF )
+				printf( "spoof_cache_age_seconds{port=\"%d\",cache=\"info\"} %.3f\n",
+					socket.port,
+					socket.info_cache_age / 1000.0 );
+
+			if( socket.player_cache_age != 0xFFFFFFFF )
+				printf( "spoof_cache_age_seconds{port=\"%d\",cache=\"player\"} %.3f\n",
+					socket.port,
+					socket.player_cache_age / 1000.0 );
+		}
+
+		printf( "# TYPE spoof_workers gauge\nspoof_workers %u\n", page.workers );
+		printf( "# TYPE spoof_worker_dropped_total counter\nspoof_worker_dropped_total %llu\n",
+			ULL( page.worker_dropped ) );
+		printf( "# TYPE spoof_handshakes_coalesced_total counter\n"
+			"spoof_handshakes_coalesced_total %llu\n",
+			ULL( page.handshakes_coalesced ) );
+
+		printf( "# TYPE spoof_egress_bytes_total counter\n" );
+		printf( "spoof_egress_bytes_total{direction=\"in\"} %llu\n", ULL( page.egress_bytes_in ) );
+		printf( "spoof_egress_bytes_total{direction=\"out\"} %llu\n", ULL( page.egress_bytes_out ) );
+		printf( "# TYPE spoof_egress_replies_total counter\n" );
+		printf( "spoof_egress_replies_total{outcome=\"reply\"} %llu\n", ULL( page.egress_replies ) );
+		printf( "spoof_egress_replies_total{outcome=\"challenge\"} %llu\n",
+			ULL( page.egress_challenges ) );
+		printf( "spoof_egress_replies_total{outcome=\"dropped\"} %llu\n",
+			ULL( page.egress_dropped ) );
+
+		printf( "# TYPE spoof_latency_seconds histogram\n" );
+		for( uint32_t stage = 0; stage < stage_count; ++stage )
+			for( uint32_t type = 0; type < class_count; ++type )
+			{
+				const histogram_t &histogram = page.latency[stage][type];
+				uint64_t cumulative = 0;
+				for( uint32_t b = 0; b + 1 < bucket_count; ++b )
+				{
+					cumulative += histogram.buckets[b];
+					printf(
+						"spoof_latency_seconds_bucket{stage=\"%s\",class=\"%s\",le=\"%.9g\"} %llu\n",
+						stage_names[stage],
+						class_names[type],
+						( 2ULL << b ) / 1000000000.0,
+						ULL( cumulative )
+					);
+				}
+
+				printf( "spoof_latency_seconds_bucket{stage=\"%s\",class=\"%s\",le=\"+Inf\"} %llu\n",
+					stage_names[stage],
+					class_names[type],
+					ULL( histogram.count ) );
+				printf( "spoof_latency_seconds_sum{stage=\"%s\",class=\"%s\"} %.9f\n",
+					stage_names[stage],
+					class_names[type],
+					histogram.total / 1000000000.0 );
+				printf( "spoof_latency_seconds_count{stage=\"%s\",class=\"%s\"} %llu\n",
+					stage_names[stage],
+					class_names[type],
+					ULL( histogram.count ) );
+			}
+
+		printf( "# TYPE spoof_wakeup_latency_seconds summary\n" );
+		printf( "spoof_wakeup_latency_seconds_sum %.9f\n", page.wakeup_total / 1000000000.0 );
+		printf( "spoof_wakeup_latency_seconds_count %llu\n", ULL( page.wakeup_count ) );
+	}
+
+	static void PrintUsage( const char *name )
+	{
+		fprintf( stderr, "usage: %s [-p] [-w milliseconds] path\n", name );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	using namespace statsreader;
+
+	bool prometheus = false;
+	uint32_t interval = 0;
+	int opt;
+	while( ( opt = getopt( argc, argv, "pw:h" ) ) != -1 )
+		switch( opt )
+		{
+		case 'p':
+			prometheus = true;
+			break;
+
+		case 'w':
+			interval = static_cast<uint32_t>( atoi( optarg ) );
+			break;
+
+		default:
+			PrintUsage( argv[0] );
+			return 1;
+		}
+
+	if( optind + 1 != argc )
+	{
+		PrintUsage( argv[0] );
+		return 1;
+	}
+
+	int fd = open( argv[optind], O_RDONLY );
+	if( fd == -1 )
+	{
+		fprintf( stderr, "failed to open '%s'\n", argv[optind] );
+		return 1;
+	}
+
+	struct stat info;
+	if( fstat( fd, &info ) == -1 || info.st_size < static_cast<off_t>( sizeof( page_t ) ) )
+	{
+		close( fd );
+		fprintf( stderr, "'%s' is not a stats page\n", argv[optind] );
+		return 1;
+	}
+
+	void *memory = mmap( nullptr, sizeof( page_t ), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( memory == MAP_FAILED )
+	{
+		fprintf( stderr, "failed to map '%s'\n", argv[optind] );
+		return 1;
+	}
+
+	const page_t *mapped = static_cast<const page_t *>( memory );
+	page_t page;
+	while( true )
+	{
+		switch( ReadPage( mapped, page ) )
+		{
+		case ReadOk:
+			if( prometheus )
+				PrintPrometheus( page );
+			else
+				PrintSummary( page );
+
+			fflush( stdout );
+			break;
+
+		case ReadIncompatible:
+			fprintf( stderr, "stats page has an incompatible layout\n" );
+			return 1;
+
+		case ReadUnpublished:
+			fprintf( stderr, "nothing was published to the stats page yet\n" );
+			break;
+
+		case ReadBusy:
+			fprintf( stderr, "stats page kept changing while reading it\n" );
+			break;
+		}
+
+		if( interval == 0 )
+			break;
+
+		usleep( interval * 1000 );
+	}
+
+	munmap( memory, sizeof( page_t ) );
+	return 0;
+}